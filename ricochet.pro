@@ -171,11 +171,13 @@ SOURCES += src/main.cpp \
     src/tor/SetConfCommand.cpp \
     src/tor/AddOnionCommand.cpp \
     src/utils/StringUtil.cpp \
+    src/utils/Utf8.cpp \
     src/core/ContactsManager.cpp \
     src/core/ContactUser.cpp \
     src/tor/GetConfCommand.cpp \
     src/tor/HiddenService.cpp \
     src/utils/CryptoKey.cpp \
+    src/utils/Base32.cpp \
     src/utils/SecureRNG.cpp \
     src/core/OutgoingContactRequest.cpp \
     src/core/IncomingRequestManager.cpp \
@@ -201,11 +203,13 @@ HEADERS += src/ui/MainWindow.h \
     src/tor/SetConfCommand.h \
     src/tor/AddOnionCommand.h \
     src/utils/StringUtil.h \
+    src/utils/Utf8.h \
     src/core/ContactsManager.h \
     src/core/ContactUser.h \
     src/tor/GetConfCommand.h \
     src/tor/HiddenService.h \
     src/utils/CryptoKey.h \
+    src/utils/Base32.h \
     src/utils/SecureRNG.h \
     src/core/OutgoingContactRequest.h \
     src/core/IncomingRequestManager.h \
@@ -228,7 +232,12 @@ SOURCES += src/protocol/Channel.cpp \
     src/protocol/OutboundConnector.cpp \
     src/protocol/AuthHiddenServiceChannel.cpp \
     src/protocol/ChatChannel.cpp \
-    src/protocol/ContactRequestChannel.cpp
+    src/protocol/ContactRequestChannel.cpp \
+    src/protocol/ChannelIdAllocator.cpp \
+    src/protocol/ChatPacket.cpp \
+    src/protocol/PacketHeader.cpp \
+    src/protocol/PacketCompression.cpp \
+    src/protocol/ResumptionTicket.cpp
 
 HEADERS += src/protocol/Channel.h \
     src/protocol/Channel_p.h \
@@ -238,9 +247,15 @@ HEADERS += src/protocol/Channel.h \
     src/protocol/OutboundConnector.h \
     src/protocol/AuthHiddenServiceChannel.h \
     src/protocol/ChatChannel.h \
-    src/protocol/ContactRequestChannel.h
+    src/protocol/ContactRequestChannel.h \
+    src/protocol/ChannelIdAllocator.h \
+    src/protocol/ChatPacket.h \
+    src/protocol/PacketHeader.h \
+    src/protocol/PacketCompression.h \
+    src/protocol/ResumptionTicket.h
 
 include(protobuf.pri)
+include(zlib.pri)
 PROTOS += src/protocol/ControlChannel.proto \
     src/protocol/AuthHiddenService.proto \
     src/protocol/ChatChannel.proto \
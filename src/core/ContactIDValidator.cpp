@@ -31,8 +31,9 @@
  */
 
 #include "ContactIDValidator.h"
+#include "utils/CryptoKey.h"
 
-static QRegularExpression regex(QStringLiteral("(torsion|ricochet):([a-z2-7]{16})"));
+static QRegularExpression regex(QStringLiteral("(torsion|ricochet):([a-z2-7]{56}|[a-z2-7]{16})"));
 
 ContactIDValidator::ContactIDValidator(QObject *parent)
     : QRegularExpressionValidator(parent), m_uniqueIdentity(0)
@@ -54,6 +55,12 @@ QValidator::State ContactIDValidator::validate(QString &text, int &pos) const
         return re;
     }
 
+    // Version 3 IDs carry a checksum, which catches most typing mistakes
+    if (!isValidID(text)) {
+        emit failed();
+        return QValidator::Invalid;
+    }
+
     if (matchingContact(text) || matchesIdentity(text)) {
         emit failed();
         return QValidator::Invalid;
@@ -82,13 +89,14 @@ void ContactIDValidator::fixup(QString &text) const
 
 bool ContactIDValidator::isValidID(const QString &text)
 {
-    return regex.match(text).hasMatch();
+    QRegularExpressionMatch match = regex.match(text);
+    return match.hasMatch() && CryptoKey::isValidServiceID(match.captured(2));
 }
 
 QString ContactIDValidator::hostnameFromID(const QString &ID)
 {
     QRegularExpressionMatch match = regex.match(ID);
-    if (!match.hasMatch())
+    if (!match.hasMatch() || !CryptoKey::isValidServiceID(match.captured(2)))
         return QString();
 
     return match.captured(2) + QStringLiteral(".onion");
@@ -98,9 +106,10 @@ QString ContactIDValidator::idFromHostname(const QString &hostname)
 {
     QString re = hostname;
 
-    if (re.size() != 16)
+    // Version 2 or version 3 onion hostnames, with or without the suffix
+    if (re.size() != 16 && re.size() != 56)
     {
-        if (re.size() == 22 && re.toLower().endsWith(QLatin1String(".onion")))
+        if ((re.size() == 22 || re.size() == 62) && re.toLower().endsWith(QLatin1String(".onion")))
             re.chop(6);
         else
             return QString();
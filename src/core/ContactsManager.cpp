@@ -81,6 +81,7 @@ ContactUser *ContactsManager::addContact(const QString &nickname)
     ContactUser *user = ContactUser::addNewContact(identity, highestID);
     user->setParent(this);
     user->setNickname(nickname);
+    user->settings()->flush();
     connectSignals(user);
 
     qDebug() << "Added new contact" << nickname << "with ID" << user->uniqueID;
@@ -115,6 +116,7 @@ ContactUser *ContactsManager::createContactRequest(const QString &contactid, con
     user->setHostname(ContactIDValidator::hostnameFromID(contactid));
 
     OutgoingContactRequest::createNewRequest(user, myNickname, message);
+    user->settings()->flush();
 
     /* Signal deferred from addContact to avoid changing the status immediately */
     Q_ASSERT(user->status() == ContactUser::RequestPending);
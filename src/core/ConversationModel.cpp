@@ -33,6 +33,7 @@
 #include "ConversationModel.h"
 #include "protocol/Connection.h"
 #include "protocol/ChatChannel.h"
+#include "utils/Settings.h"
 #include <QDebug>
 
 ConversationModel::ConversationModel(QObject *parent)
@@ -61,7 +62,12 @@ void ConversationModel::setContact(ContactUser *contact)
 
                 if (chat->direction() == Protocol::Channel::Outbound) {
                     connect(chat, &Protocol::Channel::invalidated, this, &ConversationModel::outboundChannelClosed);
+                    connect(chat, &Protocol::Channel::writable, this, &ConversationModel::sendQueuedMessages);
                     sendQueuedMessages();
+                } else {
+                    // How long acknowledgements for received messages may be held to combine them
+                    SettingsObject settings(QStringLiteral("chat"));
+                    chat->setAcknowledgeDelay(settings.read("acknowledgeDelay", Protocol::ChatChannel::DefaultAcknowledgeDelay).toInt());
                 }
             }
         };
@@ -103,7 +109,8 @@ void ConversationModel::sendMessage(const QString &text)
             }
         }
 
-        if (channel && channel->isOpened()) {
+        // If the channel is backlogged, the message stays queued until it's writable
+        if (channel && channel->isOpened() && channel->canWrite()) {
             MessageId id = 0;
             if (channel->sendChatMessage(text, QDateTime(), id))
                 message.status = Sending;
@@ -150,9 +157,15 @@ void ConversationModel::sendQueuedMessages()
     if (!channel->isOpened())
         return;
 
-    // Iterate backwards, from oldest to newest messages
+    // Iterate backwards, from oldest to newest messages. Stop when the channel
+    // is backlogged; the rest are sent when it emits writable. If the peer
+    // supports it, the messages are combined into as few packets as possible.
+    channel->beginBatch();
     for (int i = messages.size() - 1; i >= 0; i--) {
         if (messages[i].status == Queued) {
+            if (!channel->canWrite())
+                break;
+
             qDebug() << "Sending queued chat message";
             bool ok = false;
             if (messages[i].identifier)
@@ -167,6 +180,11 @@ void ConversationModel::sendQueuedMessages()
             emit dataChanged(index(i, 0), index(i, 0));
         }
     }
+
+    // This only fails if the connection has closed, and messages that were
+    // Sending are queued again when the channel is invalidated
+    if (!channel->endBatch())
+        qDebug() << "Sending batch of queued chat messages failed";
 }
 
 void ConversationModel::messageReceived(const QString &text, const QDateTime &time, MessageId id)
@@ -75,14 +75,20 @@ void IdentityManager::loadFromSettings()
     }
     else
     {
-        /* No identities exist (probably inital run); create one */
-        createIdentity();
+        /* No identities exist (probably inital run); create one. Version 3
+         * (Ed25519) identities are opt-in, because they can't be reached by
+         * contacts on older versions. */
+        CryptoKey::KeyAlgorithm algorithm = CryptoKey::RSA1024;
+        if (!qgetenv("RICOCHET_V3_IDENTITY").isEmpty())
+            algorithm = CryptoKey::Ed25519;
+        createIdentity(QString(), QString(), algorithm);
     }
 }
 
-UserIdentity *IdentityManager::createIdentity(const QString &serviceDirectory, const QString &nickname)
+UserIdentity *IdentityManager::createIdentity(const QString &serviceDirectory, const QString &nickname,
+                                              CryptoKey::KeyAlgorithm algorithm)
 {
-    UserIdentity *identity = UserIdentity::createIdentity(++highestID, serviceDirectory);
+    UserIdentity *identity = UserIdentity::createIdentity(++highestID, serviceDirectory, algorithm);
     if (!identity)
         return identity;
 
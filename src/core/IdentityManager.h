@@ -50,7 +50,8 @@ public:
     UserIdentity *lookupHostname(const QString &hostname) const;
     UserIdentity *lookupUniqueID(int uniqueID) const;
 
-    UserIdentity *createIdentity(const QString &serviceDirectory = QString(), const QString &nickname = QString());
+    UserIdentity *createIdentity(const QString &serviceDirectory = QString(), const QString &nickname = QString(),
+                                 CryptoKey::KeyAlgorithm algorithm = CryptoKey::RSA1024);
 
 signals:
     void identityAdded(UserIdentity *identity);
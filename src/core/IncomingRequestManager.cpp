@@ -224,6 +224,7 @@ void IncomingContactRequest::save()
 
     settings.write("requestDate", m_requestDate);
     settings.write("lastRequestDate", m_lastRequestDate);
+    settings.flush();
 }
 
 void IncomingContactRequest::renew()
@@ -340,6 +341,7 @@ void IncomingContactRequest::accept(ContactUser *user)
     // Remove the request
     removeRequest();
     manager->removeRequest(this);
+    user->settings()->flush();
 
     user->updateStatus();
 }
@@ -43,6 +43,25 @@
 
 using namespace Protocol;
 
+// Ed25519 keys are stored as their seed, with a prefix; RSA keys are plain DER
+static const char ed25519KeyPrefix[] = "ed25519:";
+
+static QString encodeServiceKey(const CryptoKey &key)
+{
+    if (key.algorithm() == CryptoKey::Ed25519)
+        return QLatin1String(ed25519KeyPrefix) + QString::fromLatin1(key.encodedPrivateKey(CryptoKey::Raw).toBase64());
+    return QString::fromLatin1(key.encodedPrivateKey(CryptoKey::DER).toBase64());
+}
+
+static bool decodeServiceKey(const QString &data, CryptoKey *key)
+{
+    if (data.startsWith(QLatin1String(ed25519KeyPrefix))) {
+        QByteArray seed = QByteArray::fromBase64(data.mid(int(sizeof(ed25519KeyPrefix)) - 1).toLatin1());
+        return key->loadFromData(seed, CryptoKey::PrivateKey, CryptoKey::Raw);
+    }
+    return key->loadFromData(QByteArray::fromBase64(data.toLatin1()), CryptoKey::PrivateKey, CryptoKey::DER);
+}
+
 UserIdentity::UserIdentity(int id, QObject *parent)
     : QObject(parent)
     , uniqueID(id)
@@ -59,7 +78,8 @@ UserIdentity::UserIdentity(int id, QObject *parent)
     contacts.loadFromSettings();
 }
 
-UserIdentity *UserIdentity::createIdentity(int uniqueID, const QString &dataDirectory)
+UserIdentity *UserIdentity::createIdentity(int uniqueID, const QString &dataDirectory,
+                                           CryptoKey::KeyAlgorithm algorithm)
 {
     // There is actually no support for multiple identities currently.
     Q_ASSERT(uniqueID == 0);
@@ -73,6 +93,17 @@ UserIdentity *UserIdentity::createIdentity(int uniqueID, const QString &dataDire
     else
         settings.write("dataDirectory", dataDirectory);
 
+    if (algorithm == CryptoKey::Ed25519) {
+        CryptoKey key;
+        if (!key.generateEd25519()) {
+            qWarning() << "Cannot create a version 3 identity";
+            return 0;
+        }
+
+        settings.write("serviceKey", encodeServiceKey(key));
+        settings.flush();
+    }
+
     return new UserIdentity(uniqueID);
 }
 
@@ -84,7 +115,7 @@ void UserIdentity::setupService()
 
     if (!keyData.isEmpty()) {
         CryptoKey key;
-        if (!key.loadFromData(QByteArray::fromBase64(keyData.toLatin1()), CryptoKey::PrivateKey, CryptoKey::DER)) {
+        if (!decodeServiceKey(keyData, &key)) {
             qWarning() << "Cannot load service key from configuration";
             return;
         }
@@ -98,8 +129,8 @@ void UserIdentity::setupService()
             qWarning() << "Cannot load legacy format key from" << legacyDir << "for conversion";
             return;
         } else {
-            keyData = QString::fromLatin1(key.encodedPrivateKey(CryptoKey::DER).toBase64());
-            m_settings->write("serviceKey", keyData);
+            m_settings->write("serviceKey", encodeServiceKey(key));
+            m_settings->flush();
             m_hiddenService = new Tor::HiddenService(key, legacyDir, this);
         }
     } else if (!m_settings->read("initializing").toBool()) {
@@ -109,8 +140,8 @@ void UserIdentity::setupService()
         m_hiddenService = new Tor::HiddenService(legacyDir, this);
         connect(m_hiddenService, &Tor::HiddenService::privateKeyChanged, this,
             [&]() {
-                QString key = QString::fromLatin1(m_hiddenService->privateKey().encodedPrivateKey(CryptoKey::DER).toBase64());
-                m_settings->write("serviceKey", key);
+                m_settings->write("serviceKey", encodeServiceKey(m_hiddenService->privateKey()));
+                m_settings->flush();
             }
         );
     }
@@ -34,6 +34,7 @@
 #define USERIDENTITY_H
 
 #include "ContactsManager.h"
+#include "utils/CryptoKey.h"
 #include <QObject>
 #include <QMetaType>
 #include <QVector>
@@ -119,7 +120,11 @@ private:
     QTcpServer *m_incomingServer;
     QVector<QSharedPointer<Protocol::Connection>> m_incomingConnections;
 
-    static UserIdentity *createIdentity(int uniqueID, const QString &dataDirectory = QString());
+    /* Tor generates an RSA1024 key for the identity once it's online;
+     * Ed25519 keys are generated here, because OpenSSL can't sign with the
+     * expanded form of the key that Tor would return. */
+    static UserIdentity *createIdentity(int uniqueID, const QString &dataDirectory = QString(),
+                                        CryptoKey::KeyAlgorithm algorithm = CryptoKey::RSA1024);
 
     void handleIncomingAuthedConnection(Protocol::Connection *connection);
     void setupService();
@@ -73,6 +73,9 @@ int main(int argc, char *argv[])
     a.setWindowIcon(QIcon(QStringLiteral(":/icons/ricochet_refresh.svg")));
 #endif
 
+    /* The settings are destroyed first, so pending changes are written and
+     * the journal is compacted while the profile is still locked. */
+    QScopedPointer<QLockFile> lockFile;
     QScopedPointer<SettingsFile> settings(new SettingsFile);
     SettingsObject::setDefaultFile(settings.data());
 
@@ -82,7 +85,7 @@ int main(int argc, char *argv[])
         QMessageBox::critical(0, qApp->translate("Main", "Ricochet Error"), error);
         return 1;
     }
-    QScopedPointer<QLockFile> lockFile(lock);
+    lockFile.reset(lock);
 
     initTranslation();
 
@@ -213,6 +216,8 @@ static bool initSettings(SettingsFile *settings, QLockFile **lockFile, QString &
         }
     }
 
+    // Changes are appended to a journal, instead of rewriting the whole file each time
+    settings->setJournaled(true);
     settings->setFilePath(dir.filePath(QStringLiteral("ricochet.json")));
     if (settings->hasError()) {
         errorMessage = settings->errorMessage();
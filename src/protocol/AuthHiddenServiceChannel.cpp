@@ -31,6 +31,7 @@
  */
 
 #include "AuthHiddenServiceChannel.h"
+#include "ResumptionTicket.h"
 #include "AuthHiddenService.pb.h"
 #include "Connection.h"
 #include "Channel_p.h"
@@ -38,9 +39,125 @@
 #include "utils/CryptoKey.h"
 #include "utils/Useful.h"
 #include <QMessageAuthenticationCode>
+#include <QDateTime>
+#include <QMultiMap>
+#include <QSet>
+#include <QtEndian>
+#include <QSharedPointer>
+#include <openssl/crypto.h>
 
 using namespace Protocol;
 
+constexpr const char *AuthHiddenServiceChannel::TypeName;
+constexpr const char *AuthHiddenServiceChannel::OneRoundTripFeature;
+
+namespace {
+
+// Appended to the proof data of a client_proof, which is signed without a server cookie
+const char OneRoundTripLabel[] = "im.ricochet.auth.one-round-trip";
+// Appended to the proof data of a resumption, which is an HMAC keyed by the ticket's secret
+const char ResumptionLabel[] = "im.ricochet.auth.resumption";
+
+/* Client cookies from accepted client_proof and resumption requests
+ *
+ * Each cookie is only accepted once. Cookies are kept until their timestamp
+ * is too old to be accepted anyway. If the cache is full, proofs are refused
+ * and the client authenticates with a server cookie instead.
+ */
+class ProofReplayCache
+{
+public:
+    static const int MaxEntries = 10000;
+
+    bool insert(const QByteArray &cookie, qint64 timestamp, qint64 now)
+    {
+        while (!byTimestamp.isEmpty() && byTimestamp.firstKey() < now - AuthHiddenServiceChannel::MaxProofClockSkew) {
+            cookies.remove(byTimestamp.first());
+            byTimestamp.erase(byTimestamp.begin());
+        }
+
+        if (cookies.contains(cookie) || cookies.size() >= MaxEntries)
+            return false;
+
+        cookies.insert(cookie);
+        byTimestamp.insert(timestamp, cookie);
+        return true;
+    }
+
+private:
+    QSet<QByteArray> cookies;
+    QMultiMap<qint64,QByteArray> byTimestamp;
+};
+
+ProofReplayCache &proofReplayCache()
+{
+    static ProofReplayCache cache;
+    return cache;
+}
+
+// Resumption ticket keys for each of our hidden service identities
+ResumptionTicketKeys &ticketKeys(const QString &hostname)
+{
+    static QHash<QString,QSharedPointer<ResumptionTicketKeys>> keys;
+    QSharedPointer<ResumptionTicketKeys> &ptr = keys[hostname];
+    if (!ptr)
+        ptr.reset(new ResumptionTicketKeys);
+    return *ptr;
+}
+
+struct ClientTicket
+{
+    QByteArray ticket;
+    QByteArray secret;
+    quint64 expiry;
+
+    ClientTicket() : expiry(0) { }
+};
+
+// Resumption tickets received from servers, by the proof data for our hostname and theirs
+QHash<QByteArray,ClientTicket> &clientTickets()
+{
+    static QHash<QByteArray,ClientTicket> tickets;
+    return tickets;
+}
+
+// The unexpired ticket for 'proofData', or null
+const ClientTicket *findClientTicket(const QByteArray &proofData, quint64 now)
+{
+    QHash<QByteArray,ClientTicket>::iterator ticket = clientTickets().find(proofData);
+    if (ticket == clientTickets().end() || proofData.isEmpty())
+        return 0;
+    if (ticket->expiry <= now) {
+        clientTickets().erase(ticket);
+        return 0;
+    }
+    return &ticket.value();
+}
+
+// True if a proof's timestamp is within MaxProofClockSkew of 'now'
+bool isRecent(quint64 timestamp, quint64 now)
+{
+    const quint64 maxSkew = AuthHiddenServiceChannel::MaxProofClockSkew;
+    return timestamp <= now + maxSkew && timestamp + maxSkew >= now;
+}
+
+QByteArray timestampSuffix(const QByteArray &label, quint64 timestamp)
+{
+    QByteArray suffix = label;
+    uchar buf[8];
+    qToBigEndian(timestamp, buf);
+    suffix.append(reinterpret_cast<const char*>(buf), sizeof(buf));
+    return suffix;
+}
+
+// The public_key of a proof; raw for Ed25519 keys, or DER for RSA
+QByteArray encodedProofKey(const CryptoKey &key)
+{
+    return key.encodedPublicKey(key.algorithm() == CryptoKey::Ed25519 ? CryptoKey::Raw : CryptoKey::DER);
+}
+
+}
+
 namespace Protocol {
 
 class AuthHiddenServiceChannelPrivate : public ChannelPrivate
@@ -48,15 +165,40 @@ class AuthHiddenServiceChannelPrivate : public ChannelPrivate
 public:
     CryptoKey privateKey;
     QByteArray clientCookie, serverCookie;
+    // One round trip proof from prepareOneRoundTrip, for clientCookie
+    QByteArray proofPublicKey, proofSignature;
+    quint64 proofTimestamp;
     bool accepted;
+    bool isOneRoundTrip;
+    bool isResuming;
+    // A signature is being created or verified on a worker thread
+    bool isWaitingForCrypto;
 
     AuthHiddenServiceChannelPrivate(Channel *q, Channel::Direction direction, Connection *conn)
-        : ChannelPrivate(q, QStringLiteral("im.ricochet.auth.hidden-service"), direction, conn)
+        : ChannelPrivate(q, QString::fromLatin1(AuthHiddenServiceChannel::TypeName), direction, conn)
+        , proofTimestamp(0)
         , accepted(false)
+        , isOneRoundTrip(false)
+        , isResuming(false)
+        , isWaitingForCrypto(false)
     {
+        // Authentication gates everything else on the connection
+        isUrgent = true;
     }
 
     QByteArray getProofData(const QString &clientHostname);
+    // HMAC of getProofData plus 'suffix', keyed by 'cookies'; this is what the proof signs
+    QByteArray proofDigest(const QString &clientHostname, const QByteArray &cookies, const QByteArray &suffix);
+    // Returns the client's public key and the digest its signature must match, or an unloaded key if the proof is invalid
+    CryptoKey parseProof(const Data::AuthHiddenService::Proof &proof, const QByteArray &cookies, const QByteArray &suffix,
+                         QByteArray *digest);
+    // Returns the client's public key if the proof is valid, or an unloaded key
+    CryptoKey verifyProof(const Data::AuthHiddenService::Proof &proof, const QByteArray &cookies, const QByteArray &suffix);
+    bool acceptClientProof(const Data::AuthHiddenService::Proof &proof, Data::AuthHiddenService::Result *result);
+    bool acceptResumption(const Data::AuthHiddenService::Resumption &resumption, Data::AuthHiddenService::Result *result);
+    // Authenticate the connection as 'clientHostname', and fill in the Result for the client
+    void setAccepted(const QString &clientHostname, Data::AuthHiddenService::Result *result, bool issueTicket);
+    QByteArray resumptionProof(const QByteArray &secret, const QByteArray &proofData, quint64 timestamp);
 };
 
 }
@@ -94,6 +236,61 @@ void AuthHiddenServiceChannel::setPrivateKey(const CryptoKey &key)
     d->privateKey = key;
 }
 
+void AuthHiddenServiceChannel::setOneRoundTrip(bool enabled)
+{
+    Q_D(AuthHiddenServiceChannel);
+    if (direction() != Outbound || identifier() >= 0) {
+        BUG() << "One round trip authentication can only be set on an outbound channel before it's opened";
+        return;
+    }
+
+    d->isOneRoundTrip = enabled;
+}
+
+void AuthHiddenServiceChannel::prepareOneRoundTrip()
+{
+    Q_D(AuthHiddenServiceChannel);
+    if (direction() != Outbound || identifier() >= 0 || !d->privateKey.isLoaded()) {
+        BUG() << "One round trip authentication can only be prepared on an outbound channel with a key before it's opened";
+        return;
+    }
+
+    quint64 now = quint64(QDateTime::currentMSecsSinceEpoch() / 1000);
+    if (!d->isOneRoundTrip || findClientTicket(d->getProofData(d->privateKey.torServiceID()), now)) {
+        emit oneRoundTripPrepared();
+        return;
+    }
+
+    // The cookie is signed now, so it's chosen before allowOutboundChannelRequest
+    d->clientCookie = SecureRNG::random(16);
+    QByteArray publicKey = encodedProofKey(d->privateKey);
+    QByteArray digest;
+    if (!d->clientCookie.isEmpty())
+        digest = d->proofDigest(d->privateKey.torServiceID(), d->clientCookie, timestampSuffix(QByteArray(OneRoundTripLabel), now));
+    if (publicKey.size() > 150 || digest.isEmpty()) {
+        BUG() << "Creating proof on AuthHiddenServiceChannel failed";
+        emit oneRoundTripPrepared();
+        return;
+    }
+
+    // Signing is slow enough to stall the UI when many connections authenticate
+    // at once. The request is still sent in the first flight after the signature.
+    d->privateKey.signSHA256Async(digest, this,
+        [this,publicKey,now](const QByteArray &signature) {
+            Q_D(AuthHiddenServiceChannel);
+            if (signature.isEmpty()) {
+                // Authentication can still continue with a server cookie
+                BUG() << "Creating proof on AuthHiddenServiceChannel failed";
+            } else {
+                d->proofPublicKey = publicKey;
+                d->proofSignature = signature;
+                d->proofTimestamp = now;
+            }
+            emit oneRoundTripPrepared();
+        }
+    );
+}
+
 bool AuthHiddenServiceChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result)
 {
     Q_D(AuthHiddenServiceChannel);
@@ -130,6 +327,22 @@ bool AuthHiddenServiceChannel::allowInboundChannelRequest(const Data::Control::O
     }
     d->clientCookie = QByteArray(clientCookie.c_str(), clientCookie.size());
 
+    // A valid resumption or client_proof authenticates the connection now. The
+    // channel isn't needed, so it's refused with the result attached. Otherwise,
+    // continue as usual; the client will send a proof for the server cookie.
+    Data::AuthHiddenService::Result *proofResult = result->MutableExtension(Data::AuthHiddenService::client_proof_result);
+    if (request->HasExtension(Data::AuthHiddenService::resumption) &&
+        d->acceptResumption(request->GetExtension(Data::AuthHiddenService::resumption), proofResult))
+    {
+        return false;
+    }
+    if (request->HasExtension(Data::AuthHiddenService::client_proof) &&
+        d->acceptClientProof(request->GetExtension(Data::AuthHiddenService::client_proof), proofResult))
+    {
+        return false;
+    }
+    result->ClearExtension(Data::AuthHiddenService::client_proof_result);
+
     // Generate a random cookie and return result
     d->serverCookie = SecureRNG::random(16);
     if (d->serverCookie.isEmpty())
@@ -150,10 +363,35 @@ bool AuthHiddenServiceChannel::allowOutboundChannelRequest(Data::Control::OpenCh
         return false;
     }
 
-    d->clientCookie = SecureRNG::random(16);
+    // A prepared proof has already chosen the cookie
+    if (d->clientCookie.isEmpty())
+        d->clientCookie = SecureRNG::random(16);
     if (d->clientCookie.isEmpty())
         return false;
     request->SetExtension(Data::AuthHiddenService::client_cookie, std::string(d->clientCookie.constData(), d->clientCookie.size()));
+
+    // A ticket from an earlier authentication avoids signing anything. If the
+    // server doesn't accept it, authentication continues with a server cookie.
+    quint64 now = quint64(QDateTime::currentMSecsSinceEpoch() / 1000);
+    QByteArray proofData = d->getProofData(d->privateKey.torServiceID());
+    const ClientTicket *ticket = findClientTicket(proofData, now);
+
+    if (ticket) {
+        Data::AuthHiddenService::Resumption *resumption = request->MutableExtension(Data::AuthHiddenService::resumption);
+        QByteArray proof = d->resumptionProof(ticket->secret, proofData, now);
+        resumption->set_ticket(ticket->ticket.constData(), ticket->ticket.size());
+        resumption->set_proof(proof.constData(), proof.size());
+        resumption->set_timestamp(now);
+        d->isResuming = true;
+    } else if (d->isOneRoundTrip && !d->proofSignature.isEmpty()) {
+        Data::AuthHiddenService::Proof *proof = request->MutableExtension(Data::AuthHiddenService::client_proof);
+        proof->set_public_key(d->proofPublicKey.constData(), d->proofPublicKey.size());
+        proof->set_signature(d->proofSignature.constData(), d->proofSignature.size());
+        proof->set_timestamp(d->proofTimestamp);
+    } else {
+        // Without a prepared proof, authentication continues with a server cookie
+        d->isOneRoundTrip = false;
+    }
     return true;
 }
 
@@ -161,6 +399,24 @@ bool AuthHiddenServiceChannel::processChannelOpenResult(const Data::Control::Cha
 {
     Q_D(AuthHiddenServiceChannel);
 
+    if (d->isResuming && !result->HasExtension(Data::AuthHiddenService::client_proof_result)) {
+        // The ticket wasn't accepted; maybe it expired early, or the server restarted
+        qDebug() << "Resumption ticket wasn't accepted on" << type() << "; authenticating with a proof";
+        clientTickets().remove(d->getProofData(d->privateKey.torServiceID()));
+        d->isResuming = false;
+    }
+
+    if (result->HasExtension(Data::AuthHiddenService::client_proof_result)) {
+        if (!(d->isOneRoundTrip || d->isResuming) || result->opened()) {
+            qWarning() << "Received unexpected client_proof_result on" << type();
+            return false;
+        }
+
+        // Authentication is finished, and the channel is closed without opening
+        applyResult(result->GetExtension(Data::AuthHiddenService::client_proof_result));
+        return false;
+    }
+
     if (result->opened()) {
         std::string cookie = result->GetExtension(Data::AuthHiddenService::server_cookie);
         if (cookie.size() != 16) {
@@ -193,44 +449,53 @@ void AuthHiddenServiceChannel::sendAuthMessage()
         return;
     }
 
-    QByteArray publicKey = d->privateKey.encodedPublicKey(CryptoKey::DER);
-    if (publicKey.size() > 150) {
-        BUG() << "Unexpected size for encoded public key";
-        closeChannel();
-        return;
-    }
-
-    QByteArray signature;
-    QByteArray proofData = d->getProofData(d->privateKey.torServiceID());
-    if (!proofData.isEmpty()) {
-        QByteArray proofHMAC = QMessageAuthenticationCode::hash(proofData, d->clientCookie + d->serverCookie,
-                QCryptographicHash::Sha256);
-        signature = d->privateKey.signSHA256(proofHMAC);
-    }
-
-    if (signature.isEmpty()) {
+    QByteArray publicKey = encodedProofKey(d->privateKey);
+    QByteArray digest = d->proofDigest(d->privateKey.torServiceID(), d->clientCookie + d->serverCookie, QByteArray());
+    if (publicKey.size() > 150 || digest.isEmpty()) {
         BUG() << "Creating proof on AuthHiddenServiceChannel failed";
         closeChannel();
         return;
     }
 
-    QScopedPointer<Data::AuthHiddenService::Proof> proof(new Data::AuthHiddenService::Proof);
-    proof->set_public_key(std::string(publicKey.constData(), publicKey.size()));
-    proof->set_signature(std::string(signature.constData(), signature.size()));
-
-    Data::AuthHiddenService::Packet message;
-    message.set_allocated_proof(proof.take());
-    sendMessage(message);
-
-    qDebug() << "AuthHiddenServiceChannel sent outbound authentication packet";
+    // Signing is slow enough to stall the UI when many connections authenticate at
+    // once. The channel waits for it, and the server won't send anything meanwhile.
+    d->isWaitingForCrypto = true;
+    d->privateKey.signSHA256Async(digest, this,
+        [this,publicKey](const QByteArray &signature) {
+            Q_D(AuthHiddenServiceChannel);
+            d->isWaitingForCrypto = false;
+            if (!isOpened())
+                return;
+
+            if (signature.isEmpty()) {
+                BUG() << "Creating proof on AuthHiddenServiceChannel failed";
+                closeChannel();
+                return;
+            }
+
+            MessageArena arena(connection());
+            Data::AuthHiddenService::Packet *message = arena.create<Data::AuthHiddenService::Packet>();
+            Data::AuthHiddenService::Proof *proof = message->mutable_proof();
+            proof->set_public_key(publicKey.constData(), publicKey.size());
+            proof->set_signature(signature.constData(), signature.size());
+            sendMessage(*message);
+
+            qDebug() << "AuthHiddenServiceChannel sent outbound authentication packet";
+        }
+    );
 }
 
 QByteArray AuthHiddenServiceChannelPrivate::getProofData(const QString &client)
 {
-    QByteArray serverHostname = connection->serverHostname().toLatin1().mid(0, 16);
+    QByteArray serverHostname = connection->serverHostname().toLatin1();
     QByteArray clientHostname = client.toLatin1();
+    int suffix = serverHostname.indexOf('.');
+    if (suffix >= 0)
+        serverHostname.truncate(suffix);
 
-    if (clientHostname.size() != 16 || serverHostname.size() != 16) {
+    // Either may be a version 2 (16 character) or version 3 (56 character) hostname
+    if ((clientHostname.size() != 16 && clientHostname.size() != 56) ||
+        (serverHostname.size() != 16 && serverHostname.size() != 56)) {
         BUG() << "AuthHiddenServiceChannel can't figure out the client and server hostnames";
         return QByteArray();
     }
@@ -238,18 +503,199 @@ QByteArray AuthHiddenServiceChannelPrivate::getProofData(const QString &client)
     return clientHostname + serverHostname;
 }
 
+QByteArray AuthHiddenServiceChannelPrivate::proofDigest(const QString &clientHostname, const QByteArray &cookies,
+                                                        const QByteArray &suffix)
+{
+    QByteArray proofData = getProofData(clientHostname);
+    if (proofData.isEmpty())
+        return QByteArray();
+    return QMessageAuthenticationCode::hash(proofData + suffix, cookies, QCryptographicHash::Sha256);
+}
+
+CryptoKey AuthHiddenServiceChannelPrivate::parseProof(const Data::AuthHiddenService::Proof &proof, const QByteArray &cookies,
+                                                      const QByteArray &suffix, QByteArray *digest)
+{
+    QByteArray publicKeyData(proof.public_key().c_str(), proof.public_key().size());
+    QByteArray signature(proof.signature().c_str(), proof.signature().size());
+
+    // Version 3 services use an Ed25519 key, sent raw, and have 64 byte signatures.
+    if (publicKeyData.size() == 32) {
+        CryptoKey publicKey;
+        if (signature.size() != 64) {
+            qWarning() << "Received invalid signature (size" << signature.size() << ") on" << type;
+        } else if (!publicKey.loadFromData(publicKeyData, CryptoKey::PublicKey, CryptoKey::Raw)) {
+            qWarning() << "Unable to parse public key from" << type;
+        } else {
+            *digest = proofDigest(publicKey.torServiceID(), cookies, suffix);
+            if (!digest->isEmpty())
+                return publicKey;
+        }
+        return CryptoKey();
+    }
+
+    // Version 2 services always use a 1024bit key. A valid signature will always be exactly 128 bytes.
+    CryptoKey publicKey;
+    if (signature.size() != 128) {
+        qWarning() << "Received invalid signature (size" << signature.size() << ") on" << type;
+    } else if (publicKeyData.size() > 150) {
+        qWarning() << "Received invalid public key (size" << publicKeyData.size() << ") on" << type;
+    } else if (!publicKey.loadFromData(publicKeyData, CryptoKey::PublicKey, CryptoKey::DER)) {
+        qWarning() << "Unable to parse public key from" << type;
+    } else if (publicKey.bits() != 1024) {
+        qWarning() << "Received invalid public key (" << publicKey.bits() << "bits) on" << type;
+    } else {
+        *digest = proofDigest(publicKey.torServiceID(), cookies, suffix);
+        if (!digest->isEmpty())
+            return publicKey;
+    }
+
+    return CryptoKey();
+}
+
+CryptoKey AuthHiddenServiceChannelPrivate::verifyProof(const Data::AuthHiddenService::Proof &proof, const QByteArray &cookies,
+                                                       const QByteArray &suffix)
+{
+    QByteArray digest;
+    CryptoKey publicKey = parseProof(proof, cookies, suffix, &digest);
+    if (!publicKey.isLoaded())
+        return CryptoKey();
+
+    QByteArray signature(proof.signature().c_str(), proof.signature().size());
+    if (!publicKey.verifySHA256(digest, signature)) {
+        qWarning() << "Signature verification failed on" << type;
+        return CryptoKey();
+    }
+
+    return publicKey;
+}
+
+/* Check a client_proof from an inbound request, and authenticate the connection if it's valid
+ *
+ * The proof must be signed within MaxProofClockSkew of our clock, and each
+ * client cookie is only accepted once.
+ */
+bool AuthHiddenServiceChannelPrivate::acceptClientProof(const Data::AuthHiddenService::Proof &proof,
+                                                        Data::AuthHiddenService::Result *result)
+{
+    quint64 now = quint64(QDateTime::currentMSecsSinceEpoch() / 1000);
+    quint64 timestamp = proof.timestamp();
+    if (!proof.has_timestamp() || !isRecent(timestamp, now)) {
+        qDebug() << "Ignoring client_proof on" << type << "with timestamp" << timestamp << "at" << now;
+        return false;
+    }
+
+    CryptoKey publicKey = verifyProof(proof, clientCookie, timestampSuffix(QByteArray(OneRoundTripLabel), timestamp));
+    if (!publicKey.isLoaded())
+        return false;
+
+    if (!proofReplayCache().insert(clientCookie, qint64(timestamp), qint64(now))) {
+        qWarning() << "Ignoring replayed client_proof on" << type;
+        return false;
+    }
+
+    qDebug() << type << "accepted inbound one round trip authentication for" << publicKey.torServiceID();
+    setAccepted(publicKey.torServiceID(), result, true);
+    return true;
+}
+
+/* Check a resumption ticket from an inbound request, and authenticate the connection if it's valid
+ *
+ * Like client_proof, the timestamp must be within MaxProofClockSkew and each
+ * client cookie is only accepted once. No new ticket is issued; the client
+ * keeps using this one until it expires.
+ */
+bool AuthHiddenServiceChannelPrivate::acceptResumption(const Data::AuthHiddenService::Resumption &resumption,
+                                                       Data::AuthHiddenService::Result *result)
+{
+    quint64 now = quint64(QDateTime::currentMSecsSinceEpoch() / 1000);
+    quint64 timestamp = resumption.timestamp();
+    if (!resumption.has_timestamp() || !isRecent(timestamp, now)) {
+        qDebug() << "Ignoring resumption on" << type << "with timestamp" << timestamp << "at" << now;
+        return false;
+    }
+
+    QString clientHostname;
+    QByteArray secret;
+    QByteArray ticket(resumption.ticket().c_str(), resumption.ticket().size());
+    if (!ticketKeys(connection->serverHostname()).open(ticket, now, &clientHostname, &secret)) {
+        qDebug() << "Ignoring resumption on" << type << "with an invalid or expired ticket";
+        return false;
+    }
+
+    QByteArray proofData = getProofData(clientHostname);
+    QByteArray expected = resumptionProof(secret, proofData, timestamp);
+    const std::string &proof = resumption.proof();
+    secret.fill(0);
+    if (proofData.isEmpty() || proof.size() != size_t(expected.size()) ||
+        CRYPTO_memcmp(proof.data(), expected.constData(), expected.size()) != 0)
+    {
+        qWarning() << "Resumption proof verification failed on" << type;
+        return false;
+    }
+
+    if (!proofReplayCache().insert(clientCookie, qint64(timestamp), qint64(now))) {
+        qWarning() << "Ignoring replayed resumption on" << type;
+        return false;
+    }
+
+    qDebug() << type << "accepted inbound resumption for" << clientHostname;
+    setAccepted(clientHostname, result, false);
+    return true;
+}
+
+void AuthHiddenServiceChannelPrivate::setAccepted(const QString &clientHostname, Data::AuthHiddenService::Result *result,
+                                                  bool issueTicket)
+{
+    connection->grantAuthentication(Connection::HiddenServiceAuth, clientHostname + QStringLiteral(".onion"));
+    accepted = true;
+    result->set_accepted(true);
+    result->set_is_known_contact(connection->purpose() == Connection::Purpose::KnownContact);
+
+    if (!issueTicket)
+        return;
+
+    quint64 now = quint64(QDateTime::currentMSecsSinceEpoch() / 1000);
+    QByteArray secret = SecureRNG::random(ResumptionTicketKeys::SecretSize);
+    if (secret.size() != ResumptionTicketKeys::SecretSize)
+        return;
+
+    QByteArray ticket = ticketKeys(connection->serverHostname()).issue(clientHostname, secret, now);
+    if (!ticket.isEmpty()) {
+        result->set_resumption_ticket(ticket.constData(), ticket.size());
+        result->set_resumption_secret(secret.constData(), secret.size());
+        result->set_resumption_lifetime(ResumptionTicketKeys::Lifetime);
+    }
+    secret.fill(0);
+}
+
+QByteArray AuthHiddenServiceChannelPrivate::resumptionProof(const QByteArray &secret, const QByteArray &proofData,
+                                                            quint64 timestamp)
+{
+    return QMessageAuthenticationCode::hash(proofData + clientCookie + timestampSuffix(QByteArray(ResumptionLabel), timestamp),
+                                            secret, QCryptographicHash::Sha256);
+}
+
 void AuthHiddenServiceChannel::receivePacket(const QByteArray &packet)
 {
-    Data::AuthHiddenService::Packet message;
-    if (!message.ParseFromArray(packet.constData(), packet.size())) {
+    Q_D(AuthHiddenServiceChannel);
+
+    if (d->isWaitingForCrypto) {
+        qWarning() << "Received unexpected packet on" << type() << "while waiting for a signature";
         closeChannel();
         return;
     }
 
-    if (message.has_proof()) {
-        handleProof(message.proof());
-    } else if (message.has_result()) {
-        handleResult(message.result());
+    MessageArena arena(connection());
+    Data::AuthHiddenService::Packet *message = arena.create<Data::AuthHiddenService::Packet>();
+    if (!message->ParseFromArray(packet.constData(), packet.size())) {
+        closeChannel();
+        return;
+    }
+
+    if (message->has_proof()) {
+        handleProof(message->proof());
+    } else if (message->has_result()) {
+        handleResult(message->result());
     } else {
         qWarning() << "Unrecognized message on" << type();
         closeChannel();
@@ -272,54 +718,49 @@ void AuthHiddenServiceChannel::handleProof(const Data::AuthHiddenService::Proof
         return;
     }
 
-    QByteArray publicKeyData(message.public_key().c_str(), message.public_key().size());
-    QByteArray signature(message.signature().c_str(), message.signature().size());
+    QByteArray digest;
+    CryptoKey publicKey = d->parseProof(message, d->clientCookie + d->serverCookie, QByteArray(), &digest);
+    if (!publicKey.isLoaded()) {
+        sendProofResult(CryptoKey());
+        return;
+    }
 
-    QScopedPointer<Data::AuthHiddenService::Result> result(new Data::AuthHiddenService::Result);
-    result->set_accepted(false);
+    // Verify on a worker thread, so that many clients authenticating at once
+    // don't stall the UI. The client sends nothing else until it has the result.
+    QByteArray signature(message.signature().c_str(), message.signature().size());
+    d->isWaitingForCrypto = true;
+    publicKey.verifySHA256Async(digest, signature, this,
+        [this,publicKey](bool valid) {
+            Q_D(AuthHiddenServiceChannel);
+            d->isWaitingForCrypto = false;
+            if (!isOpened())
+                return;
 
-    // Hidden services always use a 1024bit key. A valid signature will always be exactly 128 bytes.
-    CryptoKey publicKey;
-    if (signature.size() != 128) {
-        qWarning() << "Received invalid signature (size" << signature.size() << ") on" << type();
-    } else if (publicKeyData.size() > 150) {
-        qWarning() << "Received invalid public key (size" << publicKeyData.size() << ") on" << type();
-    } else if (!publicKey.loadFromData(publicKeyData, CryptoKey::PublicKey, CryptoKey::DER)) {
-        qWarning() << "Unable to parse public key from" << type();
-    } else if (publicKey.bits() != 1024) {
-        qWarning() << "Received invalid public key (" << publicKey.bits() << "bits) on" << type();
-    } else {
-        bool ok = false;
-        QByteArray proofData = d->getProofData(publicKey.torServiceID());
-        if (!proofData.isEmpty()) {
-            QByteArray proofHMAC = QMessageAuthenticationCode::hash(proofData, d->clientCookie + d->serverCookie,
-                    QCryptographicHash::Sha256);
-            ok = publicKey.verifySHA256(proofHMAC, signature);
+            if (!valid)
+                qWarning() << "Signature verification failed on" << type();
+            sendProofResult(valid ? publicKey : CryptoKey());
         }
+    );
+}
 
-        if (!ok) {
-            qWarning() << "Signature verification failed on" << type();
-            result->set_accepted(false);
-        } else {
-            result->set_accepted(true);
-            qDebug() << type() << "accepted inbound authentication for" << publicKey.torServiceID();
-        }
-    }
+// Send the Result for a proof that was valid if 'publicKey' is loaded, and close the channel
+void AuthHiddenServiceChannel::sendProofResult(const CryptoKey &publicKey)
+{
+    Q_D(AuthHiddenServiceChannel);
+
+    MessageArena arena(connection());
+    Data::AuthHiddenService::Packet *resultMessage = arena.create<Data::AuthHiddenService::Packet>();
+    Data::AuthHiddenService::Result *result = resultMessage->mutable_result();
+    result->set_accepted(publicKey.isLoaded());
 
     if (result->accepted()) {
-        connection()->grantAuthentication(Connection::HiddenServiceAuth, publicKey.torServiceID() + QStringLiteral(".onion"));
-        d->accepted = true;
-        result->set_is_known_contact(connection()->purpose() == Connection::Purpose::KnownContact);
+        qDebug() << type() << "accepted inbound authentication for" << publicKey.torServiceID();
+        d->setAccepted(publicKey.torServiceID(), result, true);
     } else {
         d->accepted = false;
     }
 
-    Data::AuthHiddenService::Packet resultMessage;
-    resultMessage.set_allocated_result(result.data());
-    sendMessage(resultMessage);
-
-    // Clear QScopedPointer, value is now owned by the Packet
-    result.take();
+    sendMessage(*resultMessage);
 
     // In all cases, close the channel afterwards. This also emits the
     // authSucceeded or authFailed signals.
@@ -328,14 +769,21 @@ void AuthHiddenServiceChannel::handleProof(const Data::AuthHiddenService::Proof
 
 void AuthHiddenServiceChannel::handleResult(const Data::AuthHiddenService::Result &message)
 {
-    Q_D(AuthHiddenServiceChannel);
-
     if (direction() != Outbound) {
         qWarning() << "Received invalid message on AuthHiddenServiceChannel";
         closeChannel();
         return;
     }
 
+    applyResult(message);
+    closeChannel();
+}
+
+void AuthHiddenServiceChannel::applyResult(const Data::AuthHiddenService::Result &message)
+{
+    Q_D(AuthHiddenServiceChannel);
+
+    QByteArray proofData = d->getProofData(d->privateKey.torServiceID());
     if (message.accepted()) {
         qDebug() << "AuthHiddenServiceChannel succeeded as" << (message.is_known_contact() ? "known" : "unknown") << "contact";
         d->accepted = true;
@@ -344,8 +792,19 @@ void AuthHiddenServiceChannel::handleResult(const Data::AuthHiddenService::Resul
     } else {
         qWarning() << "AuthHiddenServiceChannel rejected";
         d->accepted = false;
+        clientTickets().remove(proofData);
     }
 
-    closeChannel();
+    // Keep a new ticket to resume with next time; our own limit on its lifetime applies too
+    quint32 lifetime = qMin(message.resumption_lifetime(), quint32(ResumptionTicketKeys::Lifetime));
+    if (message.accepted() && message.has_resumption_ticket() && lifetime > 0 && !proofData.isEmpty() &&
+        message.resumption_ticket().size() <= 256 &&
+        message.resumption_secret().size() == size_t(ResumptionTicketKeys::SecretSize))
+    {
+        ClientTicket &ticket = clientTickets()[proofData];
+        ticket.ticket = QByteArray(message.resumption_ticket().c_str(), message.resumption_ticket().size());
+        ticket.secret = QByteArray(message.resumption_secret().c_str(), message.resumption_secret().size());
+        ticket.expiry = quint64(QDateTime::currentMSecsSinceEpoch() / 1000) + lifetime;
+    }
 }
 
@@ -49,13 +49,39 @@ class AuthHiddenServiceChannel : public Channel
     Q_DECLARE_PRIVATE(AuthHiddenServiceChannel)
 
 public:
+    static constexpr const char *TypeName = "im.ricochet.auth.hidden-service";
+    // Connection feature for peers that accept client_proof in the OpenChannel request
+    static constexpr const char *OneRoundTripFeature = "im.ricochet.auth.one-round-trip";
+
+    // Largest difference from our clock allowed for the timestamp of a client_proof
+    static const int MaxProofClockSkew = 300;
+
     explicit AuthHiddenServiceChannel(Direction direction, Connection *connection);
 
     void setPrivateKey(const CryptoKey &key);
 
+    /* Send the proof with the OpenChannel request, for one round trip authentication
+     *
+     * The proof is signed with a timestamp instead of the server's cookie.
+     * Peers with OneRoundTripFeature check it and answer with the result in
+     * their ChannelResult, which doesn't open the channel. Other peers ignore
+     * it, and authentication continues with a proof packet as usual.
+     *
+     * The proof must be signed with prepareOneRoundTrip before openChannel;
+     * without it, no proof is sent.
+     */
+    void setOneRoundTrip(bool enabled);
+    /* Sign the one round trip proof on a worker thread
+     *
+     * oneRoundTripPrepared is emitted when the channel is ready to open. If
+     * signing fails, or a resumption ticket will be used, no proof is sent.
+     */
+    void prepareOneRoundTrip();
+
 signals:
     void authSuccessful();
     void authFailed();
+    void oneRoundTripPrepared();
 
 private slots:
     void sendAuthMessage();
@@ -68,7 +94,9 @@ protected:
 
 private:
     void handleProof(const Data::AuthHiddenService::Proof &message);
+    void sendProofResult(const CryptoKey &publicKey);
     void handleResult(const Data::AuthHiddenService::Result &message);
+    void applyResult(const Data::AuthHiddenService::Result &message);
 };
 
 }
@@ -42,22 +42,63 @@
 
 using namespace Protocol;
 
-Channel *Channel::create(const QString &type, Direction direction, Connection *connection)
+namespace {
+
+/* FNV-1a hash of a channel type name
+ *
+ * This is evaluated at compile time for the registered types, where it is
+ * used for case labels in Channel::create. Two registered types with the
+ * same hash would be a duplicate case label, so the hash is guaranteed to
+ * be perfect for the known types.
+ */
+constexpr quint32 channelTypeHash(const char *type, quint32 hash = 2166136261u)
+{
+    return *type ? channelTypeHash(type + 1, (hash ^ quint8(*type)) * 16777619u) : hash;
+}
+
+quint32 channelTypeHash(const std::string &type)
+{
+    quint32 hash = 2166136261u;
+    for (char c : type)
+        hash = (hash ^ quint8(c)) * 16777619u;
+    return hash;
+}
+
+template<typename T> Channel *createChannelOfType(const std::string &type, Channel::Direction direction, Connection *connection)
+{
+    // Unknown types can share a hash with a registered type
+    if (type.compare(T::TypeName) != 0)
+        return 0;
+    return new T(direction, connection);
+}
+
+}
+
+/* Register a Channel subclass to be created by Channel::create
+ *
+ * The class must have a static TypeName, and a constructor taking the
+ * direction and connection.
+ */
+#define CHANNEL_TYPE(T) \
+    case channelTypeHash(T::TypeName): \
+        return createChannelOfType<T>(type, direction, connection);
+
+Channel *Channel::create(const std::string &type, Direction direction, Connection *connection)
 {
     if (!connection)
         return 0;
 
-    if (type == QStringLiteral("im.ricochet.auth.hidden-service")) {
-        return new AuthHiddenServiceChannel(direction, connection);
-    } else if (type == QStringLiteral("im.ricochet.chat")) {
-        return new ChatChannel(direction, connection);
-    } else if (type == QStringLiteral("im.ricochet.contact.request")) {
-        return new ContactRequestChannel(direction, connection);
-    } else {
+    switch (channelTypeHash(type)) {
+    CHANNEL_TYPE(AuthHiddenServiceChannel)
+    CHANNEL_TYPE(ChatChannel)
+    CHANNEL_TYPE(ContactRequestChannel)
+    default:
         return 0;
     }
 }
 
+#undef CHANNEL_TYPE
+
 Channel::Channel(const QString &type, Direction direction, Connection *connection)
     : QObject(connection)
     , d_ptr(new ChannelPrivate(this, type, direction, connection))
@@ -133,10 +174,51 @@ bool Channel::openChannel()
     return true;
 }
 
+bool Channel::canWrite() const
+{
+    Q_D(const Channel);
+    if (!d->isOpened || d->isInvalidated)
+        return false;
+
+    ConnectionPrivate *cd = d->connection->d;
+    if (bytesPending() < d->highWaterMark && cd->bytesPending() < cd->highWaterMark)
+        return true;
+
+    // Remember the refusal, so writable is emitted once the queues have drained
+    d->isWriteBlocked = true;
+    cd->hasBlockedChannels = true;
+    return false;
+}
+
+qint64 Channel::bytesPending() const
+{
+    Q_D(const Channel);
+    if (d->identifier < 0)
+        return 0;
+    return d->connection->queuedBytes(d->identifier);
+}
+
+bool Channel::setWriteWaterMarks(qint64 high, qint64 low)
+{
+    Q_D(Channel);
+    if (high < 1 || low < 0 || low > high) {
+        BUG() << "Invalid write water marks for" << type() << "channel: high" << high << "low" << low;
+        return false;
+    }
+
+    d->highWaterMark = high;
+    d->lowWaterMark = low;
+    return true;
+}
+
 void Channel::closeChannel()
 {
     Q_D(Channel);
 
+    // Packets sent from here may fail and close the channel first
+    if (d->isOpened && !d->hasSentClose && d->identifier >= 0 && connection()->isConnected())
+        prepareToClose();
+
     if (!d->hasSentClose && d->identifier >= 0 && connection()->isConnected()) {
         d->hasSentClose = true;
         bool ok = connection()->d->writePacket(this, QByteArray());
@@ -149,6 +231,10 @@ void Channel::closeChannel()
     d->invalidate();
 }
 
+void Channel::prepareToClose()
+{
+}
+
 /* Called by ControlChannel to handle an inbound OpenChannel message.
  * This Channel must be in a clean, inbound state. The Channel subclass
  * decides whether to accept the request, and can add data to the result.
@@ -189,6 +275,13 @@ bool ChannelPrivate::openChannelInbound(const Data::Control::OpenChannel *reques
         return false;
     }
 
+    if (isCompressible && request->GetExtension(Data::Control::request_compression) &&
+        connection->hasFeature(PacketCompression::FeatureName))
+    {
+        compression.reset(new PacketCompression);
+        result->SetExtension(Data::Control::compression_enabled, true);
+    }
+
     result->set_opened(true);
     identifier = request->channel_identifier();
     isOpened = true;
@@ -214,6 +307,10 @@ bool ChannelPrivate::openChannelOutbound(Data::Control::OpenChannel *request)
 
     request->set_channel_type(type.toStdString());
     identifier = request->channel_identifier();
+
+    isCompressionRequested = isCompressible && connection->hasFeature(PacketCompression::FeatureName);
+    if (isCompressionRequested)
+        request->SetExtension(Data::Control::request_compression, true);
     return true;
 }
 
@@ -227,13 +324,22 @@ bool ChannelPrivate::openChannelResult(const Data::Control::ChannelResult *resul
     }
 
     bool ok = result->opened();
-    if (!q->processChannelOpenResult(result)) {
-        // If the peer thinks the channel was opened successfully, send a close
-        if (result->opened())
-            q->closeChannel();
-        ok = false;
+    if (ok && result->GetExtension(Data::Control::compression_enabled)) {
+        if (isCompressionRequested) {
+            compression.reset(new PacketCompression);
+        } else {
+            qDebug() << "Peer enabled compression on" << type << "channel, but it wasn't requested";
+            ok = false;
+        }
     }
 
+    if (!q->processChannelOpenResult(result))
+        ok = false;
+
+    // If the peer thinks the channel was opened successfully, send a close
+    if (!ok && result->opened())
+        q->closeChannel();
+
     if (ok) {
         isOpened = true;
         emit q->channelOpened();
@@ -267,12 +373,168 @@ bool Channel::sendPacket(const QByteArray &packet)
         return false;
     }
 
-    if (packet.size() > ConnectionPrivate::PacketMaxDataSize) {
+    if (packet.size() > d->maxPacketSize()) {
         BUG() << "Packet is too big on channel" << type();
         return false;
     }
 
-    return connection()->d->writePacket(this, packet);
+    char *data = d->beginPacket(packet.size());
+    if (!data)
+        return false;
+    memcpy(data, packet.constData(), packet.size());
+    return d->commitPacket(packet.size());
+}
+
+int ChannelPrivate::maxPacketSize() const
+{
+    // Compressed channels keep the version 1 limit, which bounds their buffers
+    if (compression)
+        return ConnectionPrivate::PacketMaxDataSize - 1;
+    return connection->d->maxPacketDataSize();
+}
+
+char *ChannelPrivate::beginPacket(int maxSize)
+{
+    if (identifier < 0) {
+        BUG() << "Cannot send packet to channel" << type << "without an assigned identifier";
+        return 0;
+    }
+
+    if (!compression)
+        return connection->d->beginPacket(identifier, maxSize);
+
+    // Compressed packets are built in a buffer, and written to the queue by commitPacket
+    if (pendingPacketSize >= 0) {
+        BUG() << "Cannot begin a packet while another is pending on channel" << type;
+        return 0;
+    }
+
+    if (maxSize < 0 || maxSize > maxPacketSize()) {
+        BUG() << "Cannot write oversized packet of" << maxSize << "bytes to compressed channel" << type;
+        return 0;
+    }
+
+    if (!connection->isConnected()) {
+        qDebug() << "Cannot write packet to closed connection";
+        return 0;
+    }
+
+    pendingPacketSize = maxSize;
+    if (compressionBuffer.size() < maxSize)
+        compressionBuffer.resize(maxSize);
+    return compressionBuffer.data();
+}
+
+bool ChannelPrivate::commitPacket(int size)
+{
+    if (!compression)
+        return connection->d->commitPacket(size);
+
+    if (pendingPacketSize < 0) {
+        BUG() << "Cannot commit a packet that was never started on channel" << type;
+        return false;
+    }
+
+    int maxSize = pendingPacketSize;
+    pendingPacketSize = -1;
+    if (size < 0 || size > maxSize) {
+        BUG() << "Cannot commit packet of" << size << "bytes in" << maxSize << "bytes of reserved space";
+        return false;
+    }
+
+    // Empty packets close the channel, and don't have a format byte
+    ConnectionPrivate *cd = connection->d;
+    if (size == 0)
+        return cd->writePacket(identifier, QByteArray());
+
+    Connection::CompressionStatistics &stats = cd->compressionStatistics;
+    int maxCompressedSize = PacketCompression::maxCompressedSize(size);
+    if (size < PacketCompression::CompressionThreshold || 1 + maxCompressedSize > ConnectionPrivate::PacketMaxDataSize) {
+        char *packet = cd->beginPacket(identifier, 1 + size);
+        if (!packet)
+            return false;
+        packet[0] = char(PacketCompression::RawPacket);
+        memcpy(packet + 1, compressionBuffer.constData(), size);
+        if (!cd->commitPacket(1 + size))
+            return false;
+
+        stats.packets++;
+        stats.rawPackets++;
+        stats.uncompressedBytes += size;
+        stats.compressedBytes += size;
+        return true;
+    }
+
+    char *packet = cd->beginPacket(identifier, 1 + maxCompressedSize);
+    if (!packet)
+        return false;
+
+    QElapsedTimer timer;
+    timer.start();
+    packet[0] = char(PacketCompression::CompressedPacket);
+    int compressedSize = compression->compress(compressionBuffer.constData(), size, packet + 1);
+    stats.compressNsecs += timer.nsecsElapsed();
+    if (compressedSize < 0) {
+        // Nothing more can be sent on the stream, so the channel is closed
+        Q_Q(Channel);
+        cd->cancelPacket();
+        q->closeChannel();
+        return false;
+    }
+
+    // The peer needs this packet to follow the stream, so it can't be cancelled from here on
+    if (!cd->commitPacket(1 + compressedSize))
+        return false;
+
+    stats.packets++;
+    stats.uncompressedBytes += size;
+    stats.compressedBytes += compressedSize;
+    return true;
+}
+
+void ChannelPrivate::cancelPacket()
+{
+    if (!compression) {
+        connection->d->cancelPacket();
+        return;
+    }
+
+    pendingPacketSize = -1;
+}
+
+QByteArray ChannelPrivate::decompressPacket(const QByteArray &packet)
+{
+    Connection::CompressionStatistics &stats = connection->d->compressionStatistics;
+    const char *data = packet.constData() + 1;
+    int size = packet.size() - 1;
+    if (size < 1)
+        return QByteArray();
+
+    stats.inboundPackets++;
+    stats.inboundCompressedBytes += size;
+
+    switch (quint8(packet[0])) {
+    case PacketCompression::RawPacket:
+        stats.inboundBytes += size;
+        return QByteArray::fromRawData(data, size);
+    case PacketCompression::CompressedPacket:
+        break;
+    default:
+        qDebug() << "Unknown packet format" << int(packet[0]) << "on compressed channel" << type;
+        return QByteArray();
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    if (decompressionBuffer.isEmpty())
+        decompressionBuffer.resize(ConnectionPrivate::PacketMaxDataSize - 1);
+    int outSize = compression->decompress(data, size, decompressionBuffer.data(), decompressionBuffer.size());
+    stats.decompressNsecs += timer.nsecsElapsed();
+    if (outSize < 1)
+        return QByteArray();
+
+    stats.inboundBytes += outSize;
+    return QByteArray::fromRawData(decompressionBuffer.constData(), outSize);
 }
 
 void Channel::requestInboundApproval()
@@ -294,6 +556,14 @@ ChannelPrivate::ChannelPrivate(Channel *q, const QString &type, Channel::Directi
     , isOpened(false)
     , hasSentClose(false)
     , isInvalidated(false)
+    , isUrgent(false)
+    , weight(1)
+    , highWaterMark(DefaultHighWaterMark)
+    , lowWaterMark(DefaultLowWaterMark)
+    , isWriteBlocked(false)
+    , isCompressible(false)
+    , isCompressionRequested(false)
+    , pendingPacketSize(-1)
 {
 }
 
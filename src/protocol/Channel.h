@@ -82,9 +82,10 @@ public:
 
     /* Create a Channel instance of the specified type
      *
-     * Returns null if 'type' is unrecognized.
+     * 'type' is the channel type name as it appears in the OpenChannel
+     * message. Returns null if 'type' is unrecognized.
      */
-    static Channel *create(const QString &type, Direction direction, Connection *connection);
+    static Channel *create(const std::string &type, Direction direction, Connection *connection);
 
     QString type() const;
     int identifier() const;
@@ -107,10 +108,42 @@ public:
      */
     bool openChannel();
 
+    /* Determine whether the channel should send more data now
+     *
+     * Packets sent on a channel are queued until the connection can write
+     * them. Channels that send large amounts of data, or many messages at
+     * once, should check canWrite before sending and wait for the writable
+     * signal when it returns false, so that the queues don't grow without
+     * bound on a slow connection.
+     *
+     * Returns false when the channel isn't open, when bytesPending() has
+     * reached the channel's high water mark, or when the connection's
+     * pending data has reached its high water mark.
+     */
+    bool canWrite() const;
+
+    /* Bytes sent on this channel that are queued and not yet written to the socket */
+    qint64 bytesPending() const;
+
+    /* Limits on pending outbound data for this channel
+     *
+     * See canWrite. Returns false if the marks are invalid (low must not
+     * exceed high).
+     */
+    bool setWriteWaterMarks(qint64 high, qint64 low);
+
 signals:
     void channelOpened();
     void channelRejected(Data::Control::ChannelResult::CommonError error);
 
+    /* Emitted when a channel that was refused by canWrite can write again
+     *
+     * This signal is emitted once, after canWrite has returned false and the
+     * pending data for both the channel and the connection has drained to
+     * their low water marks.
+     */
+    void writable();
+
     /* Emitted when the channel has become invalid and will be destroyed
      *
      * This signal is emitted when a channel is closed, an outbound channel request is
@@ -181,9 +214,22 @@ protected:
      * Generally, a channel will parse packets using the protobuf ParseFromArray
      * method of their packet message type, and call appropriate handlers for
      * the messages it contains.
+     *
+     * 'packet' refers directly to the connection's receive buffer, and is only
+     * valid until this method returns. Implementations that need to keep any
+     * of the data must make a deep copy of it.
      */
     virtual void receivePacket(const QByteArray &packet) = 0;
 
+    /* Send any remaining packets before the channel is closed
+     *
+     * Subclasses may implement this method to send data they've held back,
+     * such as delayed replies. It's called while the channel is still open,
+     * just before the close packet is written. The default implementation
+     * does nothing.
+     */
+    virtual void prepareToClose();
+
     /* Send raw data as a packet on this channel
      *
      * Sends the contents of 'packet' as a packet for this channel. Often, you
@@ -0,0 +1,203 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ChannelIdAllocator.h"
+#include <cstring>
+#include <cstdint>
+
+#if defined(Q_CC_MSVC)
+#include <intrin.h>
+#endif
+
+using namespace Protocol;
+
+// Index of the lowest set bit; 'value' must not be zero
+static inline int lowestSetBit(quint64 value)
+{
+#if defined(Q_CC_GNU)
+    return __builtin_ctzll(value);
+#elif defined(Q_CC_MSVC) && defined(Q_PROCESSOR_X86_64)
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return int(index);
+#else
+    int index = 0;
+    while (!(value & 1)) {
+        value >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+ChannelIdAllocator::ChannelIdAllocator(Parity parity)
+{
+    reset(parity);
+}
+
+void ChannelIdAllocator::reset(Parity parity)
+{
+    m_parity = parity;
+    m_used = 0;
+    m_cursor = 0;
+    memset(m_free, 0xff, sizeof(m_free));
+    memset(m_summary, 0xff, sizeof(m_summary));
+
+    // Even identifiers stop at 65534, so the last slot doesn't exist
+    m_capacity = SlotCount;
+    if (parity == EvenIdentifiers) {
+        setFree(SlotCount - 1, false);
+        m_capacity--;
+    }
+}
+
+bool ChannelIdAllocator::contains(int id) const
+{
+    if (m_parity == OddIdentifiers)
+        return id >= 1 && id <= UINT16_MAX && (id % 2) == 1;
+    else
+        return id >= 2 && id < UINT16_MAX && (id % 2) == 0;
+}
+
+int ChannelIdAllocator::slotForId(int id) const
+{
+    if (!contains(id))
+        return -1;
+    return (id - (m_parity == OddIdentifiers ? 1 : 2)) / 2;
+}
+
+int ChannelIdAllocator::idForSlot(int slot) const
+{
+    return slot * 2 + (m_parity == OddIdentifiers ? 1 : 2);
+}
+
+bool ChannelIdAllocator::isUsed(int id) const
+{
+    int slot = slotForId(id);
+    if (slot < 0)
+        return false;
+    return !(m_free[slot / 64] & (Q_UINT64_C(1) << (slot % 64)));
+}
+
+int ChannelIdAllocator::next() const
+{
+    if (m_used >= m_capacity)
+        return -1;
+
+    int slot = findFreeSlot(m_cursor);
+    if (slot < 0)
+        return -1;
+    return idForSlot(slot);
+}
+
+int ChannelIdAllocator::allocate()
+{
+    int id = next();
+    if (id < 0 || !acquire(id))
+        return -1;
+    return id;
+}
+
+bool ChannelIdAllocator::acquire(int id)
+{
+    int slot = slotForId(id);
+    if (slot < 0 || isUsed(id))
+        return false;
+
+    setFree(slot, false);
+    m_used++;
+    m_cursor = (slot + 1) % SlotCount;
+    return true;
+}
+
+bool ChannelIdAllocator::release(int id)
+{
+    int slot = slotForId(id);
+    if (slot < 0 || !isUsed(id))
+        return false;
+
+    setFree(slot, true);
+    m_used--;
+    return true;
+}
+
+void ChannelIdAllocator::setFree(int slot, bool free)
+{
+    int word = slot / 64;
+    quint64 bit = Q_UINT64_C(1) << (slot % 64);
+    quint64 summaryBit = Q_UINT64_C(1) << (word % 64);
+
+    if (free) {
+        m_free[word] |= bit;
+        m_summary[word / 64] |= summaryBit;
+    } else {
+        m_free[word] &= ~bit;
+        if (!m_free[word])
+            m_summary[word / 64] &= ~summaryBit;
+    }
+}
+
+/* Find the first free slot at or after 'from', wrapping around to the start
+ *
+ * Besides the word containing 'from', only the summary words are scanned to
+ * locate a word with a free slot, at most twice over when wrapping.
+ */
+int ChannelIdAllocator::findFreeSlot(int from) const
+{
+    int word = from / 64;
+    quint64 bits = m_free[word] & (~Q_UINT64_C(0) << (from % 64));
+    if (bits)
+        return word * 64 + lowestSetBit(bits);
+
+    // First word with a free slot, at or after 'fromWord', without wrapping
+    auto findWord = [this](int fromWord) -> int {
+        if (fromWord >= WordCount)
+            return -1;
+        int index = fromWord / 64;
+        quint64 summary = m_summary[index] & (~Q_UINT64_C(0) << (fromWord % 64));
+        while (!summary) {
+            if (++index >= SummaryCount)
+                return -1;
+            summary = m_summary[index];
+        }
+        return index * 64 + lowestSetBit(summary);
+    };
+
+    int found = findWord(word + 1);
+    if (found < 0)
+        found = findWord(0);
+    if (found < 0)
+        return -1;
+
+    // If the search wrapped back to 'word', its free slots are all before 'from'
+    return found * 64 + lowestSetBit(m_free[found]);
+}
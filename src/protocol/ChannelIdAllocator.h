@@ -0,0 +1,121 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_CHANNELIDALLOCATOR_H
+#define PROTOCOL_CHANNELIDALLOCATOR_H
+
+#include <QtGlobal>
+
+namespace Protocol
+{
+
+/* Tracks channel identifiers in use for one side of a connection
+ *
+ * Each side of a connection opens channels in its own half of the identifier
+ * space: the client uses odd numbers from 1 to 65535, and the server uses
+ * even numbers from 2 to 65534. Identifier 0 is the control channel, and is
+ * never allocated.
+ *
+ * Identifiers are held in a two-level bitmap, so finding, acquiring and
+ * releasing an identifier take a small, bounded number of operations
+ * regardless of how many channels are open. Free identifiers are handed out
+ * in order after the most recently acquired one, so an identifier that was
+ * just released isn't reused until the rest of the space has been cycled
+ * through. When every identifier is in use, next returns -1.
+ */
+class ChannelIdAllocator
+{
+public:
+    enum Parity {
+        OddIdentifiers,
+        EvenIdentifiers
+    };
+
+    explicit ChannelIdAllocator(Parity parity = OddIdentifiers);
+
+    /* Release all identifiers and switch to the given half of the space */
+    void reset(Parity parity);
+
+    Parity parity() const { return m_parity; }
+    /* Number of identifiers in this half of the space */
+    int capacity() const { return m_capacity; }
+    int usedCount() const { return m_used; }
+
+    /* True if 'id' belongs to this half of the identifier space */
+    bool contains(int id) const;
+    bool isUsed(int id) const;
+
+    /* Find the next free identifier, without acquiring it
+     *
+     * Returns -1 if all identifiers are in use.
+     */
+    int next() const;
+
+    /* Acquire the next free identifier; returns -1 if none are free */
+    int allocate();
+
+    /* Mark an identifier as used
+     *
+     * Returns false if 'id' isn't in this half of the space, or is already used.
+     */
+    bool acquire(int id);
+
+    /* Mark an identifier as free
+     *
+     * Returns false if 'id' isn't in this half of the space, or wasn't used.
+     */
+    bool release(int id);
+
+private:
+    static const int SlotCount = 32768;
+    static const int WordCount = SlotCount / 64;
+    static const int SummaryCount = WordCount / 64;
+
+    Parity m_parity;
+    int m_capacity;
+    int m_used;
+    // Slot from which the search for a free identifier begins
+    int m_cursor;
+    // Bit set for each free slot
+    quint64 m_free[WordCount];
+    // Bit set for each word of m_free that has any free slot
+    quint64 m_summary[SummaryCount];
+
+    int slotForId(int id) const;
+    int idForSlot(int slot) const;
+    int findFreeSlot(int from) const;
+    void setFree(int slot, bool free);
+};
+
+}
+
+#endif
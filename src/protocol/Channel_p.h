@@ -35,6 +35,7 @@
 
 #include "Channel.h"
 #include "Connection_p.h"
+#include "PacketCompression.h"
 #include "utils/Useful.h"
 #include <QDebug>
 
@@ -48,6 +49,10 @@ class ChannelPrivate : public QObject
     Q_DECLARE_PUBLIC(Channel)
 
 public:
+    // Default limits on pending outbound bytes for each channel
+    static const int DefaultHighWaterMark = 65536;
+    static const int DefaultLowWaterMark = 16384;
+
     explicit ChannelPrivate(Channel *q, const QString &type, Channel::Direction direction, Connection *conn);
     virtual ~ChannelPrivate();
 
@@ -59,9 +64,42 @@ public:
     bool isOpened;
     bool hasSentClose;
     bool isInvalidated;
+    // Outbound packets for urgent channels are written before any others
+    bool isUrgent;
+    // Share of the connection's bandwidth relative to other non-urgent channels
+    int weight;
+    // Limits on bytes pending for this channel; see Channel::canWrite
+    qint64 highWaterMark;
+    qint64 lowWaterMark;
+    // Set when canWrite has refused, until the writable signal is emitted
+    mutable bool isWriteBlocked;
+    // Ask to open the channel with compression, when the connection has the compression feature
+    bool isCompressible;
+    bool isCompressionRequested;
+    /* Streams for packets on a compressed channel, or null
+     *
+     * Outbound packets are built in compressionBuffer, and compressed into the
+     * connection's write queue on commit. Inbound packets are decompressed
+     * into decompressionBuffer, and passed to the channel as views into it.
+     */
+    QScopedPointer<PacketCompression> compression;
+    QByteArray compressionBuffer;
+    QByteArray decompressionBuffer;
+    int pendingPacketSize;
 
     void invalidate();
 
+    // Largest packet that can be sent; compressed channels need a byte for the packet's format
+    int maxPacketSize() const;
+
+    // Write a packet directly into the connection's write queue; see ConnectionPrivate::beginPacket
+    char *beginPacket(int maxSize);
+    bool commitPacket(int size);
+    void cancelPacket();
+
+    // Returns the data of an inbound packet on a compressed channel, or a null QByteArray if it's invalid
+    QByteArray decompressPacket(const QByteArray &packet);
+
     // Called by ControlChannel to act on valid channel request/result messages
     bool openChannelInbound(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result);
     bool openChannelOutbound(Data::Control::OpenChannel *request);
@@ -70,8 +108,9 @@ public:
 
 template<typename T> bool Channel::sendMessage(const T &message)
 {
-    int size = message.ByteSize();
-    if (size > ConnectionPrivate::PacketMaxDataSize) {
+    Q_D(Channel);
+    size_t size = message.ByteSizeLong();
+    if (size > size_t(d->maxPacketSize())) {
         BUG() << "Message on" << type() << "channel is too big -" << size << "bytes:"
               << QString::fromStdString(message.DebugString());
         return false;
@@ -83,15 +122,19 @@ template<typename T> bool Channel::sendMessage(const T &message)
         return false;
     }
 
-    QByteArray packet(size, 0);
-    quint8 *end = message.SerializeWithCachedSizesToArray(reinterpret_cast<quint8*>(packet.data()));
-    quint8 *expected_end = reinterpret_cast<quint8*>(packet.data() + size);
-    if (end != expected_end) {
-        BUG() << "Unexpected packet size after message serialization. Expected" << size << "but got" << qptrdiff(end - expected_end);
+    // Serialize directly into the connection's write queue, using the sizes cached by ByteSizeLong
+    quint8 *packet = reinterpret_cast<quint8*>(d->beginPacket(int(size)));
+    if (!packet)
+        return false;
+
+    quint8 *end = message.SerializeWithCachedSizesToArray(packet);
+    if (end != packet + size) {
+        BUG() << "Unexpected packet size after message serialization. Expected" << size << "but got" << qptrdiff(end - packet);
+        d->cancelPacket();
         return false;
     }
 
-    return sendPacket(packet);
+    return d->commitPacket(int(size));
 }
 
 }
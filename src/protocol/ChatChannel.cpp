@@ -34,16 +34,37 @@
 #include "Channel_p.h"
 #include "Connection.h"
 #include "utils/SecureRNG.h"
+#include "utils/Utf8.h"
 #include "utils/Useful.h"
 
 using namespace Protocol;
 
+constexpr const char *ChatChannel::TypeName;
+constexpr const char *ChatChannel::BatchFeature;
+constexpr const char *ChatChannel::CoalescedAckFeature;
+
 ChatChannel::ChatChannel(Direction direction, Connection *connection)
-    : Channel(QStringLiteral("im.ricochet.chat"), direction, connection)
+    : Channel(QString::fromLatin1(TypeName), direction, connection)
+    , isBatching(false)
+    , m_acknowledgeDelay(DefaultAcknowledgeDelay)
 {
     // The peer might use recent message IDs between connections to handle
     // re-send. Start at a random ID to reduce chance of collisions, then increment
     lastMessageId = SecureRNG::randomInt(UINT32_MAX);
+
+    // Chat is interactive, so it gets a larger share than bulk channels when both are busy
+    d_ptr->weight = 4;
+    d_ptr->isCompressible = true;
+
+    acknowledgeTimer.setSingleShot(true);
+    connect(&acknowledgeTimer, &QTimer::timeout, this, &ChatChannel::flushAcknowledgements);
+    // Acknowledgements that are still waiting must go out before the socket closes
+    connect(connection, &Connection::aboutToClose, this, &ChatChannel::flushAcknowledgements);
+}
+
+void ChatChannel::setAcknowledgeDelay(int msec)
+{
+    m_acknowledgeDelay = qBound(0, msec, int(MaxAcknowledgeDelay));
 }
 
 bool ChatChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result)
@@ -83,16 +104,25 @@ bool ChatChannel::allowOutboundChannelRequest(Data::Control::OpenChannel *reques
 
 void ChatChannel::receivePacket(const QByteArray &packet)
 {
-    Data::Chat::Packet message;
-    if (!message.ParseFromArray(packet.constData(), packet.size())) {
+    // Chat is most of the traffic on a connection, so it uses a decoder that
+    // doesn't copy the message text out of the packet.
+    ChatPacket message;
+    if (!message.parse(packet)) {
         closeChannel();
         return;
     }
 
-    if (message.has_chat_message()) {
-        handleChatMessage(message.chat_message());
-    } else if (message.has_chat_acknowledge()) {
-        handleChatAcknowledge(message.chat_acknowledge());
+    if (message.hasChatMessage() || !message.chatMessageBatch().isEmpty()) {
+        if (message.hasChatMessage())
+            handleChatMessage(message.chatMessage());
+        foreach (const ChatPacket::Message &batched, message.chatMessageBatch()) {
+            // Handling a message may close the channel
+            if (!isOpened())
+                break;
+            handleChatMessage(batched);
+        }
+    } else if (message.hasChatAcknowledge()) {
+        handleChatAcknowledge(message);
     } else {
         qWarning() << "Unrecognized message on" << type();
         closeChannel();
@@ -112,9 +142,6 @@ bool ChatChannel::sendChatMessageWithId(QString text, QDateTime time, MessageId
         return false;
     }
 
-    QScopedPointer<Data::Chat::ChatMessage> message(new Data::Chat::ChatMessage);
-    message->set_message_id(id);
-
     if (text.isEmpty()) {
         BUG() << "Chat message is empty, and it should've been discarded";
         return false;
@@ -123,56 +150,157 @@ bool ChatChannel::sendChatMessageWithId(QString text, QDateTime time, MessageId
         text.truncate(MessageMaxCharacters);
     }
 
-    // Also converts to UTF-8
-    message->set_message_text(text.toStdString());
-
+    qint64 timeDelta = 0;
     if (!time.isNull())
-        message->set_time_delta(qMin(QDateTime::currentDateTime().secsTo(time), qint64(0)));
+        timeDelta = qMin(QDateTime::currentDateTime().secsTo(time), qint64(0));
 
-    Data::Chat::Packet packet;
-    packet.set_allocated_chat_message(message.take());
-    if (!Channel::sendMessage(packet))
-        return false;
+    // Encode the text as UTF-8 straight into the outbound packet or batch
+    int maxSize = ChatPacket::maxChatMessageSize(text.size());
+    if (isBatching) {
+        int offset = batchPacket.size();
+        batchPacket.resize(offset + maxSize);
+        int size = ChatPacket::writeBatchedChatMessage(batchPacket.data() + offset, text, id, !time.isNull(), timeDelta);
+        if (size < 0) {
+            BUG() << "Chat message couldn't be encoded";
+            batchPacket.resize(offset);
+            return false;
+        }
+        batchPacket.resize(offset + size);
+
+        // If this message doesn't fit, send the ones before it and start the next packet
+        if (batchPacket.size() > d_ptr->maxPacketSize()) {
+            bool ok = sendPacket(batchPacket.left(offset));
+            batchPacket.remove(0, offset);
+            if (!ok) {
+                batchPacket.clear();
+                return false;
+            }
+        }
+    } else {
+        char *data = d_ptr->beginPacket(maxSize);
+        if (!data)
+            return false;
+
+        int size = ChatPacket::writeChatMessage(data, text, id, !time.isNull(), timeDelta);
+        if (size < 0) {
+            BUG() << "Chat message couldn't be encoded";
+            d_ptr->cancelPacket();
+            return false;
+        }
+
+        if (!d_ptr->commitPacket(size))
+            return false;
+    }
 
     pendingMessages.insert(id);
     return true;
 }
 
-void ChatChannel::handleChatMessage(const Data::Chat::ChatMessage &message)
+void ChatChannel::beginBatch()
+{
+    if (direction() != Outbound) {
+        BUG() << "Chat channels are unidirectional, and this is not an outbound channel";
+        return;
+    }
+
+    // Peers without the feature get one message per packet, as usual
+    isBatching = connection()->hasFeature(BatchFeature);
+}
+
+bool ChatChannel::endBatch()
+{
+    isBatching = false;
+    return flushBatch();
+}
+
+bool ChatChannel::flushBatch()
 {
-    QScopedPointer<Data::Chat::ChatAcknowledge> response(new Data::Chat::ChatAcknowledge);
+    if (batchPacket.isEmpty())
+        return true;
+
+    bool ok = sendPacket(batchPacket);
+    batchPacket.clear();
+    return ok;
+}
 
-    // QString::fromStdString decodes the string as UTF-8, replacing all invalid sequences and
-    // codepoints with the unicode replacement character.
-    QString text = QString::fromStdString(message.message_text());
+void ChatChannel::handleChatMessage(const ChatPacket::Message &message)
+{
+    // Invalid sequences and codepoints are replaced with the unicode
+    // replacement character, as QString::fromUtf8 does.
+    QByteArray utf8Text = message.text();
+    QString text = utf8ToString(utf8Text.constData(), utf8Text.size());
+    bool accepted = false;
 
     if (direction() != Inbound) {
         qWarning() << "Rejected inbound message on an outbound chat channel";
-        response->set_accepted(false);
     } else if (text.isEmpty()) {
         qWarning() << "Rejected empty chat message";
-        response->set_accepted(false);
     } else if (text.size() > MessageMaxCharacters) {
         qWarning() << "Rejected oversize chat message of" << text.size() << "characters";
-        response->set_accepted(false);
     } else {
         QDateTime time = QDateTime::currentDateTime();
-        if (message.has_time_delta() && message.time_delta() <= 0)
-            time = time.addSecs(message.time_delta());
+        if (message.hasTimeDelta() && message.timeDelta() <= 0)
+            time = time.addSecs(message.timeDelta());
+
+        emit messageReceived(text, time, message.messageId());
+        accepted = true;
+    }
 
-        emit messageReceived(text, time, message.message_id());
-        response->set_accepted(true);
+    if (!message.hasMessageId())
+        return;
+
+    if (!accepted || !connection()->hasFeature(CoalescedAckFeature)) {
+        // Earlier messages must still be acknowledged first
+        flushAcknowledgements();
+        sendAcknowledgement(message.messageId(), accepted);
+        return;
     }
 
-    if (message.has_message_id()) {
-        response->set_message_id(message.message_id());
-        Data::Chat::Packet packet;
-        packet.set_allocated_chat_acknowledge(response.take());
-        Channel::sendMessage(packet);
+    // Accepted messages are acknowledged together once the delay has passed
+    // since the first of them. The timer isn't restarted, so the delay is bounded.
+    pendingAcknowledgements.append(message.messageId());
+    if (pendingAcknowledgements.size() >= MaxCoalescedAcknowledgements)
+        flushAcknowledgements();
+    else if (!acknowledgeTimer.isActive())
+        acknowledgeTimer.start(m_acknowledgeDelay);
+}
+
+void ChatChannel::sendAcknowledgement(MessageId id, bool accepted)
+{
+    MessageArena arena(connection());
+    Data::Chat::Packet *packet = arena.create<Data::Chat::Packet>();
+    Data::Chat::ChatAcknowledge *response = packet->mutable_chat_acknowledge();
+    response->set_message_id(id);
+    response->set_accepted(accepted);
+    Channel::sendMessage(*packet);
+}
+
+void ChatChannel::prepareToClose()
+{
+    flushAcknowledgements();
+}
+
+void ChatChannel::flushAcknowledgements()
+{
+    acknowledgeTimer.stop();
+    if (pendingAcknowledgements.isEmpty() || !isOpened()) {
+        pendingAcknowledgements.clear();
+        return;
     }
+
+    MessageArena arena(connection());
+    Data::Chat::Packet *packet = arena.create<Data::Chat::Packet>();
+    Data::Chat::ChatAcknowledge *response = packet->mutable_chat_acknowledge();
+    response->set_message_id(pendingAcknowledgements.first());
+    response->set_accepted(true);
+    for (int i = 1; i < pendingAcknowledgements.size(); i++)
+        response->add_additional_message_id(pendingAcknowledgements[i]);
+    pendingAcknowledgements.clear();
+
+    Channel::sendMessage(*packet);
 }
 
-void ChatChannel::handleChatAcknowledge(const Data::Chat::ChatAcknowledge &message)
+void ChatChannel::handleChatAcknowledge(const ChatPacket &message)
 {
     if (direction() != Outbound) {
         qWarning() << "Rejected inbound acknowledgement on an inbound chat channel";
@@ -180,17 +308,23 @@ void ChatChannel::handleChatAcknowledge(const Data::Chat::ChatAcknowledge &messa
         return;
     }
 
-    if (!message.has_message_id()) {
+    if (!message.hasAcknowledgeId()) {
         qDebug() << "Chat acknowledgement doesn't have a message ID we understand";
         closeChannel();
         return;
     }
 
-    MessageId id = message.message_id();
-    if (pendingMessages.remove(id)) {
-        emit messageAcknowledged(id, message.accepted());
-    } else {
-        qDebug() << "Received chat acknowledgement for unknown message" << id;
-    }
+    auto acknowledge = [this,&message](MessageId id) {
+        if (pendingMessages.remove(id)) {
+            emit messageAcknowledged(id, message.accepted());
+        } else {
+            qDebug() << "Received chat acknowledgement for unknown message" << id;
+        }
+    };
+
+    // A coalesced acknowledgement lists more messages with the same result
+    acknowledge(message.acknowledgeId());
+    foreach (MessageId id, message.additionalAcknowledgeIds())
+        acknowledge(id);
 }
 
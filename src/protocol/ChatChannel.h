@@ -35,8 +35,11 @@
 
 #include "Channel.h"
 #include "ChatChannel.pb.h"
+#include "ChatPacket.h"
 #include <QDateTime>
 #include <QSet>
+#include <QTimer>
+#include <QVector>
 
 namespace Protocol
 {
@@ -49,12 +52,42 @@ class ChatChannel : public Channel
 public:
     typedef quint32 MessageId;
     static const int MessageMaxCharacters = 2000;
+    static constexpr const char *TypeName = "im.ricochet.chat";
+    // Feature allowing several messages in one packet; see ControlChannel::supportedFeatures
+    static constexpr const char *BatchFeature = "im.ricochet.chat.batch";
+    // Feature allowing one acknowledgement for several messages
+    static constexpr const char *CoalescedAckFeature = "im.ricochet.chat.coalesced-ack";
+    // Limits in milliseconds for setAcknowledgeDelay
+    static const int DefaultAcknowledgeDelay = 200;
+    static const int MaxAcknowledgeDelay = 2000;
 
     explicit ChatChannel(Direction direction, Connection *connection);
 
     bool sendChatMessage(QString text, QDateTime time, MessageId &id);
     bool sendChatMessageWithId(QString text, QDateTime time, MessageId id);
 
+    /* Combine the messages sent until endBatch into as few packets as possible
+     *
+     * If the peer has enabled BatchFeature, messages sent between beginBatch
+     * and endBatch are collected and sent together, in packets of up to the
+     * maximum packet size. Otherwise, each message is sent as its own packet
+     * immediately, as usual. This is used to send a backlog of messages.
+     */
+    void beginBatch();
+    /* Send any messages remaining in the batch; returns false if sending failed */
+    bool endBatch();
+
+    /* Longest time in milliseconds to hold acknowledgements of received messages
+     *
+     * If the peer has enabled CoalescedAckFeature, received messages that are
+     * accepted are acknowledged together in one packet, which is sent at most
+     * this long after the first of them arrived. A delay of 0 only combines
+     * messages that arrive together. Without the feature, each message is
+     * acknowledged immediately. The delay is limited to MaxAcknowledgeDelay.
+     */
+    int acknowledgeDelay() const { return m_acknowledgeDelay; }
+    void setAcknowledgeDelay(int msec);
+
 signals:
     void messageAcknowledged(MessageId id, bool accepted);
     void messageReceived(const QString &text, const QDateTime &time, MessageId id);
@@ -63,13 +96,29 @@ protected:
     virtual bool allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result);
     virtual bool allowOutboundChannelRequest(Data::Control::OpenChannel *request);
     virtual void receivePacket(const QByteArray &packet);
+    virtual void prepareToClose();
 
 private:
+    // Most messages acknowledged by one packet when acknowledgements are coalesced
+    static const int MaxCoalescedAcknowledgements = 1000;
+
     QSet<MessageId> pendingMessages;
     MessageId lastMessageId;
+    // Encoded entries of chat_message_batch that haven't been sent yet
+    QByteArray batchPacket;
+    bool isBatching;
+    // Accepted messages that haven't been acknowledged yet, in order of arrival
+    QVector<MessageId> pendingAcknowledgements;
+    QTimer acknowledgeTimer;
+    int m_acknowledgeDelay;
+
+    bool flushBatch();
+    void sendAcknowledgement(MessageId id, bool accepted);
+    void handleChatMessage(const ChatPacket::Message &message);
+    void handleChatAcknowledge(const ChatPacket &message);
 
-    void handleChatMessage(const Data::Chat::ChatMessage &message);
-    void handleChatAcknowledge(const Data::Chat::ChatAcknowledge &message);
+private slots:
+    void flushAcknowledgements();
 };
 
 }
@@ -0,0 +1,407 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ChatPacket.h"
+#include "utils/Utf8.h"
+#include <climits>
+#include <cstring>
+
+using namespace Protocol;
+
+namespace {
+
+// Same as the protobuf parser's default recursion limit
+const int RecursionLimit = 100;
+
+// Largest size of the tag and length of Packet.chat_message, then of message_text
+const int ChatMessageTextOffset = 1 + 5 + 1 + 5;
+
+enum WireType {
+    WireVarint = 0,
+    WireFixed64 = 1,
+    WireLengthDelimited = 2,
+    WireStartGroup = 3,
+    WireEndGroup = 4,
+    WireFixed32 = 5
+};
+
+/* Read a varint of up to 10 bytes
+ *
+ * Bits beyond 64 are discarded, as protobuf does.
+ */
+inline bool readVarint(const char *&p, const char *end, quint64 &value)
+{
+    value = 0;
+    for (int i = 0; i < 10; i++) {
+        if (p == end)
+            return false;
+        quint8 byte = quint8(*p++);
+        value |= quint64(byte & 0x7f) << (7 * i);
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+inline int varintSize(quint64 value)
+{
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+inline char *writeVarint(char *p, quint64 value)
+{
+    while (value >= 0x80) {
+        *p++ = char(quint8(value) | 0x80);
+        value >>= 7;
+    }
+    *p++ = char(value);
+    return p;
+}
+
+/* Read a field tag of up to 5 bytes, truncated to 32 bits */
+inline bool readTag(const char *&p, const char *end, quint32 &tag)
+{
+    tag = 0;
+    for (int i = 0; i < 5; i++) {
+        if (p == end)
+            return false;
+        quint8 byte = quint8(*p++);
+        tag |= quint32(byte & 0x7f) << (7 * i);
+        if (byte < 0x80)
+            return true;
+    }
+    return false;
+}
+
+/* Read the length of a length-delimited field, and check that the data is present
+ *
+ * Lengths are at most 5 bytes, and must fit in a positive int with protobuf's
+ * 16 bytes of headroom.
+ */
+inline bool readLength(const char *&p, const char *end, int &length)
+{
+    quint32 value = 0;
+    for (int i = 0; i < 5; i++) {
+        if (p == end)
+            return false;
+        quint8 byte = quint8(*p++);
+        if (i == 4 && byte >= 8)
+            return false;
+        value |= quint32(byte & 0x7f) << (7 * i);
+        if (byte < 0x80)
+            break;
+    }
+
+    if (value > quint32(INT_MAX - 16) || value > quint32(end - p))
+        return false;
+    length = int(value);
+    return true;
+}
+
+/* Skip the value of an unknown field with the given tag
+ *
+ * Groups are skipped up to their matching end tag, counting against the
+ * recursion limit. Field number 0 is never valid.
+ */
+bool skipField(const char *&p, const char *end, quint32 tag, int depth)
+{
+    if ((tag >> 3) == 0)
+        return false;
+
+    switch (tag & 7) {
+    case WireVarint: {
+        quint64 value;
+        return readVarint(p, end, value);
+    }
+    case WireFixed64:
+        if (end - p < 8)
+            return false;
+        p += 8;
+        return true;
+    case WireLengthDelimited: {
+        int length;
+        if (!readLength(p, end, length))
+            return false;
+        p += length;
+        return true;
+    }
+    case WireStartGroup:
+        if (--depth < 0)
+            return false;
+        for (;;) {
+            quint32 innerTag;
+            if (!readTag(p, end, innerTag) || innerTag == 0)
+                return false;
+            if ((innerTag & 7) == WireEndGroup)
+                return innerTag == tag + 1;
+            if (!skipField(p, end, innerTag, depth))
+                return false;
+        }
+    case WireFixed32:
+        if (end - p < 4)
+            return false;
+        p += 4;
+        return true;
+    default:
+        return false;
+    }
+}
+
+}
+
+ChatPacket::Message::Message()
+    : m_hasText(false)
+    , m_hasMessageId(false)
+    , m_hasTimeDelta(false)
+    , m_text("")
+    , m_textSize(0)
+    , m_messageId(0)
+    , m_timeDelta(0)
+{
+}
+
+ChatPacket::ChatPacket()
+{
+    clear();
+}
+
+void ChatPacket::clear()
+{
+    m_hasChatMessage = false;
+    m_hasChatAcknowledge = false;
+    m_hasAcknowledgeId = false;
+    m_accepted = true;
+    m_chatMessage = Message();
+    m_chatMessageBatch.clear();
+    m_acknowledgeId = 0;
+    m_additionalAcknowledgeIds.clear();
+}
+
+bool ChatPacket::parse(const char *data, int size)
+{
+    clear();
+    if (size < 0)
+        return false;
+    if (!parsePacket(data, data + size, RecursionLimit))
+        return false;
+
+    // message_text is a required field
+    if (m_hasChatMessage && !m_chatMessage.m_hasText)
+        return false;
+    foreach (const Message &message, m_chatMessageBatch) {
+        if (!message.m_hasText)
+            return false;
+    }
+    return true;
+}
+
+/* Each message is a sequence of fields until the end of its data. A zero tag
+ * or an end group tag would end the message early, which the protobuf parser
+ * treats as an error for both the outer packet and embedded messages.
+ */
+bool ChatPacket::parsePacket(const char *p, const char *end, int depth)
+{
+    while (p < end) {
+        quint32 tag;
+        if (!readTag(p, end, tag) || tag == 0 || (tag & 7) == WireEndGroup)
+            return false;
+
+        if ((tag & 7) == WireLengthDelimited && (tag >> 3) >= 1 && (tag >> 3) <= 3) {
+            int length;
+            if (!readLength(p, end, length) || depth - 1 < 0)
+                return false;
+
+            // Optional submessages that appear more than once are merged,
+            // and each occurrence of the repeated batch is a new message
+            bool ok;
+            switch (tag >> 3) {
+            case 1:
+                m_hasChatMessage = true;
+                ok = parseChatMessage(m_chatMessage, p, p + length, depth - 1);
+                break;
+            case 2:
+                ok = parseChatAcknowledge(p, p + length, depth - 1);
+                break;
+            default:
+                m_chatMessageBatch.append(Message());
+                ok = parseChatMessage(m_chatMessageBatch.last(), p, p + length, depth - 1);
+                break;
+            }
+            if (!ok)
+                return false;
+            p += length;
+        } else if (!skipField(p, end, tag, depth)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool ChatPacket::parseChatMessage(Message &message, const char *p, const char *end, int depth)
+{
+    while (p < end) {
+        quint32 tag;
+        if (!readTag(p, end, tag) || tag == 0 || (tag & 7) == WireEndGroup)
+            return false;
+
+        quint64 value;
+        switch (tag) {
+        case (1 << 3) | WireLengthDelimited: {
+            int length;
+            if (!readLength(p, end, length))
+                return false;
+            message.m_text = p;
+            message.m_textSize = length;
+            message.m_hasText = true;
+            p += length;
+            break;
+        }
+        case (2 << 3) | WireVarint:
+            if (!readVarint(p, end, value))
+                return false;
+            message.m_messageId = quint32(value);
+            message.m_hasMessageId = true;
+            break;
+        case (3 << 3) | WireVarint:
+            if (!readVarint(p, end, value))
+                return false;
+            message.m_timeDelta = qint64(value);
+            message.m_hasTimeDelta = true;
+            break;
+        default:
+            if (!skipField(p, end, tag, depth))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+bool ChatPacket::parseChatAcknowledge(const char *p, const char *end, int depth)
+{
+    m_hasChatAcknowledge = true;
+
+    while (p < end) {
+        quint32 tag;
+        if (!readTag(p, end, tag) || tag == 0 || (tag & 7) == WireEndGroup)
+            return false;
+
+        quint64 value;
+        switch (tag) {
+        case (1 << 3) | WireVarint:
+            if (!readVarint(p, end, value))
+                return false;
+            m_acknowledgeId = quint32(value);
+            m_hasAcknowledgeId = true;
+            break;
+        case (2 << 3) | WireVarint:
+            if (!readVarint(p, end, value))
+                return false;
+            m_accepted = value != 0;
+            break;
+        // additional_message_id is packed, but may also be sent as separate values
+        case (3 << 3) | WireVarint:
+            if (!readVarint(p, end, value))
+                return false;
+            m_additionalAcknowledgeIds.append(quint32(value));
+            break;
+        case (3 << 3) | WireLengthDelimited: {
+            int length;
+            if (!readLength(p, end, length))
+                return false;
+            const char *packedEnd = p + length;
+            while (p < packedEnd) {
+                if (!readVarint(p, packedEnd, value))
+                    return false;
+                m_additionalAcknowledgeIds.append(quint32(value));
+            }
+            break;
+        }
+        default:
+            if (!skipField(p, end, tag, depth))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+int ChatPacket::maxChatMessageSize(int textLength)
+{
+    // Text, then message_id and time_delta with their tags
+    return ChatMessageTextOffset + utf8MaxSize(textLength) + (1 + 5) + (1 + 10);
+}
+
+int ChatPacket::writeChatMessage(char *out, const QString &text, quint32 messageId, bool hasTimeDelta, qint64 timeDelta)
+{
+    return writeMessage(out, 0x0a, text, messageId, hasTimeDelta, timeDelta); // Packet.chat_message
+}
+
+int ChatPacket::writeBatchedChatMessage(char *out, const QString &text, quint32 messageId, bool hasTimeDelta, qint64 timeDelta)
+{
+    return writeMessage(out, 0x1a, text, messageId, hasTimeDelta, timeDelta); // Packet.chat_message_batch
+}
+
+int ChatPacket::writeMessage(char *out, quint8 fieldTag, const QString &text, quint32 messageId, bool hasTimeDelta, qint64 timeDelta)
+{
+    // The text is encoded first at the largest possible offset, and moved
+    // back once the size of the headers before it is known.
+    int textSize = stringToUtf8(text, out + ChatMessageTextOffset);
+    if (textSize < 0)
+        return -1;
+
+    int messageSize = 1 + varintSize(textSize) + textSize + 1 + varintSize(messageId);
+    if (hasTimeDelta)
+        messageSize += 1 + varintSize(quint64(timeDelta));
+
+    char *p = out;
+    *p++ = char(fieldTag);
+    p = writeVarint(p, messageSize);
+    *p++ = 0x0a; // ChatMessage.message_text
+    p = writeVarint(p, textSize);
+    memmove(p, out + ChatMessageTextOffset, textSize);
+    p += textSize;
+    *p++ = 0x10; // ChatMessage.message_id
+    p = writeVarint(p, messageId);
+    if (hasTimeDelta) {
+        *p++ = 0x18; // ChatMessage.time_delta
+        p = writeVarint(p, quint64(timeDelta));
+    }
+
+    return int(p - out);
+}
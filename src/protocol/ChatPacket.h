@@ -0,0 +1,145 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_CHATPACKET_H
+#define PROTOCOL_CHATPACKET_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+namespace Protocol
+{
+
+/* Decoder for packets on the chat channel
+ *
+ * This decodes the wire format of Data::Chat::Packet from ChatChannel.proto
+ * without copying anything, and only allocates for batches of messages or
+ * acknowledgements. The message text is a view into the packet data, which
+ * must stay valid for as long as it's used.
+ *
+ * The decoder accepts and rejects exactly the same inputs as the protobuf
+ * parser does for Packet::ParseFromArray, and gives the same field values:
+ * unknown fields and groups are skipped, fields with an unexpected wire type
+ * are treated as unknown, repeated occurrences of a field take the last value,
+ * repeated optional submessages are merged, and a ChatMessage without
+ * message_text is rejected because that field is required.
+ */
+class ChatPacket
+{
+public:
+    /* A ChatMessage, which is either chat_message or an entry of chat_message_batch */
+    class Message
+    {
+    public:
+        Message();
+
+        /* UTF-8 encoded text; a view into the packet data */
+        QByteArray text() const { return QByteArray::fromRawData(m_text, m_textSize); }
+        bool hasMessageId() const { return m_hasMessageId; }
+        quint32 messageId() const { return m_messageId; }
+        bool hasTimeDelta() const { return m_hasTimeDelta; }
+        qint64 timeDelta() const { return m_timeDelta; }
+
+    private:
+        friend class ChatPacket;
+
+        bool m_hasText;
+        bool m_hasMessageId;
+        bool m_hasTimeDelta;
+        const char *m_text;
+        int m_textSize;
+        quint32 m_messageId;
+        qint64 m_timeDelta;
+    };
+
+    ChatPacket();
+
+    /* Decode a packet, replacing any previous contents
+     *
+     * Returns false if the packet is invalid, in which case the contents
+     * are undefined.
+     */
+    bool parse(const char *data, int size);
+    bool parse(const QByteArray &data) { return parse(data.constData(), data.size()); }
+    void clear();
+
+    bool hasChatMessage() const { return m_hasChatMessage; }
+    const Message &chatMessage() const { return m_chatMessage; }
+
+    /* Messages of chat_message_batch, in order */
+    const QVector<Message> &chatMessageBatch() const { return m_chatMessageBatch; }
+
+    // ChatAcknowledge
+    bool hasChatAcknowledge() const { return m_hasChatAcknowledge; }
+    bool hasAcknowledgeId() const { return m_hasAcknowledgeId; }
+    quint32 acknowledgeId() const { return m_acknowledgeId; }
+    bool accepted() const { return m_accepted; }
+    /* Messages acknowledged with the same result as acknowledgeId */
+    const QVector<quint32> &additionalAcknowledgeIds() const { return m_additionalAcknowledgeIds; }
+
+    /* Upper bound on the size of the output of writeChatMessage or writeBatchedChatMessage */
+    static int maxChatMessageSize(int textLength);
+
+    /* Encode a Packet containing a ChatMessage directly into 'out'
+     *
+     * 'out' must have room for maxChatMessageSize(text.size()) bytes. The
+     * result is identical to serializing the equivalent Data::Chat::Packet.
+     * Returns the size of the packet, or -1 if the text can't be encoded.
+     */
+    static int writeChatMessage(char *out, const QString &text, quint32 messageId, bool hasTimeDelta, qint64 timeDelta);
+
+    /* Encode one entry of chat_message_batch directly into 'out'
+     *
+     * As writeChatMessage, but the result is a single field of a Packet.
+     * A batch packet is any number of these written one after another.
+     */
+    static int writeBatchedChatMessage(char *out, const QString &text, quint32 messageId, bool hasTimeDelta, qint64 timeDelta);
+
+private:
+    bool m_hasChatMessage;
+    bool m_hasChatAcknowledge;
+    bool m_hasAcknowledgeId;
+    bool m_accepted;
+    Message m_chatMessage;
+    QVector<Message> m_chatMessageBatch;
+    quint32 m_acknowledgeId;
+    QVector<quint32> m_additionalAcknowledgeIds;
+
+    bool parsePacket(const char *p, const char *end, int depth);
+    bool parseChatMessage(Message &message, const char *p, const char *end, int depth);
+    bool parseChatAcknowledge(const char *p, const char *end, int depth);
+    static int writeMessage(char *out, quint8 fieldTag, const QString &text, quint32 messageId, bool hasTimeDelta, qint64 timeDelta);
+};
+}
+
+#endif
@@ -31,10 +31,12 @@
  */
 
 #include "Connection_p.h"
+#include "Channel_p.h"
 #include "ControlChannel.h"
 #include "utils/Useful.h"
 #include <QTcpSocket>
 #include <QTimer>
+#include <QPointer>
 #include <QtEndian>
 #include <QDebug>
 
@@ -47,6 +49,19 @@ Connection::Connection(QTcpSocket *socket, Direction direction)
     d->setSocket(socket, direction);
 }
 
+Connection::Connection()
+    : QObject()
+    , d(new ConnectionPrivate(this))
+{
+}
+
+Connection *Connection::optimisticClient(QTcpSocket *socket, int version)
+{
+    Connection *connection = new Connection;
+    connection->d->setSocket(socket, ClientSide, version);
+    return connection;
+}
+
 ConnectionPrivate::ConnectionPrivate(Connection *qq)
     : QObject(qq)
     , q(qq)
@@ -55,10 +70,35 @@ ConnectionPrivate::ConnectionPrivate(Connection *qq)
     , purpose(Connection::Purpose::Unknown)
     , wasClosed(false)
     , handshakeDone(false)
-    , nextOutboundChannelId(-1)
+    , protocolVersion(ProtocolVersionMin)
+    , isOptimistic(false)
+    , readStart(0)
+    , readEnd(0)
+    , isReadingPackets(false)
+    , scheduledPosition(0)
+    , pendingPacketOffset(-1)
+    , pendingPacketChannel(-1)
+    , pendingPacketHeaderSize(0)
+    , queuedByteCount(0)
+    , highWaterMark(DefaultHighWaterMark)
+    , lowWaterMark(DefaultLowWaterMark)
+    , hasBlockedChannels(false)
+    , messageArenaBlock(new char[MessageArenaBlockSize])
+    , messageArenaScopes(0)
 {
     ageTimer.start();
 
+    google::protobuf::ArenaOptions arenaOptions;
+    arenaOptions.initial_block = messageArenaBlock.data();
+    arenaOptions.initial_block_size = MessageArenaBlockSize;
+    messageArena.reset(new google::protobuf::Arena(arenaOptions));
+
+    memset(&writeStatistics, 0, sizeof(writeStatistics));
+    memset(&compressionStatistics, 0, sizeof(compressionStatistics));
+    flushTimer.setSingleShot(true);
+    flushTimer.setInterval(0);
+    connect(&flushTimer, &QTimer::timeout, this, &ConnectionPrivate::flushWrites);
+
     QTimer *timeout = new QTimer(this);
     timeout->setSingleShot(true);
     timeout->setInterval(UnknownPurposeTimeout * 1000);
@@ -116,6 +156,11 @@ bool Connection::isConnected() const
     return re;
 }
 
+int Connection::protocolVersion() const
+{
+    return d->protocolVersion;
+}
+
 QString Connection::serverHostname() const
 {
     QString hostname;
@@ -137,7 +182,7 @@ int Connection::age() const
     return qRound(d->ageTimer.elapsed() / 1000.0);
 }
 
-void ConnectionPrivate::setSocket(QTcpSocket *s, Connection::Direction d)
+void ConnectionPrivate::setSocket(QTcpSocket *s, Connection::Direction d, int optimisticVersion)
 {
     if (socket) {
         BUG() << "Connection already has a socket";
@@ -146,8 +191,12 @@ void ConnectionPrivate::setSocket(QTcpSocket *s, Connection::Direction d)
 
     socket = s;
     direction = d;
+    // Server opens even-numbered channels, client opens odd-numbered
+    outboundChannelIds.reset(direction == Connection::ServerSide ? ChannelIdAllocator::EvenIdentifiers
+                                                                 : ChannelIdAllocator::OddIdentifiers);
     connect(socket, &QAbstractSocket::disconnected, this, &ConnectionPrivate::socketDisconnected);
     connect(socket, &QIODevice::readyRead, this, &ConnectionPrivate::socketReadable);
+    connect(socket, &QIODevice::bytesWritten, this, &ConnectionPrivate::socketWritten);
 
     socket->setParent(q);
 
@@ -177,9 +226,27 @@ void ConnectionPrivate::setSocket(QTcpSocket *s, Connection::Direction d)
 
         q->grantAuthentication(Connection::HiddenServiceAuth, serverName);
 
+        if (optimisticVersion && (optimisticVersion < ProtocolVersionMin || optimisticVersion > ProtocolVersion)) {
+            BUG() << "Cannot assume unsupported protocol version" << optimisticVersion << "for connection";
+            optimisticVersion = 0;
+        }
+
         // Send the introduction version handshake message
-        char intro[] = { 0x49, 0x4D, 0x02, ProtocolVersion, 0 };
-        if (socket->write(intro, sizeof(intro)) < (int)sizeof(intro)) {
+        QByteArray intro;
+        if (optimisticVersion) {
+            // Offer only the assumed version, so that packets can be written in its format now
+            char optimisticIntro[] = { 0x49, 0x4D, 0x01, char(optimisticVersion) };
+            intro = QByteArray(optimisticIntro, sizeof(optimisticIntro));
+            protocolVersion = quint8(optimisticVersion);
+            isOptimistic = true;
+        } else {
+            // Version 0 is answered by Ricochet 1.0 servers; see oldVersionNegotiated
+            Q_STATIC_ASSERT(ProtocolVersion == ProtocolVersionMin + 1);
+            char fullIntro[] = { 0x49, 0x4D, 0x03, ProtocolVersion, ProtocolVersionMin, 0 };
+            intro = QByteArray(fullIntro, sizeof(fullIntro));
+        }
+
+        if (socket->write(intro) < intro.size()) {
             qDebug() << "Failed writing introduction message to socket";
             q->close();
             return;
@@ -192,6 +259,9 @@ void Connection::close()
     if (isConnected()) {
         Q_ASSERT(!d->wasClosed);
         qDebug() << "Disconnecting socket for connection" << this;
+        emit aboutToClose();
+        // Queued packets must reach the socket before it's closed
+        d->writeQueuedPackets(-1);
         d->socket->disconnectFromHost();
 
         // If not fully closed in 5 seconds, abort
@@ -204,6 +274,9 @@ void Connection::close()
 
 void ConnectionPrivate::closeImmediately()
 {
+    flushTimer.stop();
+    discardQueuedPackets();
+
     if (socket)
         socket->abort();
 
@@ -246,18 +319,27 @@ void ConnectionPrivate::socketReadable()
             }
 
             handshakeDone = true;
-            if (version == 0) {
+            if (isOptimistic && version != protocolVersion) {
+                // Packets were already written in the format of the assumed version
+                qDebug() << "Server in optimistic outbound connection selected version" << version
+                         << "instead of" << protocolVersion;
+                emit q->versionNegotiationFailed();
+                socket->abort();
+                return;
+            } else if (version == 0) {
                 qDebug() << "Server in outbound connection is using the version 1.0 protocol";
                 emit q->oldVersionNegotiated(socket);
                 q->close();
                 return;
-            } else if (version != ProtocolVersion) {
+            } else if (version < ProtocolVersionMin || version > ProtocolVersion) {
                 qDebug() << "Version negotiation failed on outbound connection";
                 emit q->versionNegotiationFailed();
                 socket->abort();
                 return;
-            } else
+            } else {
+                protocolVersion = version;
                 emit q->ready();
+            }
         } else if (direction == Connection::ServerSide && available >= 3) {
             // Expecting at least 3 bytes
             uchar intro[3] = { 0 };
@@ -289,13 +371,8 @@ void ConnectionPrivate::socketReadable()
                 return;
             }
 
-            quint8 selectedVersion = ProtocolVersionFailed;
-            foreach (quint8 v, versions) {
-                if (v == ProtocolVersion) {
-                    selectedVersion = v;
-                    break;
-                }
-            }
+            // Use the newest version that both sides support
+            quint8 selectedVersion = PacketHeader::selectVersion(versions, ProtocolVersionMin, ProtocolVersion);
 
             re = socket->write(reinterpret_cast<char*>(&selectedVersion), 1);
             if (re != 1) {
@@ -305,102 +382,151 @@ void ConnectionPrivate::socketReadable()
             }
 
             handshakeDone = true;
-            if (selectedVersion != ProtocolVersion) {
+            if (selectedVersion == ProtocolVersionFailed) {
                 qDebug() << "Version negotiation failed on inbound connection";
                 emit q->versionNegotiationFailed();
                 // Close gracefully to allow the response to write
                 q->close();
                 return;
-            } else
+            } else {
+                protocolVersion = selectedVersion;
                 emit q->ready();
+            }
         } else {
             return;
         }
     }
 
-    qint64 available;
-    while ((available = socket->bytesAvailable()) >= PacketHeaderSize) {
-        uchar header[PacketHeaderSize];
-        // Peek at the header first, to read the size of the packet and make sure
-        // the entire thing is available within the buffer.
-        qint64 re = socket->peek(reinterpret_cast<char*>(header), PacketHeaderSize);
-        if (re < 0) {
-            qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
-            socket->abort();
-            return;
-        } else if (re < PacketHeaderSize) {
-            BUG() << "Socket had" << available << "bytes available but peek only returned" << re;
-            return;
-        }
+    // Packets are parsed in place from readBuffer. If a packet handler re-enters
+    // the event loop and this is called again, the outer call continues reading
+    // once the handler returns.
+    if (isReadingPackets)
+        return;
+    isReadingPackets = true;
 
-        Q_STATIC_ASSERT(PacketHeaderSize == 4);
-        quint16 packetSize = qFromBigEndian<quint16>(header);
-        quint16 channelId = qFromBigEndian<quint16>(&header[2]);
+    // Messages parsed from this batch of packets share the arena, which is reset afterwards
+    MessageArena arena(q);
 
-        if (packetSize < PacketHeaderSize) {
-            qWarning() << "Corrupted data from connection (packet size is too small); disconnecting";
-            socket->abort();
-            return;
+    while (socket->isOpen() && fillReadBuffer()) {
+        while (readEnd > readStart) {
+            const uchar *header = reinterpret_cast<const uchar*>(readBuffer.constData()) + readStart;
+            int headerSize, dataSize, channelId;
+            int re = parsePacketHeader(header, readEnd - readStart, &headerSize, &dataSize, &channelId);
+            if (re < 0) {
+                socket->abort();
+                break;
+            }
+
+            if (re == 0 || headerSize + dataSize > readEnd - readStart)
+                break;
+
+            // The packet is a view into readBuffer, which is not modified until it has been handled
+            QByteArray data = QByteArray::fromRawData(reinterpret_cast<const char*>(header) + headerSize, dataSize);
+            readStart += headerSize + dataSize;
+            dispatchPacket(channelId, data);
+
+            if (!socket->isOpen())
+                break;
         }
 
-        if (packetSize > available)
+        if (!socket->isOpen() || socket->bytesAvailable() < 1)
             break;
+    }
 
-        // Read header out of the buffer and discard
-        re = socket->read(reinterpret_cast<char*>(header), PacketHeaderSize);
-        if (re != PacketHeaderSize) {
-            if (re < 0) {
-                qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
-            } else {
-                // Because of QTcpSocket buffering, we can expect that up to 'available' bytes
-                // will read. Treat anything less as an error condition.
-                BUG() << "Socket read was unexpectedly small;" << available << "bytes should've been available but we read" << re;
-            }
-            socket->abort();
-            return;
-        }
+    if (!socket->isOpen())
+        readStart = readEnd = 0;
+    isReadingPackets = false;
+}
 
-        // Read data
-        QByteArray data(packetSize - PacketHeaderSize, 0);
-        re = (data.size() == 0) ? 0 : socket->read(data.data(), data.size());
-        if (re != data.size()) {
-            if (re < 0) {
-                qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
-            } else {
-                // As above
-                BUG() << "Socket read was unexpectedly small;" << available << "bytes should've been available but we read" << re;
-            }
-            socket->abort();
-            return;
-        }
+/* Read all available data from the socket into readBuffer
+ *
+ * The buffer is grown if necessary to fit the next packet. If the next packet
+ * would not fit in the space after readEnd, the unparsed data is first moved
+ * back to the start of the buffer. That is the only case in which inbound
+ * data is copied.
+ *
+ * Returns false if the socket failed, in which case it has been aborted.
+ */
+bool ConnectionPrivate::fillReadBuffer()
+{
+    int pending = readEnd - readStart;
+    if (pending == 0)
+        readStart = readEnd = 0;
+
+    int needed = protocolVersion < 2 ? PacketHeaderSize : LargePacketHeaderMaxSize;
+    int headerSize, dataSize, channelId;
+    if (parsePacketHeader(reinterpret_cast<const uchar*>(readBuffer.constData()) + readStart, pending,
+                          &headerSize, &dataSize, &channelId) > 0)
+    {
+        needed = headerSize + dataSize;
+    }
 
-        Channel *channel = q->channel(channelId);
-        if (!channel) {
-            // XXX We should sanity-check and rate limit these responses better
-            if (data.isEmpty()) {
-                qDebug() << "Ignoring channel close message for non-existent channel" << channelId;
-            } else {
-                qDebug() << "Ignoring" << data.size() << "byte packet for non-existent channel" << channelId;
-                // Send channel close message
-                writePacket(channelId, QByteArray());
-            }
-            continue;
-        }
+    if (readStart > 0 && readStart + needed > readBuffer.size()) {
+        memmove(readBuffer.data(), readBuffer.constData() + readStart, pending);
+        readStart = 0;
+        readEnd = pending;
+    }
 
-        if (channel->connection() != q) {
-            // If this fails, something is extremely broken. It may be dangerous to continue
-            // processing any data at all. Crash gracefully.
-            BUG() << "Channel" << channelId << "found on connection" << this << "but its connection is"
-                  << channel->connection();
-            qFatal("Connection mismatch while handling packet");
-            return;
-        }
+    if (needed > readBuffer.size() || readBuffer.isEmpty())
+        readBuffer.resize(qMax<int>(needed, ReadBufferSize));
 
+    qint64 re = socket->read(readBuffer.data() + readEnd, readBuffer.size() - readEnd);
+    if (re < 0) {
+        qDebug() << "Connection socket error" << socket->error() << "during read:" << socket->errorString();
+        socket->abort();
+        return false;
+    }
+
+    readEnd += int(re);
+    return true;
+}
+
+/* Parse the header of the packet at the start of 'data'
+ *
+ * Returns 1 and sets the header size, data size, and channel if the header is
+ * complete, 0 if more data is needed, or -1 if the header is invalid.
+ */
+int ConnectionPrivate::parsePacketHeader(const uchar *data, int available, int *headerSize, int *dataSize, int *channelId) const
+{
+    return PacketHeader::parse(protocolVersion, data, available, maxInboundPacketDataSize(), headerSize, dataSize, channelId);
+}
+
+void ConnectionPrivate::dispatchPacket(int channelId, const QByteArray &data)
+{
+    Channel *channel = q->channel(channelId);
+    if (!channel) {
+        // XXX We should sanity-check and rate limit these responses better
         if (data.isEmpty()) {
+            qDebug() << "Ignoring channel close message for non-existent channel" << channelId;
+        } else {
+            qDebug() << "Ignoring" << data.size() << "byte packet for non-existent channel" << channelId;
+            // Send channel close message
+            writePacket(channelId, QByteArray());
+        }
+        return;
+    }
+
+    if (channel->connection() != q) {
+        // If this fails, something is extremely broken. It may be dangerous to continue
+        // processing any data at all. Crash gracefully.
+        BUG() << "Channel" << channelId << "found on connection" << this << "but its connection is"
+              << channel->connection();
+        qFatal("Connection mismatch while handling packet");
+        return;
+    }
+
+    if (data.isEmpty()) {
+        channel->closeChannel();
+    } else if (channel->d_ptr->compression) {
+        QByteArray packet = channel->d_ptr->decompressPacket(data);
+        if (packet.isNull()) {
+            qDebug() << "Closing" << channel->type() << "channel after invalid compressed packet";
             channel->closeChannel();
         } else {
-            channel->receivePacket(data);
+            channel->receivePacket(packet);
         }
+    } else {
+        channel->receivePacket(data);
     }
 }
 
@@ -419,83 +545,470 @@ bool ConnectionPrivate::writePacket(Channel *channel, const QByteArray &data)
 
 bool ConnectionPrivate::writePacket(int channelId, const QByteArray &data)
 {
+    char *packet = beginPacket(channelId, data.size());
+    if (!packet)
+        return false;
+
+    if (!data.isEmpty())
+        memcpy(packet, data.constData(), data.size());
+    return commitPacket(data.size());
+}
+
+/* Large packets are only exchanged once the client has authenticated, so an
+ * unauthenticated peer can't make either side buffer more than a version 1
+ * packet. The server is authenticated by the transport, so a client accepts
+ * them from the start, and sends them once the server knows it as a contact.
+ */
+int ConnectionPrivate::maxPacketDataSize() const
+{
+    if (protocolVersion < 2)
+        return PacketMaxDataSize;
+    if (direction == Connection::ClientSide && !authentication.contains(Connection::KnownToPeer))
+        return PacketMaxDataSize;
+    return LargePacketMaxDataSize;
+}
+
+int ConnectionPrivate::maxInboundPacketDataSize() const
+{
+    if (protocolVersion < 2 || !authentication.contains(Connection::HiddenServiceAuth))
+        return PacketMaxDataSize;
+    return LargePacketMaxDataSize;
+}
+
+/* Reserve space for a packet at the end of the channel's outbound queue
+ *
+ * Returns a pointer to 'maxSize' bytes in the queue, where the packet data
+ * is to be written directly, or null if the packet can't be sent. The packet
+ * must be completed with commitPacket or removed with cancelPacket before
+ * anything else is written to the connection.
+ */
+char *ConnectionPrivate::beginPacket(int channelId, int maxSize)
+{
+    if (pendingPacketOffset >= 0) {
+        BUG() << "Cannot begin a packet while another is pending on the connection";
+        return 0;
+    }
+
     if (channelId < 0 || channelId > UINT16_MAX) {
         BUG() << "Cannot write packet for channel with invalid identifier" << channelId;
-        return false;
+        return 0;
     }
 
-    if (data.size() > PacketMaxDataSize) {
-        BUG() << "Cannot write oversized packet of" << data.size() << "bytes to channel" << channelId;
-        return false;
+    if (maxSize < 0 || maxSize > maxPacketDataSize()) {
+        BUG() << "Cannot write oversized packet of" << maxSize << "bytes to channel" << channelId;
+        return 0;
     }
 
     if (!q->isConnected()) {
         qDebug() << "Cannot write packet to closed connection";
+        return 0;
+    }
+
+    // Version 2 headers have room for a size of up to maxSize, and no flags
+    int headerSize = PacketHeaderSize;
+    if (protocolVersion >= 2)
+        headerSize = PacketHeader::varintSize(quint32(maxSize)) + PacketHeader::varintSize(quint32(channelId) << 1);
+
+    OutboundQueue &queue = outboundQueue(channelId);
+    pendingPacketOffset = queue.data.size();
+    pendingPacketChannel = channelId;
+    pendingPacketHeaderSize = headerSize;
+    queue.data.resize(pendingPacketOffset + headerSize + maxSize);
+    return queue.data.data() + pendingPacketOffset + headerSize;
+}
+
+/* Complete the pending packet from beginPacket with 'size' bytes of data
+ *
+ * 'size' may be smaller than the space that was reserved.
+ */
+bool ConnectionPrivate::commitPacket(int size)
+{
+    if (pendingPacketOffset < 0) {
+        BUG() << "Cannot commit a packet that was never started";
         return false;
     }
 
-    Q_STATIC_ASSERT(PacketHeaderSize + PacketMaxDataSize <= UINT16_MAX);
-    Q_STATIC_ASSERT(PacketHeaderSize == 4);
-    uchar header[PacketHeaderSize] = { 0 };
-    qToBigEndian(static_cast<quint16>(PacketHeaderSize + data.size()), header);
-    qToBigEndian(static_cast<quint16>(channelId), &header[2]);
+    OutboundQueue &queue = outboundQueues[pendingPacketChannel];
+    int maxSize = queue.data.size() - pendingPacketOffset - pendingPacketHeaderSize;
+    if (size < 0 || size > maxSize) {
+        BUG() << "Cannot commit packet of" << size << "bytes in" << maxSize << "bytes of reserved space";
+        cancelPacket();
+        return false;
+    }
 
-    qint64 re = socket->write(reinterpret_cast<char*>(header), PacketHeaderSize);
-    if (re != PacketHeaderSize) {
-        qDebug() << "Connection socket error" << socket->error() << "during write:" << socket->errorString();
-        socket->abort();
+    uchar *header = reinterpret_cast<uchar*>(queue.data.data()) + pendingPacketOffset;
+    if (protocolVersion < 2) {
+        Q_STATIC_ASSERT(PacketHeaderSize + PacketMaxDataSize <= UINT16_MAX);
+        Q_STATIC_ASSERT(PacketHeaderSize == 4);
+        qToBigEndian(static_cast<quint16>(PacketHeaderSize + size), header);
+        qToBigEndian(static_cast<quint16>(pendingPacketChannel), &header[2]);
+    } else {
+        // The size is padded to the space reserved for maxSize, so the data doesn't move
+        Q_STATIC_ASSERT(LargePacketMaxDataSize < (1 << (7 * PacketHeader::VarintMaxSize)));
+        int channelBytes = PacketHeader::varintSize(quint32(pendingPacketChannel) << 1);
+        header = PacketHeader::writeVarint(header, quint32(size), pendingPacketHeaderSize - channelBytes);
+        PacketHeader::writeVarint(header, quint32(pendingPacketChannel) << 1, channelBytes);
+    }
+
+    int packetSize = pendingPacketHeaderSize + size;
+    queue.data.resize(pendingPacketOffset + packetSize);
+    pendingPacketOffset = -1;
+    if (size == 0)
+        queue.hasPendingClose = true;
+
+    if (queue.packetSizes.isEmpty()) {
+        if (queue.isUrgent)
+            urgentQueues.append(pendingPacketChannel);
+        else
+            scheduledQueues.append(pendingPacketChannel);
+    }
+    queue.packetSizes.enqueue(packetSize);
+    queuedByteCount += packetSize;
+
+    // Packets are written to the socket at the end of this event loop
+    // iteration, unless something calls flushWrites first.
+    if (!flushTimer.isActive())
+        flushTimer.start();
+
+    return true;
+}
+
+void ConnectionPrivate::cancelPacket()
+{
+    if (pendingPacketOffset < 0)
+        return;
+
+    OutboundQueue &queue = outboundQueues[pendingPacketChannel];
+    queue.data.resize(pendingPacketOffset);
+    pendingPacketOffset = -1;
+
+    // The channel may have been removed while the packet was pending
+    if (queue.packetSizes.isEmpty() && !channels.contains(pendingPacketChannel))
+        releaseOutboundQueue(pendingPacketChannel);
+}
+
+/* Find or create the outbound queue for a channel identifier
+ *
+ * The control channel and channels that ask for it (such as authentication)
+ * are urgent: their packets are written before anything else. Other channels
+ * share the remaining bandwidth by weight.
+ */
+ConnectionPrivate::OutboundQueue &ConnectionPrivate::outboundQueue(int channelId)
+{
+    auto it = outboundQueues.find(channelId);
+    if (it != outboundQueues.end())
+        return *it;
+
+    OutboundQueue queue;
+    Channel *channel = channels.value(channelId);
+    if (channelId == 0 || (channel && channel->d_ptr->isUrgent)) {
+        queue.isUrgent = true;
+    } else if (channel) {
+        queue.weight = qMax(1, channel->d_ptr->weight);
+    }
+
+    return *outboundQueues.insert(channelId, queue);
+}
+
+/* Write queued packets to the socket
+ *
+ * Queues that end with a channel's close packet are written first, in full,
+ * so that the close always arrives before control packets that were sent
+ * after it. All packets in urgent queues are written next. Packets for other
+ * channels are then written using deficit round-robin scheduling by weight
+ * until the socket has SocketWriteBudget bytes waiting to be written, so
+ * that urgent packets never wait behind a large backlog in the socket.
+ * The remaining packets are written as the socket drains.
+ *
+ * Each channel's queue is written as a contiguous run of packets, and all
+ * writes land in the socket's buffer to be sent together by the event loop.
+ *
+ * A negative budget writes all queued packets. Returns false if the socket
+ * failed, in which case it has been aborted and all queues are discarded.
+ */
+bool ConnectionPrivate::writeQueuedPackets(qint64 budget)
+{
+    flushTimer.stop();
+    if (pendingPacketOffset >= 0) {
+        BUG() << "Flushing writes with an incomplete packet in the queue";
+        cancelPacket();
+    }
+
+    if (urgentQueues.isEmpty() && scheduledQueues.isEmpty())
+        return true;
+
+    if (!socket || !socket->isOpen()) {
+        qDebug() << "Discarding queued packets for closed connection";
+        discardQueuedPackets();
         return false;
     }
 
-    re = socket->write(data);
-    if (re != data.size()) {
+    int packets = 0;
+    qint64 bytes = 0;
+
+    for (int i = 0; i < scheduledQueues.size(); ) {
+        int channelId = scheduledQueues[i];
+        OutboundQueue &queue = outboundQueues[channelId];
+        if (!queue.hasPendingClose) {
+            i++;
+            continue;
+        }
+
+        scheduledQueues.removeAt(i);
+        if (scheduledPosition > i)
+            scheduledPosition--;
+        queue.deficit = 0;
+
+        int size = queue.data.size() - queue.offset;
+        packets += queue.packetSizes.size();
+        queue.packetSizes.clear();
+        if (!writeQueue(channelId, queue, size))
+            return false;
+        bytes += size;
+    }
+
+    while (!urgentQueues.isEmpty()) {
+        int channelId = urgentQueues.takeFirst();
+        OutboundQueue &queue = outboundQueues[channelId];
+        int size = queue.data.size() - queue.offset;
+        packets += queue.packetSizes.size();
+        queue.packetSizes.clear();
+        if (!writeQueue(channelId, queue, size))
+            return false;
+        bytes += size;
+    }
+
+    while (!scheduledQueues.isEmpty() && (budget < 0 || socket->bytesToWrite() < budget)) {
+        if (scheduledPosition >= scheduledQueues.size())
+            scheduledPosition = 0;
+
+        int channelId = scheduledQueues[scheduledPosition];
+        OutboundQueue &queue = outboundQueues[channelId];
+        queue.deficit += SchedulerQuantum * queue.weight;
+
+        int size = 0;
+        while (!queue.packetSizes.isEmpty() && (budget < 0 || queue.packetSizes.head() <= queue.deficit)) {
+            int packetSize = queue.packetSizes.dequeue();
+            queue.deficit -= packetSize;
+            size += packetSize;
+            packets++;
+        }
+
+        if (queue.packetSizes.isEmpty()) {
+            // Idle queues don't keep their deficit in round-robin scheduling
+            queue.deficit = 0;
+            scheduledQueues.removeAt(scheduledPosition);
+        } else {
+            scheduledPosition++;
+        }
+
+        if (size > 0 && !writeQueue(channelId, queue, size))
+            return false;
+        bytes += size;
+    }
+
+    if (packets > 0) {
+        writeStatistics.packets += packets;
+        writeStatistics.bytes += bytes;
+        writeStatistics.flushes++;
+        writeStatistics.largestFlush = qMax(writeStatistics.largestFlush, packets);
+    }
+    return true;
+}
+
+/* Write the next 'size' bytes of a channel's queue to the socket
+ *
+ * The queue and its channel identifier are released if it has been fully
+ * written and the channel no longer exists.
+ */
+bool ConnectionPrivate::writeQueue(int channelId, OutboundQueue &queue, int size)
+{
+    qint64 re = socket->write(queue.data.constData() + queue.offset, size);
+    if (re != size) {
         qDebug() << "Connection socket error" << socket->error() << "during write:" << socket->errorString();
+        discardQueuedPackets();
         socket->abort();
         return false;
     }
 
+    queue.offset += size;
+    queuedByteCount -= size;
+    if (queue.offset == queue.data.size()) {
+        if (!channels.contains(channelId)) {
+            releaseOutboundQueue(channelId);
+        } else {
+            queue.data.resize(0);
+            queue.offset = 0;
+            queue.hasPendingClose = false;
+        }
+    } else if (queue.offset >= SocketWriteBudget && queue.offset * 2 >= queue.data.size()) {
+        queue.data.remove(0, queue.offset);
+        queue.offset = 0;
+    }
+
     return true;
 }
 
-int ConnectionPrivate::availableOutboundChannelId()
+/* Remove the queue of a channel that no longer exists
+ *
+ * The channel's identifier can't be used for a new channel until this
+ * point, so the new channel never shares a queue with packets of the old one.
+ */
+void ConnectionPrivate::releaseOutboundQueue(int channelId)
+{
+    outboundQueues.remove(channelId);
+    outboundChannelIds.release(channelId);
+}
+
+void ConnectionPrivate::discardQueuedPackets()
 {
-    // Server opens even-nubmered channels, client opens odd-numbered
-    bool evenNumbered = (direction == Connection::ServerSide);
-    const int minId = evenNumbered ? 2 : 1;
-    const int maxId = evenNumbered ? (UINT16_MAX-1) : UINT16_MAX;
+    foreach (int channelId, outboundQueues.keys()) {
+        if (!channels.contains(channelId))
+            outboundChannelIds.release(channelId);
+    }
+    outboundQueues.clear();
+    urgentQueues.clear();
+    scheduledQueues.clear();
+    pendingPacketOffset = -1;
+    queuedByteCount = 0;
+}
 
-    if (nextOutboundChannelId < minId || nextOutboundChannelId > maxId)
-        nextOutboundChannelId = minId;
+bool ConnectionPrivate::flushWrites()
+{
+    return writeQueuedPackets(SocketWriteBudget);
+}
 
-    // Find an unused id, trying a maximum of 100 times, using a random step to avoid collision
-    for (int i = 0; i < 100 && channels.contains(nextOutboundChannelId); i++) {
-        nextOutboundChannelId += 1 + (qrand() % 200);
-        if (evenNumbered)
-            nextOutboundChannelId += nextOutboundChannelId % 2;
-        if (nextOutboundChannelId > maxId)
-            nextOutboundChannelId = minId;
+void ConnectionPrivate::socketWritten()
+{
+    // Continue writing packets that were held back by the scheduler
+    if (!scheduledQueues.isEmpty() && !flushTimer.isActive()) {
+        if (!flushWrites())
+            return;
     }
 
-    if (channels.contains(nextOutboundChannelId)) {
-        // Abort the connection if we still couldn't find an id, because it's probably a nasty bug
-        BUG() << "Can't find an available outbound channel ID for connection; aborting connection";
-        socket->abort();
-        return -1;
+    notifyWritable();
+}
+
+// Bytes sent on channels that haven't yet been written to the network
+qint64 ConnectionPrivate::bytesPending() const
+{
+    qint64 re = queuedByteCount;
+    if (socket)
+        re += socket->bytesToWrite();
+    return re;
+}
+
+/* Emit Channel::writable for blocked channels that can write again
+ *
+ * Called as the socket drains. Nothing is emitted until the connection is
+ * below its low water mark; then each blocked channel is notified once its
+ * own queue is below the channel's low water mark. Handlers may send packets
+ * or close channels, so the signals are emitted after the scan is finished.
+ */
+void ConnectionPrivate::notifyWritable()
+{
+    if (!hasBlockedChannels || bytesPending() > lowWaterMark)
+        return;
+
+    QList<QPointer<Channel>> unblocked;
+    hasBlockedChannels = false;
+    foreach (Channel *channel, channels) {
+        ChannelPrivate *cd = channel->d_ptr.data();
+        if (!cd->isWriteBlocked)
+            continue;
+
+        if (q->queuedBytes(channel->identifier()) <= cd->lowWaterMark) {
+            cd->isWriteBlocked = false;
+            unblocked.append(channel);
+        } else {
+            hasBlockedChannels = true;
+        }
     }
 
-    if (nextOutboundChannelId < minId || nextOutboundChannelId > maxId) {
-        BUG() << "Selected a channel id that isn't within range";
-        return -1;
+    foreach (const QPointer<Channel> &channel, unblocked) {
+        if (channel && channel->isOpened())
+            emit channel->writable();
     }
+}
+
+void Connection::flush()
+{
+    d->flushWrites();
+}
+
+bool Connection::hasFeature(const QByteArray &feature) const
+{
+    return d->enabledFeatures.contains(feature);
+}
+
+Connection::WriteStatistics Connection::writeStatistics() const
+{
+    return d->writeStatistics;
+}
+
+Connection::CompressionStatistics Connection::compressionStatistics() const
+{
+    return d->compressionStatistics;
+}
+
+int Connection::queuedPackets(int channelId) const
+{
+    auto it = d->outboundQueues.constFind(channelId);
+    if (it == d->outboundQueues.constEnd())
+        return 0;
+    return it->packetSizes.size();
+}
+
+qint64 Connection::queuedBytes(int channelId) const
+{
+    auto it = d->outboundQueues.constFind(channelId);
+    if (it == d->outboundQueues.constEnd())
+        return 0;
+    return it->data.size() - it->offset;
+}
+
+qint64 Connection::bytesPending() const
+{
+    return d->bytesPending();
+}
+
+bool Connection::setWriteWaterMarks(qint64 high, qint64 low)
+{
+    if (high < 1 || low < 0 || low > high) {
+        BUG() << "Invalid write water marks for connection: high" << high << "low" << low;
+        return false;
+    }
+
+    d->highWaterMark = high;
+    d->lowWaterMark = low;
+    d->notifyWritable();
+    return true;
+}
+
+qint64 Connection::writeHighWaterMark() const
+{
+    return d->highWaterMark;
+}
 
-    if (evenNumbered == bool(nextOutboundChannelId % 2)) {
-        BUG() << "Selected a channel id that isn't valid for this side of the connection";
+qint64 Connection::writeLowWaterMark() const
+{
+    return d->lowWaterMark;
+}
+
+/* Find an identifier for a new outbound channel
+ *
+ * The identifier isn't reserved until the channel is inserted. Returns -1
+ * if every identifier for this side of the connection is in use.
+ */
+int ConnectionPrivate::availableOutboundChannelId()
+{
+    int id = outboundChannelIds.next();
+    if (id < 0) {
+        qWarning() << "All" << outboundChannelIds.capacity() << "outbound channel identifiers are in use on connection" << q;
         return -1;
     }
 
-    int re = nextOutboundChannelId;
-    nextOutboundChannelId += 2;
-    return re;
+    return id;
 }
 
 bool ConnectionPrivate::isValidAvailableChannelId(int id, Connection::Direction side)
@@ -531,12 +1044,34 @@ bool ConnectionPrivate::insertChannel(Channel *channel)
         return false;
     }
 
+    if (outboundChannelIds.contains(channel->identifier()) && !outboundChannelIds.acquire(channel->identifier())) {
+        BUG() << "Connection tried to insert a channel with an identifier that is already allocated" << channel->identifier();
+        return false;
+    }
+
+    // The peer may reuse the identifier of a channel before our reply to its close has
+    // been written; write that first, so the new channel starts with a queue of its own
+    if (outboundQueues.contains(channel->identifier()) && !writeQueuedPackets(SocketWriteBudget))
+        return false;
+
     if (channel->parent() != q) {
         BUG() << "Connection inserted a channel without expected parent object. Fixing.";
         channel->setParent(q);
     }
 
     channels.insert(channel->identifier(), channel);
+
+    Channel::Direction channelDirection = channel->direction();
+    if (channelDirection == Channel::Inbound || channelDirection == Channel::Outbound) {
+        for (const QMetaObject *type = channel->metaObject(); type; type = type->superClass()) {
+            channelsByType[channelDirection][type].append(channel);
+            if (type == &Channel::staticMetaObject)
+                break;
+        }
+    } else {
+        BUG() << "Connection inserted a channel without a direction";
+    }
+
     return true;
 }
 
@@ -550,9 +1085,29 @@ void ConnectionPrivate::removeChannel(Channel *channel)
     // Out of caution, find the channel by pointer instead of identifier. This will make sure
     // it's always removed from the list, even if the identifier was somehow reset or lost.
     for (auto it = channels.begin(); it != channels.end(); ) {
-        if (*it == channel)
+        if (*it == channel) {
+            // Queues with packets left, and their identifiers, are released
+            // once they have been written
+            int channelId = it.key();
             it = channels.erase(it);
-        else
+            auto queue = outboundQueues.find(channelId);
+            if (queue == outboundQueues.end())
+                outboundChannelIds.release(channelId);
+            else if (queue->packetSizes.isEmpty() && (pendingPacketOffset < 0 || channelId != pendingPacketChannel))
+                releaseOutboundQueue(channelId);
+
+            // This may be called from the Channel destructor, where metaObject() no
+            // longer returns the subclass, so remove it from every type in the index.
+            for (int i = 0; i < 2; i++) {
+                for (auto type = channelsByType[i].begin(); type != channelsByType[i].end(); ) {
+                    type->removeOne(channel);
+                    if (type->isEmpty())
+                        type = channelsByType[i].erase(type);
+                    else
+                        type++;
+                }
+            }
+        } else
             it++;
     }
 }
@@ -567,11 +1122,62 @@ void ConnectionPrivate::closeAllChannels()
         BUG() << "Channels remain open on connection after calling closeAllChannels";
 }
 
-QHash<int,Channel*> Connection::channels()
+MessageArena::MessageArena(Connection *connection)
+    : d(connection->d)
+    , arena(connection->d->messageArena.data())
+{
+    d->messageArenaScopes++;
+}
+
+MessageArena::~MessageArena()
+{
+    Q_ASSERT(d->messageArenaScopes > 0);
+    if (--d->messageArenaScopes == 0)
+        arena->Reset();
+}
+
+const QHash<int,Channel*> &Connection::channels() const
 {
     return d->channels;
 }
 
+Channel *Connection::findChannel(const QMetaObject *type, Channel::Direction direction)
+{
+    if (direction != Channel::Outbound) {
+        const QList<Channel*> &inbound = d->channelsOfType(type, Channel::Inbound);
+        if (!inbound.isEmpty())
+            return inbound.first();
+    }
+
+    if (direction != Channel::Inbound) {
+        const QList<Channel*> &outbound = d->channelsOfType(type, Channel::Outbound);
+        if (!outbound.isEmpty())
+            return outbound.first();
+    }
+
+    return 0;
+}
+
+QList<Channel*> Connection::findChannels(const QMetaObject *type, Channel::Direction direction)
+{
+    if (direction != Channel::Invalid)
+        return d->channelsOfType(type, direction);
+    return d->channelsOfType(type, Channel::Inbound) + d->channelsOfType(type, Channel::Outbound);
+}
+
+const QList<Channel*> &ConnectionPrivate::channelsOfType(const QMetaObject *type, Channel::Direction direction) const
+{
+    static const QList<Channel*> empty;
+    if (direction != Channel::Inbound && direction != Channel::Outbound)
+        return empty;
+
+    const QHash<const QMetaObject*,QList<Channel*>> &index = channelsByType[direction];
+    auto it = index.constFind(type);
+    if (it == index.constEnd())
+        return empty;
+    return *it;
+}
+
 Channel *Connection::channel(int identifier)
 {
     return d->channels.value(identifier);
@@ -43,6 +43,7 @@ namespace Protocol
 {
 
 class ConnectionPrivate;
+class MessageArena;
 
 /* Represents a protocol connection associated with a socket
  *
@@ -75,6 +76,7 @@ class Connection : public QObject
     friend class Channel;
     friend class ChannelPrivate;
     friend class ControlChannel;
+    friend class MessageArena;
 
 public:
     /* Direction of the underlying socket connection
@@ -94,11 +96,28 @@ public:
      * the socket has disconnected.
      */
     explicit Connection(QTcpSocket *socket, Direction direction);
+
+    /* Create a ClientSide connection that doesn't wait for version negotiation
+     *
+     * The introduction offers only 'version', which the server is expected
+     * to select, and packets are written in that version's format right
+     * away. Channels can be opened immediately, and their packets are sent
+     * in the same flight as the introduction. The ready signal is still
+     * emitted when the server's reply arrives.
+     *
+     * If the server selects anything else, versionNegotiationFailed is
+     * emitted and the socket is closed. The caller should reconnect with
+     * normal negotiation, which can fall back to older versions.
+     */
+    static Connection *optimisticClient(QTcpSocket *socket, int version);
     virtual ~Connection();
 
     Direction direction() const;
     bool isConnected() const;
 
+    /* Protocol version in use, once the connection is ready */
+    int protocolVersion() const;
+
     /* Hostname of the server side of the connection
      *
      * For a ClientSide connection, this returns the hostname that
@@ -133,10 +152,25 @@ public:
     Purpose purpose() const;
     bool setPurpose(Purpose purpose);
 
-    QHash<int,Channel*> channels();
+    /* All channels on this connection, by identifier
+     *
+     * The returned reference is valid until the next channel is inserted or
+     * removed. Don't open or close channels while iterating it; take a copy
+     * instead.
+     */
+    const QHash<int,Channel*> &channels() const;
     Channel *channel(int identifier);
+
+    /* Find channels of a type (including subclasses) by class
+     *
+     * Channels are indexed by type and direction as they're inserted, so
+     * these are a single lookup. A direction of Channel::Invalid matches
+     * channels in either direction.
+     */
     template<typename T> T *findChannel(Channel::Direction direction = Channel::Invalid);
     template<typename T> QList<T*> findChannels(Channel::Direction direction = Channel::Invalid);
+    Channel *findChannel(const QMetaObject *type, Channel::Direction direction = Channel::Invalid);
+    QList<Channel*> findChannels(const QMetaObject *type, Channel::Direction direction = Channel::Invalid);
 
     enum AuthenticationType {
         HiddenServiceAuth,
@@ -148,6 +182,83 @@ public:
     QString authenticatedIdentity(AuthenticationType type) const;
     void grantAuthentication(AuthenticationType type, const QString &identity = QString());
 
+    /* Determine whether a protocol extension is enabled on this connection
+     *
+     * Features are negotiated by the control channel with EnableFeatures
+     * messages once the connection is ready, and are enabled when both peers
+     * support them. Until the peer has answered, and for peers that don't
+     * support a feature, this returns false and channels must use only the
+     * base protocol.
+     */
+    bool hasFeature(const QByteArray &feature) const;
+
+    /* Counters for outbound packets written to the socket
+     *
+     * Packets are queued and written to the socket in batches, normally once
+     * per event loop iteration. The ratio of packets to flushes shows how well
+     * writes are being coalesced.
+     */
+    struct WriteStatistics {
+        quint64 packets;
+        quint64 bytes;
+        quint64 flushes;
+        // Most packets written by a single flush
+        int largestFlush;
+    };
+
+    WriteStatistics writeStatistics() const;
+
+    /* Counters for packets on compressed channels
+     *
+     * Channels are compressed when both peers have the compression feature
+     * (see PacketCompression). Outbound packets count their data before and
+     * after compression, without the format byte; packets below the size
+     * threshold are sent raw, and count the same size for both. Inbound
+     * packets are counted likewise. Times are the CPU spent in zlib.
+     */
+    struct CompressionStatistics {
+        quint64 packets;
+        quint64 rawPackets;
+        quint64 uncompressedBytes;
+        quint64 compressedBytes;
+        quint64 inboundPackets;
+        quint64 inboundBytes;
+        quint64 inboundCompressedBytes;
+        qint64 compressNsecs;
+        qint64 decompressNsecs;
+    };
+
+    CompressionStatistics compressionStatistics() const;
+
+    /* Packets and bytes queued for a channel, but not yet written to the socket
+     *
+     * Outbound packets are queued per channel and scheduled by priority; the
+     * control and authentication channels are always written first, and other
+     * channels share the remaining bandwidth.
+     */
+    int queuedPackets(int channelId) const;
+    qint64 queuedBytes(int channelId) const;
+
+    /* Bytes sent on all channels that haven't yet been written to the network
+     *
+     * This includes packets in the outbound queues and data buffered by the
+     * socket.
+     */
+    qint64 bytesPending() const;
+
+    /* Limits on pending outbound data for the whole connection
+     *
+     * Channel::canWrite returns false while bytesPending is at or above the
+     * high water mark. Channels that were refused emit Channel::writable once
+     * the connection has drained to the low water mark. These limits are
+     * advisory; sending is never refused because of them.
+     *
+     * Returns false if the marks are invalid (low must not exceed high).
+     */
+    bool setWriteWaterMarks(qint64 high, qint64 low);
+    qint64 writeHighWaterMark() const;
+    qint64 writeLowWaterMark() const;
+
 public slots:
     /* Close this connection and the underlying socket
      *
@@ -160,25 +271,48 @@ public slots:
      */
     void close();
 
+    /* Write queued packets to the socket immediately
+     *
+     * Packets sent on channels are normally written to the socket together at
+     * the end of the current event loop iteration. This can be used for
+     * latency-critical packets that shouldn't wait for that. As with normal
+     * writes, packets on lower priority channels may be held back if the
+     * socket already has a backlog.
+     */
+    void flush();
+
 signals:
     /* Emitted when the socket is closed. All channels will be closed
      * automatically. It is not possible to re-use the same Connection instance,
      * or to reconnect the socket.
      */
     void closed();
+    /* Emitted by close() before the queued packets are written
+     *
+     * Channels can still send packets from this signal, and they'll be
+     * written before the socket is closed.
+     */
+    void aboutToClose();
     /* Emitted once, after version negotiation has finished and the connection
      * is ready to use. If negotiation fails, the versionNegotiationFailed
      * signal is emitted instead, and the socket is closed.
      */
     void ready();
     /* Emitted once when version negotiation has failed; meaning, there is no
-     * protocol version that both peers will accept. The socket will be closed.
+     * protocol version that both peers will accept, or the server didn't select
+     * the version assumed by an optimistic connection. The socket will be closed.
      */
     void versionNegotiationFailed();
     /* Hack to allow delivering an upgrade message to old clients
      * XXX: Remove this once enough time has passed for most clients to be upgraded.
      */
     void oldVersionNegotiated(QTcpSocket *socket);
+    /* Emitted when features have been enabled by EnableFeatures negotiation
+     *
+     * This may be emitted more than once, and hasFeature can change after
+     * the connection is ready and in use.
+     */
+    void featuresEnabled();
 
     void authenticated(AuthenticationType type, const QString &identity);
     void purposeChanged(Purpose after, Purpose before);
@@ -210,31 +344,22 @@ signals:
     void channelOpened(Channel *channel);
 
 private:
+    Connection();
+
     ConnectionPrivate *d;
 };
 
+// Channels are only indexed under their own classes, so the casts are safe
 template<typename T> T *Connection::findChannel(Channel::Direction direction)
 {
-    T *re = 0;
-    foreach (Channel *c, channels()) {
-        if (direction != Channel::Invalid && c->direction() != direction)
-            continue;
-        if ((re = qobject_cast<T*>(c)))
-            return re;
-    }
-    return 0;
+    return static_cast<T*>(findChannel(&T::staticMetaObject, direction));
 }
 
 template<typename T> QList<T*> Connection::findChannels(Channel::Direction direction)
 {
     QList<T*> re;
-    T *tmp = 0;
-    foreach (Channel *c, channels()) {
-        if (direction != Channel::Invalid && c->direction() != direction)
-            continue;
-        if ((tmp = qobject_cast<T*>(c)))
-            re.append(tmp);
-    }
+    foreach (Channel *c, findChannels(&T::staticMetaObject, direction))
+        re.append(static_cast<T*>(c));
     return re;
 }
 
@@ -34,23 +34,77 @@
 #define PROTOCOL_CONNECTION_P_H
 
 #include "Connection.h"
+#include "ChannelIdAllocator.h"
+#include "PacketHeader.h"
 #include <QMap>
+#include <QSet>
 #include <QElapsedTimer>
+#include <QTimer>
+#include <QQueue>
+#include <QScopedArrayPointer>
 #include <cstdint>
+#include <google/protobuf/arena.h>
 
 namespace Protocol
 {
 
+/* Scope for protobuf messages allocated on a connection's arena
+ *
+ * Messages from create() belong to the arena, and are only valid until the
+ * scope ends; they must not be deleted or kept afterwards. Scopes can be
+ * nested, and the arena is reset when the outermost scope on the connection
+ * ends. Submessages should be built with mutable_* rather than set_allocated_*,
+ * so that they're allocated on the arena as well.
+ */
+class MessageArena
+{
+    Q_DISABLE_COPY(MessageArena)
+
+public:
+    explicit MessageArena(Connection *connection);
+    ~MessageArena();
+
+    template<typename T> T *create()
+    {
+        return google::protobuf::Arena::CreateMessage<T>(arena);
+    }
+
+private:
+    ConnectionPrivate *d;
+    google::protobuf::Arena *arena;
+};
+
 class ConnectionPrivate : public QObject
 {
     Q_OBJECT
     Q_DISABLE_COPY(ConnectionPrivate)
 
 public:
-    static const quint8 ProtocolVersion = 1;
-    static const quint8 ProtocolVersionFailed = 0xff;
-    static const int PacketHeaderSize = 4;
-    static const int PacketMaxDataSize = UINT16_MAX - PacketHeaderSize;
+    // Range of protocol versions that can be negotiated; the newest common version is used
+    static const quint8 ProtocolVersionMin = 1;
+    static const quint8 ProtocolVersion = 2;
+    static const quint8 ProtocolVersionFailed = PacketHeader::VersionFailed;
+    // Version 1 packets have a fixed header, and are limited to 64KB including the header
+    static const int PacketHeaderSize = PacketHeader::Version1Size;
+    static const int PacketMaxDataSize = PacketHeader::Version1MaxDataSize;
+    /* Version 2 packets have a header of varints for the size and channel,
+     * and an optional flags byte. Each varint is at most 3 bytes. Outbound
+     * packets never have flags. Large packets are only exchanged once the
+     * client has authenticated. See doc/protocol.md.
+     */
+    static const int LargePacketHeaderMaxSize = PacketHeader::Version2MaxSize;
+    static const int LargePacketMaxDataSize = PacketHeader::Version2MaxDataSize;
+    // Initial size of the receive buffer; it grows as needed to hold a complete packet
+    static const int ReadBufferSize = 16384;
+    // Bytes allowed to wait in the socket's buffer before the scheduler holds back packets
+    static const int SocketWriteBudget = 65536;
+    // Bytes credited to a channel per weight in each round of outbound scheduling
+    static const int SchedulerQuantum = 4096;
+    // Default limits on pending outbound bytes for the connection; see Connection::setWriteWaterMarks
+    static const int DefaultHighWaterMark = 262144;
+    static const int DefaultLowWaterMark = 65536;
+    // Size of the block allocated with each connection for protobuf messages
+    static const int MessageArenaBlockSize = 16384;
     // Time in seconds before a connection with a purpose of Unknown is killed
     static const int UnknownPurposeTimeout = 15;
 
@@ -60,35 +114,141 @@ public:
     Connection *q;
     QTcpSocket *socket;
     QHash<int,Channel*> channels;
+    /* Channels by direction (Inbound or Outbound), then by each class in their
+     * type hierarchy from the most derived type up to Channel, in the order
+     * they were inserted. Used to make findChannel a single lookup.
+     */
+    QHash<const QMetaObject*,QList<Channel*>> channelsByType[2];
+    // Identifiers used by channels in this side's half of the identifier space
+    ChannelIdAllocator outboundChannelIds;
     QMap<Connection::AuthenticationType,QString> authentication;
+    // Protocol extensions negotiated by ControlChannel; see Connection::hasFeature
+    QSet<QByteArray> enabledFeatures;
     QElapsedTimer ageTimer;
     Connection::Direction direction;
     Connection::Purpose purpose;
     bool wasClosed;
     bool handshakeDone;
+    // Negotiated protocol version, which decides the packet format
+    quint8 protocolVersion;
+    // Set for a client that assumed protocolVersion before the server's reply
+    bool isOptimistic;
+
+    /* Inbound data is drained from the socket into readBuffer in large reads.
+     * Bytes in the range [readStart, readEnd) have been read from the socket
+     * but not yet dispatched. Packets are parsed in place and passed to
+     * channels as views into this buffer, without copying. The unparsed tail
+     * is moved back to the start of the buffer only when a packet wouldn't
+     * fit in the remaining space.
+     */
+    QByteArray readBuffer;
+    int readStart;
+    int readEnd;
+    bool isReadingPackets;
 
-    void setSocket(QTcpSocket *socket, Connection::Direction direction);
+    /* Outbound packets waiting to be written for one channel
+     *
+     * Packets are encoded with their headers into data; the first 'offset'
+     * bytes have already been written to the socket. packetSizes holds the
+     * size of each packet that hasn't been written yet. hasPendingClose is
+     * set while the channel's close packet is among them.
+     */
+    struct OutboundQueue
+    {
+        QByteArray data;
+        int offset;
+        QQueue<int> packetSizes;
+        bool isUrgent;
+        bool hasPendingClose;
+        int weight;
+        int deficit;
+
+        OutboundQueue() : offset(0), isUrgent(false), hasPendingClose(false), weight(1), deficit(0) { }
+    };
+
+    /* Outbound packets are queued per channel and written to the socket in a
+     * batch at the end of the event loop iteration, so bursts of small packets
+     * are coalesced. The order in which channels are written is decided by
+     * writeQueuedPackets. flushWrites can be used to write immediately.
+     */
+    QHash<int,OutboundQueue> outboundQueues;
+    // Channels with queued packets, in the order they will be written
+    QList<int> urgentQueues;
+    QList<int> scheduledQueues;
+    int scheduledPosition;
+    // Offset in the queue of pendingPacketChannel of a packet started by beginPacket, or -1
+    int pendingPacketOffset;
+    int pendingPacketChannel;
+    int pendingPacketHeaderSize;
+    QTimer flushTimer;
+    Connection::WriteStatistics writeStatistics;
+    Connection::CompressionStatistics compressionStatistics;
+    // Total bytes in outboundQueues that haven't been written to the socket
+    qint64 queuedByteCount;
+
+    /* Channels that were refused by Channel::canWrite are marked as blocked,
+     * and their writable signal is emitted once both the channel and the
+     * connection have drained below their low water marks.
+     */
+    qint64 highWaterMark;
+    qint64 lowWaterMark;
+    bool hasBlockedChannels;
+
+    /* Protobuf messages for inbound and outbound packets are allocated on
+     * messageArena, inside of a MessageArena scope. The arena is reset when
+     * the outermost scope ends, which is normally after a batch of inbound
+     * packets has been dispatched. Reset keeps the initial block, so handling
+     * typical packets doesn't allocate at all.
+     */
+    QScopedArrayPointer<char> messageArenaBlock;
+    QScopedPointer<google::protobuf::Arena> messageArena;
+    int messageArenaScopes;
+
+    void setSocket(QTcpSocket *socket, Connection::Direction direction, int optimisticVersion = 0);
 
     int availableOutboundChannelId();
     bool isValidAvailableChannelId(int channelId, Connection::Direction idDirection);
 
     bool insertChannel(Channel *channel);
     void removeChannel(Channel *channel);
+    const QList<Channel*> &channelsOfType(const QMetaObject *type, Channel::Direction direction) const;
 
     void closeAllChannels();
 
     bool writePacket(Channel *channel, const QByteArray &data);
     bool writePacket(int channelId, const QByteArray &data);
 
+    // Largest packet data that may be sent to the peer, or accepted from it
+    int maxPacketDataSize() const;
+    int maxInboundPacketDataSize() const;
+
+    char *beginPacket(int channelId, int maxSize);
+    bool commitPacket(int size);
+    void cancelPacket();
+
+    bool writeQueuedPackets(qint64 budget);
+    void discardQueuedPackets();
+
+    qint64 bytesPending() const;
+    void notifyWritable();
+
 public slots:
     void closeImmediately();
+    bool flushWrites();
 
 private slots:
     void socketReadable();
+    void socketWritten();
     void socketDisconnected();
 
 private:
-    int nextOutboundChannelId;
+    bool fillReadBuffer();
+    int parsePacketHeader(const uchar *data, int available, int *headerSize, int *dataSize, int *channelId) const;
+    void dispatchPacket(int channelId, const QByteArray &data);
+
+    OutboundQueue &outboundQueue(int channelId);
+    bool writeQueue(int channelId, OutboundQueue &queue, int size);
+    void releaseOutboundQueue(int channelId);
 };
 
 }
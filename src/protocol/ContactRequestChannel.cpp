@@ -35,6 +35,8 @@
 
 using namespace Protocol;
 
+constexpr const char *ContactRequestChannel::TypeName;
+
 /* Regarding message and nickname limitations:
  *
  * For messages, we should use limits the same as those of chat, including limits on the
@@ -49,7 +51,7 @@ using namespace Protocol;
  */
 
 ContactRequestChannel::ContactRequestChannel(Direction direction, Connection *connection)
-    : Channel(QStringLiteral("im.ricochet.contact.request"), direction, connection)
+    : Channel(QString::fromLatin1(TypeName), direction, connection)
     , m_responseStatus(Data::ContactRequest::Response::Undefined)
 {
 }
@@ -134,9 +136,7 @@ bool ContactRequestChannel::allowInboundChannelRequest(const Data::Control::Open
 
     // If this connection is already KnownContact, report that the request is accepted
     if (connection()->purpose() == Connection::Purpose::KnownContact) {
-        QScopedPointer<Response> response(new Response);
-        response->set_status(Response::Accepted);
-        result->SetAllocatedExtension(Data::ContactRequest::response, response.take());
+        result->MutableExtension(Data::ContactRequest::response)->set_status(Response::Accepted);
         return false;
     }
 
@@ -165,7 +165,7 @@ bool ContactRequestChannel::allowInboundChannelRequest(const Data::Control::Open
         return false;
     }
 
-    ContactRequest contactData = request->GetExtension(Data::ContactRequest::contact_request);
+    const ContactRequest &contactData = request->GetExtension(Data::ContactRequest::contact_request);
     QString nickname = QString::fromStdString(contactData.nickname());
     QString message = QString::fromStdString(contactData.message_text());
 
@@ -186,9 +186,7 @@ bool ContactRequestChannel::allowInboundChannelRequest(const Data::Control::Open
         }
     }
 
-    QScopedPointer<Response> response(new Response);
-    response->set_status(m_responseStatus);
-    result->SetAllocatedExtension(Data::ContactRequest::response, response.take());
+    result->MutableExtension(Data::ContactRequest::response)->set_status(m_responseStatus);
 
     // If the response is final, close the channel immediately once it's fully open
     if (m_responseStatus > Response::Pending)
@@ -214,9 +212,10 @@ void ContactRequestChannel::setResponseStatus(Status status)
 
     // If the channel is already open, the response is sent as a separate packet
     if (isOpened()) {
-        Response response;
-        response.set_status(m_responseStatus);
-        sendMessage(response);
+        MessageArena arena(connection());
+        Response *response = arena.create<Response>();
+        response->set_status(m_responseStatus);
+        sendMessage(*response);
 
         if (m_responseStatus > Response::Pending)
             closeChannel();
@@ -238,13 +237,11 @@ bool ContactRequestChannel::allowOutboundChannelRequest(Data::Control::OpenChann
         return false;
     }
 
-    QScopedPointer<Data::ContactRequest::ContactRequest> contactData(new Data::ContactRequest::ContactRequest);
+    Data::ContactRequest::ContactRequest *contactData = request->MutableExtension(Data::ContactRequest::contact_request);
     if (!m_nickname.isEmpty())
         contactData->set_nickname(m_nickname.toStdString());
     if (!m_message.isEmpty())
         contactData->set_message_text(m_message.toStdString());
-
-    request->SetAllocatedExtension(Data::ContactRequest::contact_request, contactData.take());
     return true;
 }
 
@@ -255,20 +252,20 @@ bool ContactRequestChannel::processChannelOpenResult(const Data::Control::Channe
         return false;
     }
 
-    Data::ContactRequest::Response response = result->GetExtension(Data::ContactRequest::response);
-    return handleResponse(&response);
+    return handleResponse(&result->GetExtension(Data::ContactRequest::response));
 }
 
 void ContactRequestChannel::receivePacket(const QByteArray &packet)
 {
-    Data::ContactRequest::Response response;
-    if (!response.ParseFromArray(packet.constData(), packet.size())) {
+    MessageArena arena(connection());
+    Data::ContactRequest::Response *response = arena.create<Data::ContactRequest::Response>();
+    if (!response->ParseFromArray(packet.constData(), packet.size())) {
         qDebug() << "Invalid message received on contact request channel";
         closeChannel();
         return;
     }
 
-    if (!handleResponse(&response))
+    if (!handleResponse(response))
         closeChannel();
 }
 
@@ -46,6 +46,7 @@ class ContactRequestChannel : public Channel
 
 public:
     typedef Data::ContactRequest::Response::Status Status;
+    static constexpr const char *TypeName = "im.ricochet.contact.request";
 
     explicit ContactRequestChannel(Direction direction, Connection *connection);
 
@@ -31,16 +31,18 @@
  */
 
 #include "ControlChannel.h"
+#include "ChatChannel.h"
+#include "AuthHiddenServiceChannel.h"
 #include "Channel_p.h"
 #include "Connection_p.h"
 #include "utils/Useful.h"
-#include <QScopedPointer>
 #include <QDebug>
 
 using namespace Protocol;
 
 ControlChannel::ControlChannel(Direction direction, Connection *connection)
     : Channel(QStringLiteral("control"), direction, connection)
+    , isWaitingForFeatures(false)
 {
     if (connection->channel(0))
         BUG() << "Created ControlChannel for connection which already has a channel 0";
@@ -48,6 +50,28 @@ ControlChannel::ControlChannel(Direction direction, Connection *connection)
     Q_D(Channel);
     d->isOpened = true;
     d->identifier = 0;
+
+    connect(connection, &Connection::ready, this, &ControlChannel::sendEnableFeatures);
+}
+
+QList<QByteArray> ControlChannel::supportedFeatures()
+{
+    return QList<QByteArray>() << QByteArray(ChatChannel::BatchFeature)
+                               << QByteArray(ChatChannel::CoalescedAckFeature)
+                               << QByteArray(PacketCompression::FeatureName)
+                               << QByteArray(AuthHiddenServiceChannel::OneRoundTripFeature);
+}
+
+void ControlChannel::sendEnableFeatures()
+{
+    MessageArena arena(connection());
+    Data::Control::Packet *packet = arena.create<Data::Control::Packet>();
+    Data::Control::EnableFeatures *request = packet->mutable_enable_features();
+    foreach (const QByteArray &feature, supportedFeatures())
+        request->add_feature(feature.constData(), feature.size());
+
+    if (sendMessage(*packet))
+        isWaitingForFeatures = true;
 }
 
 bool ControlChannel::sendOpenChannel(Channel *channel)
@@ -62,13 +86,16 @@ bool ControlChannel::sendOpenChannel(Channel *channel)
         return false;
     }
 
-    QScopedPointer<Data::Control::OpenChannel> request(new Data::Control::OpenChannel);
     int channelId = connection()->d->availableOutboundChannelId();
     if (channelId <= 0)
         return false;
+
+    MessageArena arena(connection());
+    Data::Control::Packet *packet = arena.create<Data::Control::Packet>();
+    Data::Control::OpenChannel *request = packet->mutable_open_channel();
     request->set_channel_identifier(channelId);
 
-    if (!channel->d_ptr->openChannelOutbound(request.data())) {
+    if (!channel->d_ptr->openChannelOutbound(request)) {
         qDebug() << "Outbound OpenChannel request of type" << channel->type() << "refused locally";
         return false;
     }
@@ -90,19 +117,15 @@ bool ControlChannel::sendOpenChannel(Channel *channel)
         return false;
     }
 
-    Data::Control::Packet packet;
-    packet.set_allocated_open_channel(request.take());
-    return sendMessage(packet);
+    return sendMessage(*packet);
 }
 
 void ControlChannel::keepAlive()
 {
-    Data::Control::KeepAlive *request = new Data::Control::KeepAlive;
-    request->set_response_requested(true);
-
-    Data::Control::Packet packet;
-    packet.set_allocated_keep_alive(request);
-    sendMessage(packet);
+    MessageArena arena(connection());
+    Data::Control::Packet *packet = arena.create<Data::Control::Packet>();
+    packet->mutable_keep_alive()->set_response_requested(true);
+    sendMessage(*packet);
 }
 
 bool ControlChannel::allowInboundChannelRequest(const Data::Control::OpenChannel *request, Data::Control::ChannelResult *result)
@@ -129,23 +152,24 @@ bool ControlChannel::processChannelOpenResult(const Data::Control::ChannelResult
 
 void ControlChannel::receivePacket(const QByteArray &packet)
 {
-    Data::Control::Packet message;
-    if (!message.ParseFromArray(packet.constData(), packet.size())) {
+    MessageArena arena(connection());
+    Data::Control::Packet *message = arena.create<Data::Control::Packet>();
+    if (!message->ParseFromArray(packet.constData(), packet.size())) {
         qWarning() << "Control channel failed parsing packet; connection will be killed";
         closeChannel();
         return;
     }
 
-    if (message.has_open_channel()) {
-        handleOpenChannel(message.open_channel());
-    } else if (message.has_channel_result()) {
-        handleChannelResult(message.channel_result());
-    } else if (message.has_keep_alive()) {
-        handleKeepAlive(message.keep_alive());
-    } else if (message.has_enable_features()) {
-        handleEnableFeatures(message.enable_features());
-    } else if (message.has_features_enabled()) {
-        handleFeaturesEnabled(message.features_enabled());
+    if (message->has_open_channel()) {
+        handleOpenChannel(message->open_channel());
+    } else if (message->has_channel_result()) {
+        handleChannelResult(message->channel_result());
+    } else if (message->has_keep_alive()) {
+        handleKeepAlive(message->keep_alive());
+    } else if (message->has_enable_features()) {
+        handleEnableFeatures(message->enable_features());
+    } else if (message->has_features_enabled()) {
+        handleFeaturesEnabled(message->features_enabled());
     } else {
         qWarning() << "Unrecognized message on control channel; connection will be killed";
         closeChannel();
@@ -165,12 +189,14 @@ void ControlChannel::handleOpenChannel(const Data::Control::OpenChannel &message
         return;
     }
 
-    Data::Control::ChannelResult *response = new Data::Control::ChannelResult;
+    MessageArena arena(connection());
+    Data::Control::Packet *responseMessage = arena.create<Data::Control::Packet>();
+    Data::Control::ChannelResult *response = responseMessage->mutable_channel_result();
     response->set_channel_identifier(id);
 
-    Channel *channel = Channel::create(QString::fromStdString(message.channel_type()), Inbound, connection());
+    Channel *channel = Channel::create(message.channel_type(), Inbound, connection());
     if (!channel) {
-        qDebug() << "Received OpenChannel for unknown channel type:" << QString::fromStdString(message.channel_type());
+        qDebug() << "Received OpenChannel for unknown channel type:" << message.channel_type().c_str();
         response->set_opened(false);
         response->set_common_error(Data::Control::ChannelResult::UnknownTypeError);
     } else {
@@ -210,9 +236,7 @@ void ControlChannel::handleOpenChannel(const Data::Control::OpenChannel &message
         channel = 0;
     }
 
-    Data::Control::Packet responseMessage;
-    responseMessage.set_allocated_channel_result(response);
-    sendMessage(responseMessage);
+    sendMessage(*responseMessage);
 
     if (response->opened())
         emit connection()->channelOpened(channel);
@@ -257,11 +281,10 @@ void ControlChannel::handleChannelResult(const Data::Control::ChannelResult &mes
 void ControlChannel::handleKeepAlive(const Data::Control::KeepAlive &message)
 {
     if (message.response_requested()) {
-        Data::Control::KeepAlive *pong = new Data::Control::KeepAlive;
-        pong->set_response_requested(false);
-        Data::Control::Packet response;
-        response.set_allocated_keep_alive(pong);
-        sendMessage(response);
+        MessageArena arena(connection());
+        Data::Control::Packet *response = arena.create<Data::Control::Packet>();
+        response->mutable_keep_alive()->set_response_requested(false);
+        sendMessage(*response);
     } else {
         emit keepAliveResponse();
     }
@@ -269,18 +292,39 @@ void ControlChannel::handleKeepAlive(const Data::Control::KeepAlive &message)
 
 void ControlChannel::handleEnableFeatures(const Data::Control::EnableFeatures &message)
 {
-    Q_UNUSED(message);
-    // This version does not support any features.
-    Data::Control::Packet responseMessage;
-    responseMessage.mutable_features_enabled();
-    sendMessage(responseMessage);
+    // Enable the requested features that this version supports, and tell the peer which ones
+    QList<QByteArray> supported = supportedFeatures();
+    MessageArena arena(connection());
+    Data::Control::Packet *responseMessage = arena.create<Data::Control::Packet>();
+    Data::Control::FeaturesEnabled *response = responseMessage->mutable_features_enabled();
+    for (int i = 0; i < message.feature_size(); i++) {
+        QByteArray feature(message.feature(i).data(), int(message.feature(i).size()));
+        if (supported.contains(feature)) {
+            response->add_feature(message.feature(i));
+            connection()->d->enabledFeatures.insert(feature);
+        }
+    }
+    sendMessage(*responseMessage);
+    emit connection()->featuresEnabled();
 }
 
 void ControlChannel::handleFeaturesEnabled(const Data::Control::FeaturesEnabled &message)
 {
-    Q_UNUSED(message);
-    // This version does not generate EnableFeatures messages, so receiving this is an error.
-    qDebug() << "Unexpectedly received FeaturesEnabled message from peer, but we never send EnableFeatures";
-    closeChannel();
-}
+    if (!isWaitingForFeatures) {
+        qDebug() << "Unexpectedly received FeaturesEnabled message from peer, but we didn't send EnableFeatures";
+        closeChannel();
+        return;
+    }
 
+    isWaitingForFeatures = false;
+    QList<QByteArray> supported = supportedFeatures();
+    for (int i = 0; i < message.feature_size(); i++) {
+        QByteArray feature(message.feature(i).data(), int(message.feature(i).size()));
+        if (!supported.contains(feature)) {
+            qDebug() << "Peer enabled feature" << feature << "that we didn't request; ignoring it";
+            continue;
+        }
+        connection()->d->enabledFeatures.insert(feature);
+    }
+    emit connection()->featuresEnabled();
+}
@@ -50,6 +50,16 @@ public:
     bool sendOpenChannel(Channel *channel);
     void keepAlive();
 
+    /* Protocol extensions this version can enable with the peer
+     *
+     * Each side sends EnableFeatures with these once the connection is ready,
+     * and the peer replies with the subset it also supports. Features agreed
+     * in either direction are enabled on the connection; see
+     * Connection::hasFeature. Peers that don't support any features reply
+     * with an empty list, so nothing changes for them.
+     */
+    static QList<QByteArray> supportedFeatures();
+
 signals:
     void keepAliveResponse();
 
@@ -63,11 +73,17 @@ protected:
     virtual void receivePacket(const QByteArray &packet);
 
 private:
+    // An EnableFeatures request was sent, and FeaturesEnabled hasn't arrived yet
+    bool isWaitingForFeatures;
+
     void handleOpenChannel(const Data::Control::OpenChannel &message);
     void handleChannelResult(const Data::Control::ChannelResult &message);
     void handleKeepAlive(const Data::Control::KeepAlive &message);
     void handleEnableFeatures(const Data::Control::EnableFeatures &message);
     void handleFeaturesEnabled(const Data::Control::FeaturesEnabled &message);
+
+private slots:
+    void sendEnableFeatures();
 };
 
 }
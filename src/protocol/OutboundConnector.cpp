@@ -36,9 +36,35 @@
 #include "ControlChannel.h"
 #include "AuthHiddenServiceChannel.h"
 #include <QSharedPointer>
+#include <QElapsedTimer>
 
 using namespace Protocol;
 
+namespace {
+
+/* What was learned about each host from connections during this session
+ *
+ * Later connections to a host assume the same protocol version, and send
+ * their authentication along with the introduction instead of waiting a
+ * round trip for the version reply. If the host has one round trip
+ * authentication, the proof is sent with that too.
+ */
+struct KnownHost
+{
+    int protocolVersion;
+    bool hasOneRoundTripAuth;
+
+    KnownHost() : protocolVersion(0), hasOneRoundTripAuth(false) { }
+};
+
+QHash<QString,KnownHost> &knownHosts()
+{
+    static QHash<QString,KnownHost> hosts;
+    return hosts;
+}
+
+}
+
 namespace Protocol
 {
 
@@ -57,6 +83,10 @@ public:
     QString errorMessage;
     QTimer errorRetryTimer;
     int errorRetryCount;
+    // Set when the connection assumed a protocol version; see knownHosts
+    bool isOptimistic;
+    // Time since the socket connected, for the time taken to become ready
+    QElapsedTimer setupTimer;
 
     OutboundConnectorPrivate(OutboundConnector *q)
         : QObject(q)
@@ -65,12 +95,15 @@ public:
         , port(0)
         , status(OutboundConnector::Inactive)
         , errorRetryCount(0)
+        , isOptimistic(false)
     {
         connect(&errorRetryTimer, &QTimer::timeout, this, &OutboundConnectorPrivate::retryAfterError);
     }
 
     void setStatus(OutboundConnector::Status status);
     void setError(const QString &errorMessage);
+    void setReady();
+    void startConnecting();
 
 public slots:
     void onConnected();
@@ -129,14 +162,18 @@ bool OutboundConnector::connectToHost(const QString &hostname, quint16 port)
 
     d->hostname = hostname;
     d->port = port;
-
-    d->socket = new Tor::TorSocket(this);
-    connect(d->socket, &Tor::TorSocket::connected, d, &OutboundConnectorPrivate::onConnected);
-    d->setStatus(Connecting);
-    d->socket->connectToHost(d->hostname, d->port);
+    d->startConnecting();
     return true;
 }
 
+void OutboundConnectorPrivate::startConnecting()
+{
+    socket = new Tor::TorSocket(q);
+    connect(socket, &Tor::TorSocket::connected, this, &OutboundConnectorPrivate::onConnected);
+    setStatus(OutboundConnector::Connecting);
+    socket->connectToHost(hostname, port);
+}
+
 void OutboundConnector::abort()
 {
     d->abort();
@@ -222,6 +259,14 @@ void OutboundConnectorPrivate::setError(const QString &message)
     qDebug() << "Retrying outbound connection attempt in 60 seconds after an error";
 }
 
+void OutboundConnectorPrivate::setReady()
+{
+    qDebug() << "Outbound connection to" << hostname << "was ready" << setupTimer.elapsed()
+             << "ms after connecting" << (isOptimistic ? "(optimistic)" : "");
+    setStatus(OutboundConnector::Ready);
+    emit q->ready();
+}
+
 void OutboundConnectorPrivate::retryAfterError()
 {
     if (status != OutboundConnector::Error) {
@@ -246,22 +291,59 @@ void OutboundConnectorPrivate::onConnected()
         return;
     }
 
-    connection = QSharedPointer<Connection>(new Connection(socket, Connection::ClientSide), &QObject::deleteLater);
+    // Authentication doesn't need to wait for the version reply if the version is already known
+    int version = knownHosts().value(hostname).protocolVersion;
+    isOptimistic = version > 0 && authPrivateKey.isLoaded();
+    setupTimer.start();
+
+    Connection *c = isOptimistic ? Connection::optimisticClient(socket, version) : new Connection(socket, Connection::ClientSide);
+    connection = QSharedPointer<Connection>(c, &QObject::deleteLater);
 
     // Socket is now owned by connection
     Q_ASSERT(socket->parent() == connection);
     socket->setReconnectEnabled(false);
     socket = 0;
 
-    connect(connection.data(), &Connection::ready, this, &OutboundConnectorPrivate::startAuthentication);
+    connect(connection.data(), &Connection::ready, this,
+        [this]() {
+            knownHosts()[hostname].protocolVersion = connection->protocolVersion();
+        }
+    );
+    // Features are negotiated after authentication, often once the connection has been handed off
+    QString host = hostname;
+    connect(c, &Connection::featuresEnabled, c,
+        [c,host]() {
+            if (c->hasFeature(AuthHiddenServiceChannel::OneRoundTripFeature))
+                knownHosts()[host].hasOneRoundTripAuth = true;
+        }
+    );
+    if (!isOptimistic)
+        connect(connection.data(), &Connection::ready, this, &OutboundConnectorPrivate::startAuthentication);
+
     // XXX Needs special treatment in UI (along with some other error types here)
     connect(connection.data(), &Connection::versionNegotiationFailed, this,
         [this]() {
+            if (isOptimistic) {
+                // The peer may have changed versions; try again without assuming one
+                qDebug() << "Optimistic connection to" << hostname << "failed version negotiation, reconnecting";
+                knownHosts().remove(hostname);
+                if (Channel *authChannel = connection->findChannel<AuthHiddenServiceChannel>(Channel::Outbound))
+                    authChannel->disconnect(this);
+                abort();
+                isOptimistic = false;
+                startConnecting();
+                return;
+            }
+
             setError(QStringLiteral("Protocol version negotiation failed with peer"));
         }
     );
     connect(connection.data(), &Connection::oldVersionNegotiated, q, &OutboundConnector::oldVersionNegotiated);
     setStatus(OutboundConnector::Initializing);
+
+    // Authentication is sent in the same flight as the introduction
+    if (isOptimistic)
+        startAuthentication();
 }
 
 void OutboundConnectorPrivate::startAuthentication()
@@ -274,8 +356,7 @@ void OutboundConnectorPrivate::startAuthentication()
 
     if (!authPrivateKey.isLoaded() || !authPrivateKey.isPrivate()) {
         qDebug() << "Skipping authentication for OutboundConnector without a private key";
-        setStatus(OutboundConnector::Ready);
-        emit q->ready();
+        setReady();
         return;
     }
 
@@ -283,8 +364,7 @@ void OutboundConnectorPrivate::startAuthentication()
     AuthHiddenServiceChannel *authChannel = new AuthHiddenServiceChannel(Channel::Outbound, connection.data());
     connect(authChannel, &AuthHiddenServiceChannel::authSuccessful, this,
         [this]() {
-            setStatus(OutboundConnector::Ready);
-            emit q->ready();
+            setReady();
         }
     );
     connect(authChannel, &AuthHiddenServiceChannel::authFailed, this,
@@ -301,10 +381,18 @@ void OutboundConnectorPrivate::startAuthentication()
         }
     );
 
+    // The one round trip proof is signed off the GUI thread before the request
+    // is sent; it's still in the first flight, so this adds no round trip.
+    connect(authChannel, &AuthHiddenServiceChannel::oneRoundTripPrepared, this,
+        [this,authChannel]() {
+            if (!authChannel->openChannel())
+                setError(QStringLiteral("Unable to open authentication channel"));
+        }
+    );
+
     authChannel->setPrivateKey(authPrivateKey);
-    if (!authChannel->openChannel()) {
-        setError(QStringLiteral("Unable to open authentication channel"));
-    }
+    authChannel->setOneRoundTrip(knownHosts().value(hostname).hasOneRoundTripAuth);
+    authChannel->prepareOneRoundTrip();
 }
 
 #include "OutboundConnector.moc"
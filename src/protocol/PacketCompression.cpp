@@ -0,0 +1,196 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PacketCompression.h"
+#include "utils/Useful.h"
+#include <QDebug>
+#include <zlib.h>
+#include <cstring>
+
+using namespace Protocol;
+
+constexpr const char *PacketCompression::FeatureName;
+
+namespace {
+
+// Raw deflate with a 4KB window; both peers must use the same window and dictionary
+const int WindowBits = 12;
+const int MemLevel = 5;
+
+// Empty stored block written by a sync flush; it ends every compressed packet, and isn't sent
+const Bytef FlushMarker[] = { 0x00, 0x00, 0xff, 0xff };
+
+/* Preset dictionary for both directions of every compressed channel
+ *
+ * This is part of the protocol, and can't be changed without a new feature
+ * name. Deflate refers back to the end of the dictionary most cheaply, so the
+ * most common text is last.
+ */
+const char Dictionary[] =
+    "I'm not sure what you mean, can you send me the link again? "
+    "https://www.youtube.com/watch?v= https://github.com/ https://en.wikipedia.org/wiki/ "
+    "I think that's a good idea. Let me know when you're free tomorrow. "
+    "Are you there? Did you get my message? I'll be back in a few minutes. "
+    "What do you think about this? I don't know, maybe we should talk about it later. "
+    "Sorry, I was away from my computer. No problem, take your time. "
+    "Good morning! Good night! See you later. Talk to you soon. "
+    "Thank you so much! Thanks, you too. That sounds great. "
+    "Yes, I have. No, I haven't. I can't right now, but I will. "
+    "How are you doing? I'm doing well, how about you? "
+    "What are you up to? Not much, just working on something. "
+    "Hey, how's it going? hello hi hey yes yeah no ok okay lol :) ";
+
+}
+
+struct PacketCompression::Stream
+{
+    z_stream z;
+    bool isDeflate;
+    bool failed;
+
+    explicit Stream(bool isDeflate);
+    ~Stream();
+};
+
+PacketCompression::Stream::Stream(bool deflate)
+    : isDeflate(deflate)
+    , failed(false)
+{
+    memset(&z, 0, sizeof(z));
+
+    const Bytef *dictionary = reinterpret_cast<const Bytef*>(Dictionary);
+    uInt dictionarySize = sizeof(Dictionary) - 1;
+    int re;
+    if (isDeflate) {
+        re = deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -WindowBits, MemLevel, Z_DEFAULT_STRATEGY);
+        if (re == Z_OK)
+            re = deflateSetDictionary(&z, dictionary, dictionarySize);
+    } else {
+        re = inflateInit2(&z, -WindowBits);
+        if (re == Z_OK)
+            re = inflateSetDictionary(&z, dictionary, dictionarySize);
+    }
+
+    if (re != Z_OK) {
+        qWarning() << "Failed to initialize packet compression:" << re << (z.msg ? z.msg : "");
+        failed = true;
+    }
+}
+
+PacketCompression::Stream::~Stream()
+{
+    if (isDeflate)
+        deflateEnd(&z);
+    else
+        inflateEnd(&z);
+}
+
+PacketCompression::PacketCompression()
+    : deflateStream(0)
+    , inflateStream(0)
+{
+}
+
+PacketCompression::~PacketCompression()
+{
+    delete deflateStream;
+    delete inflateStream;
+}
+
+int PacketCompression::maxCompressedSize(int size)
+{
+    // Incompressible data is written as stored blocks, which cost 5 bytes for
+    // each block of up to 2047 bytes with this MemLevel, plus the final flush.
+    return size + (size >> 8) + 32;
+}
+
+int PacketCompression::compress(const char *data, int size, char *out)
+{
+    if (!deflateStream)
+        deflateStream = new Stream(true);
+    if (deflateStream->failed)
+        return -1;
+
+    z_stream &z = deflateStream->z;
+    int maxSize = maxCompressedSize(size);
+    z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    z.avail_in = uInt(size);
+    z.next_out = reinterpret_cast<Bytef*>(out);
+    z.avail_out = uInt(maxSize);
+
+    // All of the output must fit, otherwise the stream can't continue
+    int re = deflate(&z, Z_SYNC_FLUSH);
+    int outSize = maxSize - int(z.avail_out);
+    if (re != Z_OK || z.avail_in != 0 || z.avail_out == 0 || outSize < int(sizeof(FlushMarker)) ||
+        memcmp(out + outSize - sizeof(FlushMarker), FlushMarker, sizeof(FlushMarker)) != 0)
+    {
+        BUG() << "Packet compression failed:" << re << (z.msg ? z.msg : "") << "with" << z.avail_in
+              << "bytes left and" << z.avail_out << "bytes of space";
+        deflateStream->failed = true;
+        return -1;
+    }
+
+    return outSize - int(sizeof(FlushMarker));
+}
+
+int PacketCompression::decompress(const char *data, int size, char *out, int maxSize)
+{
+    if (!inflateStream)
+        inflateStream = new Stream(false);
+    if (inflateStream->failed)
+        return -1;
+
+    z_stream &z = inflateStream->z;
+    z.next_out = reinterpret_cast<Bytef*>(out);
+    z.avail_out = uInt(maxSize);
+
+    // The packet's data, then the flush marker that was removed by the sender.
+    // Input that's left over means the packet decompresses to more than maxSize.
+    for (int i = 0; i < 2; i++) {
+        if (i == 0) {
+            z.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+            z.avail_in = uInt(size);
+        } else {
+            z.next_in = const_cast<Bytef*>(FlushMarker);
+            z.avail_in = uInt(sizeof(FlushMarker));
+        }
+
+        int re = inflate(&z, Z_SYNC_FLUSH);
+        if ((re != Z_OK && re != Z_BUF_ERROR) || z.avail_in != 0) {
+            qDebug() << "Invalid compressed packet:" << re << (z.msg ? z.msg : "");
+            inflateStream->failed = true;
+            return -1;
+        }
+    }
+
+    return maxSize - int(z.avail_out);
+}
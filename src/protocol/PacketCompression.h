@@ -0,0 +1,105 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_PACKETCOMPRESSION_H
+#define PROTOCOL_PACKETCOMPRESSION_H
+
+#include <QtGlobal>
+
+namespace Protocol
+{
+
+/* Deflate streams for the packets of one compressed channel
+ *
+ * Channels that are opened with compression (see doc/protocol.md) carry a
+ * format byte before each packet's data. Packets smaller than
+ * CompressionThreshold are sent raw. Larger packets are compressed as one
+ * continuous raw deflate stream for each direction of the channel, which
+ * starts from a preset dictionary of common chat text. Each packet ends with
+ * a sync flush, so it can be decompressed as soon as it arrives; the
+ * 00 00 ff ff marker of the flush is implied and not sent.
+ *
+ * The streams are per channel, rather than per connection, because packets
+ * from different channels are reordered by the outbound scheduler. They are
+ * created when first used.
+ *
+ * Once compress has failed, the peer can't follow the stream any more, and
+ * compress will always fail; the channel is closed when that happens.
+ * Likewise for decompress, which fails for any invalid data from the peer.
+ */
+class PacketCompression
+{
+    Q_DISABLE_COPY(PacketCompression)
+
+public:
+    // Connection feature for opening channels with compression
+    static constexpr const char *FeatureName = "im.ricochet.compression";
+
+    // Format byte at the start of each packet on a compressed channel
+    enum PacketFormat {
+        RawPacket = 0,
+        CompressedPacket = 1
+    };
+
+    // Packets with less data than this are sent raw
+    static const int CompressionThreshold = 64;
+
+    PacketCompression();
+    ~PacketCompression();
+
+    /* Largest possible result of compressing 'size' bytes */
+    static int maxCompressedSize(int size);
+
+    /* Compress 'size' bytes from 'data' into 'out'
+     *
+     * 'size' must not be zero, and 'out' must have space for maxCompressedSize(size) bytes. Returns the
+     * compressed size, or -1 on failure. The result must be sent, because
+     * the peer needs it to decompress later packets.
+     */
+    int compress(const char *data, int size, char *out);
+
+    /* Decompress a packet's data into at most 'maxSize' bytes of 'out'
+     *
+     * Returns the decompressed size, or -1 if the data is invalid or would
+     * decompress to more than 'maxSize' bytes.
+     */
+    int decompress(const char *data, int size, char *out, int maxSize);
+
+private:
+    struct Stream;
+    Stream *deflateStream;
+    Stream *inflateStream;
+};
+
+}
+
+#endif
@@ -0,0 +1,142 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "PacketHeader.h"
+#include <QtEndian>
+#include <QDebug>
+
+using namespace Protocol;
+
+int PacketHeader::varintSize(quint32 value)
+{
+    int size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+uchar *PacketHeader::writeVarint(uchar *p, quint32 value, int size)
+{
+    for (int i = 1; i < size; i++) {
+        *p++ = uchar(value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    *p++ = uchar(value);
+    return p;
+}
+
+int PacketHeader::readVarint(const uchar *p, int available, quint32 *value)
+{
+    quint32 result = 0;
+    for (int i = 0; i < VarintMaxSize; i++) {
+        if (i >= available)
+            return 0;
+        result |= quint32(p[i] & 0x7f) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *value = result;
+            return i + 1;
+        }
+    }
+    return -1;
+}
+
+int PacketHeader::parse(int version, const uchar *data, int available, int maxDataSize,
+                        int *headerSize, int *dataSize, int *channelId)
+{
+    if (version < 2) {
+        if (available < Version1Size)
+            return 0;
+
+        quint16 packetSize = qFromBigEndian<quint16>(data);
+        if (packetSize < Version1Size) {
+            qWarning() << "Corrupted data from connection (packet size is too small); disconnecting";
+            return -1;
+        } else if (packetSize - Version1Size > maxDataSize) {
+            qWarning() << "Corrupted data from connection (packet size is too large); disconnecting";
+            return -1;
+        }
+
+        *headerSize = Version1Size;
+        *dataSize = packetSize - Version1Size;
+        *channelId = qFromBigEndian<quint16>(&data[2]);
+        return 1;
+    }
+
+    // Size of the data, then the channel shifted left by one, with the low bit set if there are flags
+    quint32 size = 0, channel = 0;
+    int sizeBytes = readVarint(data, available, &size);
+    int channelBytes = sizeBytes;
+    if (sizeBytes > 0)
+        channelBytes = readVarint(data + sizeBytes, available - sizeBytes, &channel);
+    if (channelBytes <= 0) {
+        if (channelBytes < 0)
+            qWarning() << "Corrupted data from connection (packet header is too long); disconnecting";
+        return channelBytes;
+    }
+
+    int pos = sizeBytes + channelBytes;
+    if (channel & 1) {
+        if (pos >= available)
+            return 0;
+        // No flags are defined yet
+        if (data[pos] != 0) {
+            qWarning() << "Corrupted data from connection (unknown packet flags); disconnecting";
+            return -1;
+        }
+        pos++;
+    }
+
+    if (size > quint32(qMin(maxDataSize, int(Version2MaxDataSize))) || (channel >> 1) > UINT16_MAX) {
+        qWarning() << "Corrupted data from connection (packet size or channel is too large); disconnecting";
+        return -1;
+    }
+
+    *headerSize = pos;
+    *dataSize = int(size);
+    *channelId = int(channel >> 1);
+    return 1;
+}
+
+quint8 PacketHeader::selectVersion(const QByteArray &versions, quint8 minVersion, quint8 maxVersion)
+{
+    quint8 selectedVersion = VersionFailed;
+    foreach (char c, versions) {
+        quint8 v = quint8(c);
+        if (v < minVersion || v > maxVersion)
+            continue;
+        if (selectedVersion == VersionFailed || v > selectedVersion)
+            selectedVersion = v;
+    }
+    return selectedVersion;
+}
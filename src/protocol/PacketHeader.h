@@ -0,0 +1,87 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_PACKETHEADER_H
+#define PROTOCOL_PACKETHEADER_H
+
+#include <QByteArray>
+#include <cstdint>
+
+namespace Protocol
+{
+
+/* Encoding of packet headers and the version handshake
+ *
+ * Version 1 headers are a 16-bit size, including the header, and a 16-bit
+ * channel identifier, both big-endian. Version 2 headers are varints for the
+ * size of the data and the channel identifier, and an optional flags byte.
+ * See doc/protocol.md.
+ */
+class PacketHeader
+{
+public:
+    static const int Version1Size = 4;
+    static const int Version1MaxDataSize = UINT16_MAX - Version1Size;
+    static const int Version2MaxSize = 7;
+    static const int Version2MaxDataSize = 1048576;
+    // Varints are little-endian base 128, as in protobuf, and at most 3 bytes
+    static const int VarintMaxSize = 3;
+    // Selected by the server when there is no common version
+    static const quint8 VersionFailed = 0xff;
+
+    static int varintSize(quint32 value);
+    /* Write 'value' in exactly 'size' bytes, padding with continuation bytes if necessary
+     *
+     * Returns a pointer to the byte after the varint.
+     */
+    static uchar *writeVarint(uchar *p, quint32 value, int size);
+    /* Returns the number of bytes read, 0 if the varint isn't complete, or -1 if it's too long */
+    static int readVarint(const uchar *p, int available, quint32 *value);
+
+    /* Parse the header of the packet at the start of 'data'
+     *
+     * Returns 1 and sets the header size, data size, and channel if the header
+     * is complete, 0 if more data is needed, or -1 if the header is invalid or
+     * the packet has more than 'maxDataSize' bytes of data.
+     */
+    static int parse(int version, const uchar *data, int available, int maxDataSize,
+                     int *headerSize, int *dataSize, int *channelId);
+
+    /* Choose the newest of the versions offered by a client that is between
+     * 'minVersion' and 'maxVersion', or VersionFailed if there is none
+     */
+    static quint8 selectVersion(const QByteArray &versions, quint8 minVersion, quint8 maxVersion);
+};
+
+}
+
+#endif
@@ -0,0 +1,206 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "ResumptionTicket.h"
+#include "utils/SecureRNG.h"
+#include "utils/Useful.h"
+#include <QtEndian>
+#include <openssl/evp.h>
+#include <cstring>
+
+using namespace Protocol;
+
+namespace {
+
+const int KeySize = 32;
+const int KeyIdSize = 4;
+const int NonceSize = 12;
+const int TagSize = 16;
+// A length byte, then the hostname padded with zeros
+const int HostnameSize = 1 + ResumptionTicketKeys::MaxHostnameSize;
+const int HeaderSize = KeyIdSize + NonceSize;
+const int PlaintextSize = HostnameSize + 8 + ResumptionTicketKeys::SecretSize;
+
+static_assert(ResumptionTicketKeys::TicketSize == HeaderSize + PlaintextSize + TagSize, "Ticket size doesn't match its layout");
+
+/* AES-256-GCM, with 'aad' authenticated but not encrypted
+ *
+ * On encryption, the tag is written to 'tag'; on decryption, it's checked
+ * against 'tag'. Returns false on failure, including an invalid tag.
+ */
+bool aesGcm(bool encrypt, const QByteArray &key, const uchar *nonce, const uchar *aad, int aadSize,
+            const uchar *in, int size, uchar *out, uchar *tag)
+{
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx)
+        return false;
+
+    const uchar *keyData = reinterpret_cast<const uchar*>(key.constData());
+    int len = 0;
+    bool ok = EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL, encrypt ? 1 : 0)
+           && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, NonceSize, NULL)
+           && EVP_CipherInit_ex(ctx, NULL, NULL, keyData, nonce, encrypt ? 1 : 0)
+           && EVP_CipherUpdate(ctx, NULL, &len, aad, aadSize)
+           && EVP_CipherUpdate(ctx, out, &len, in, size)
+           && len == size;
+
+    if (ok && !encrypt)
+        ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TagSize, tag);
+    if (ok)
+        ok = EVP_CipherFinal_ex(ctx, out + len, &len) && len == 0;
+    if (ok && encrypt)
+        ok = EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TagSize, tag);
+
+    EVP_CIPHER_CTX_free(ctx);
+    return ok;
+}
+
+}
+
+ResumptionTicketKeys::ResumptionTicketKeys()
+{
+    current.id = previous.id = 0;
+    current.created = previous.created = 0;
+}
+
+ResumptionTicketKeys::~ResumptionTicketKeys()
+{
+    clear(current);
+    clear(previous);
+}
+
+void ResumptionTicketKeys::clear(Key &key)
+{
+    key.key.fill(0);
+    key.key.clear();
+}
+
+void ResumptionTicketKeys::rotate(quint64 now)
+{
+    if (!current.key.isEmpty() && now < current.created + Lifetime)
+        return;
+
+    // Tickets from the current key expire within the next Lifetime
+    clear(previous);
+    if (!current.key.isEmpty() && now < current.created + 2 * quint64(Lifetime)) {
+        previous = current;
+        current.key = QByteArray();
+    } else {
+        clear(current);
+    }
+
+    quint32 id = 0;
+    if (!previous.key.isEmpty())
+        id = previous.id + 1;
+    else
+        SecureRNG::random(reinterpret_cast<char*>(&id), sizeof(id));
+
+    current.id = id;
+    current.key = SecureRNG::random(KeySize);
+    current.created = now;
+}
+
+QByteArray ResumptionTicketKeys::issue(const QString &clientHostname, const QByteArray &secret, quint64 now)
+{
+    QByteArray hostname = clientHostname.toLatin1();
+    if (hostname.isEmpty() || hostname.size() > MaxHostnameSize || secret.size() != SecretSize) {
+        BUG() << "Invalid data for resumption ticket";
+        return QByteArray();
+    }
+
+    rotate(now);
+    QByteArray nonce = SecureRNG::random(NonceSize);
+    if (current.key.size() != KeySize || nonce.size() != NonceSize)
+        return QByteArray();
+
+    uchar plaintext[PlaintextSize];
+    memset(plaintext, 0, HostnameSize);
+    plaintext[0] = uchar(hostname.size());
+    memcpy(plaintext + 1, hostname.constData(), hostname.size());
+    qToBigEndian(now + Lifetime, plaintext + HostnameSize);
+    memcpy(plaintext + HostnameSize + 8, secret.constData(), SecretSize);
+
+    QByteArray ticket(TicketSize, 0);
+    uchar *p = reinterpret_cast<uchar*>(ticket.data());
+    qToBigEndian(current.id, p);
+    memcpy(p + KeyIdSize, nonce.constData(), NonceSize);
+
+    bool ok = aesGcm(true, current.key, p + KeyIdSize, p, HeaderSize, plaintext, PlaintextSize,
+                     p + HeaderSize, p + HeaderSize + PlaintextSize);
+    memset(plaintext, 0, sizeof(plaintext));
+    if (!ok) {
+        qWarning() << "Encrypting resumption ticket failed";
+        return QByteArray();
+    }
+
+    return ticket;
+}
+
+bool ResumptionTicketKeys::open(const QByteArray &ticket, quint64 now, QString *clientHostname, QByteArray *secret,
+                                quint64 *expiry)
+{
+    if (ticket.size() != TicketSize)
+        return false;
+
+    rotate(now);
+
+    const uchar *p = reinterpret_cast<const uchar*>(ticket.constData());
+    quint32 id = qFromBigEndian<quint32>(p);
+    const Key *key = 0;
+    if (id == current.id && !current.key.isEmpty())
+        key = &current;
+    else if (id == previous.id && !previous.key.isEmpty())
+        key = &previous;
+    else
+        return false;
+
+    // The tag is only read, but OpenSSL wants a mutable pointer
+    uchar tag[TagSize];
+    memcpy(tag, p + HeaderSize + PlaintextSize, TagSize);
+
+    uchar plaintext[PlaintextSize];
+    if (!aesGcm(false, key->key, p + KeyIdSize, p, HeaderSize, p + HeaderSize, PlaintextSize, plaintext, tag))
+        return false;
+
+    quint64 ticketExpiry = qFromBigEndian<quint64>(plaintext + HostnameSize);
+    int hostnameSize = plaintext[0];
+    bool ok = ticketExpiry > now && hostnameSize > 0 && hostnameSize <= MaxHostnameSize;
+    if (ok) {
+        *clientHostname = QString::fromLatin1(reinterpret_cast<const char*>(plaintext + 1), hostnameSize);
+        *secret = QByteArray(reinterpret_cast<const char*>(plaintext + HostnameSize + 8), SecretSize);
+        if (expiry)
+            *expiry = ticketExpiry;
+    }
+
+    memset(plaintext, 0, sizeof(plaintext));
+    return ok;
+}
@@ -0,0 +1,108 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PROTOCOL_RESUMPTIONTICKET_H
+#define PROTOCOL_RESUMPTIONTICKET_H
+
+#include <QByteArray>
+#include <QString>
+
+namespace Protocol
+{
+
+/* Keys for the authentication resumption tickets issued by one identity
+ *
+ * After a client authenticates with a proof, the server gives it a ticket
+ * and a random secret. The ticket is the client's hostname, the secret, and
+ * an expiry time, encrypted and authenticated with AES-256-GCM under a key
+ * that only the server knows. On a later connection, the client presents
+ * the ticket with an HMAC of its cookie keyed by the secret, and both sides
+ * skip the public key operations.
+ *
+ * Each hidden service identity has separate keys. The key is replaced every
+ * Lifetime seconds, and the previous key is kept for one more Lifetime, so a
+ * ticket can be opened until it expires and not after. Keys are only held in
+ * memory; tickets don't survive a restart.
+ *
+ * Times are seconds since the epoch, passed in by the caller.
+ */
+class ResumptionTicketKeys
+{
+    Q_DISABLE_COPY(ResumptionTicketKeys)
+
+public:
+    // Tickets expire this many seconds after they are issued
+    static const int Lifetime = 6 * 60 * 60;
+    static const int SecretSize = 32;
+    // Version 3 hostnames are the longest, at 56 characters
+    static const int MaxHostnameSize = 56;
+    /* Size of a ticket as returned by issue; anything else isn't valid
+     *
+     * Key id (4) | nonce (12) | encrypted hostname length (1), hostname padded
+     * to MaxHostnameSize, expiry (8) and secret | tag (16)
+     */
+    static const int TicketSize = 4 + 12 + 1 + MaxHostnameSize + 8 + SecretSize + 16;
+
+    ResumptionTicketKeys();
+    ~ResumptionTicketKeys();
+
+    /* Issue a ticket for 'clientHostname' with 'secret', expiring Lifetime after 'now'
+     *
+     * 'clientHostname' is the base32 service ID, without .onion. Returns an
+     * empty array on failure.
+     */
+    QByteArray issue(const QString &clientHostname, const QByteArray &secret, quint64 now);
+
+    /* Open a ticket issued by these keys
+     *
+     * Returns false if the ticket was modified, was issued with a key that
+     * has been discarded, or has expired at 'now'.
+     */
+    bool open(const QByteArray &ticket, quint64 now, QString *clientHostname, QByteArray *secret, quint64 *expiry = 0);
+
+private:
+    struct Key
+    {
+        quint32 id;
+        QByteArray key;
+        quint64 created;
+    };
+
+    Key current, previous;
+
+    void rotate(quint64 now);
+    static void clear(Key &key);
+};
+
+}
+
+#endif
@@ -52,7 +52,10 @@ QByteArray AddOnionCommand::build()
 {
     QByteArray out("ADD_ONION");
 
-    if (m_service->privateKey().isLoaded()) {
+    if (m_service->privateKey().isLoaded() && m_service->privateKey().algorithm() == CryptoKey::Ed25519) {
+        out += " ED25519-V3:";
+        out += m_service->privateKey().expandedPrivateKey().toBase64();
+    } else if (m_service->privateKey().isLoaded()) {
         out += " RSA1024:";
         out += m_service->privateKey().encodedPrivateKey(CryptoKey::DER).toBase64();
     } else {
@@ -0,0 +1,147 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Base32.h"
+#include <QtEndian>
+
+/* Each group of 5 bytes and 8 characters is handled as a 64-bit word,
+ * with one character in each byte (SWAR). Characters are checked and
+ * converted with arithmetic on all 8 bytes at once.
+ */
+
+namespace {
+
+const quint64 Ones = Q_UINT64_C(0x0101010101010101);
+const quint64 High = Q_UINT64_C(0x8080808080808080);
+
+// 0xff in each byte whose high bit is set in 'bits', and 0 in the others
+inline quint64 byteMask(quint64 bits)
+{
+    return ((bits & High) >> 7) * 0xff;
+}
+
+/* The high bit of each byte that is within lo to hi
+ *
+ * Bytes must be below 0x80, so that nothing carries between them.
+ */
+inline quint64 inRange(quint64 v, quint8 lo, quint8 hi)
+{
+    quint64 aboveLo = v + Ones * (0x80 - lo);
+    quint64 aboveHi = v + Ones * (0x7f - hi);
+    return aboveLo & ~aboveHi & High;
+}
+
+// Spread 40 bits into the low 5 bits of each byte, most significant first
+inline quint64 spread(quint64 v)
+{
+    v = ((v & Q_UINT64_C(0x000000fffff00000)) << 12) | (v & Q_UINT64_C(0x00000000000fffff));
+    v = ((v & Q_UINT64_C(0x000ffc00000ffc00)) << 6) | (v & Q_UINT64_C(0x000003ff000003ff));
+    v = ((v & Q_UINT64_C(0x03e003e003e003e0)) << 3) | (v & Q_UINT64_C(0x001f001f001f001f));
+    return v;
+}
+
+// The inverse of spread
+inline quint64 gather(quint64 v)
+{
+    v = ((v & Q_UINT64_C(0x1f001f001f001f00)) >> 3) | (v & Q_UINT64_C(0x001f001f001f001f));
+    v = ((v & Q_UINT64_C(0x03ff000003ff0000)) >> 6) | (v & Q_UINT64_C(0x000003ff000003ff));
+    v = ((v & Q_UINT64_C(0x000fffff00000000)) >> 12) | (v & Q_UINT64_C(0x00000000000fffff));
+    return v;
+}
+
+}
+
+void base32_encode(char *dest, unsigned destlen, const char *src, unsigned srclen)
+{
+    const uchar *in = reinterpret_cast<const uchar*>(src);
+    uchar *out = reinterpret_cast<uchar*>(dest);
+
+    // We need a whole number of 5 byte groups, and enough space
+    if ((srclen % 5) != 0 || destlen < (srclen / 5) * 8 + 1) {
+        Q_ASSERT(false);
+        for (unsigned i = 0; i < destlen; i++)
+            dest[i] = 0;
+        return;
+    }
+
+    for (unsigned i = 0; i < srclen; i += 5, in += 5, out += 8) {
+        quint64 v = quint64(in[0]) << 32 | quint64(in[1]) << 24 | quint64(in[2]) << 16 |
+                    quint64(in[3]) << 8 | quint64(in[4]);
+        v = spread(v);
+
+        // 'a' to 'z' for 0 to 25, then '2' to '7'
+        quint64 digits = byteMask(inRange(v, 26, 31));
+        v = v + Ones * 'a' - (digits & (Ones * ('a' + 26 - '2')));
+        qToBigEndian(v, out);
+    }
+
+    *out = 0;
+}
+
+bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srclen)
+{
+    const uchar *in = reinterpret_cast<const uchar*>(src);
+    uchar *out = reinterpret_cast<uchar*>(dest);
+
+    // We need a whole number of 8 character groups, and enough space
+    if ((srclen % 8) != 0 || (srclen / 8) * 5 + 1 > destlen) {
+        Q_ASSERT(false);
+        return false;
+    }
+
+    // Invalid characters are only checked at the end, so that the time taken doesn't depend on them
+    quint64 invalid = 0;
+    for (unsigned i = 0; i < srclen; i += 8, in += 8, out += 5) {
+        quint64 v = qFromBigEndian<quint64>(in);
+        invalid |= v & High;
+        v &= ~High;
+
+        // Setting 0x20 folds uppercase letters into lowercase, and doesn't change digits
+        quint64 folded = v | (Ones * 0x20);
+        quint64 letters = inRange(folded, 'a', 'z');
+        quint64 digits = inRange(v, '2', '7');
+        invalid |= ~(letters | digits) & High;
+
+        // Setting the high bit of each byte keeps subtraction from borrowing across them
+        quint64 letterValues = ((folded | High) - Ones * 'a') & byteMask(letters);
+        quint64 digitValues = ((v | High) - Ones * ('2' - 26)) & byteMask(digits);
+        v = gather((letterValues | digitValues) & (Ones * 0x1f));
+
+        out[0] = uchar(v >> 32);
+        out[1] = uchar(v >> 24);
+        out[2] = uchar(v >> 16);
+        out[3] = uchar(v >> 8);
+        out[4] = uchar(v);
+    }
+
+    return invalid == 0;
+}
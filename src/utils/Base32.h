@@ -0,0 +1,59 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef BASE32_H
+#define BASE32_H
+
+/* Base32 encoding as in RFC 3548, with lowercase output and no padding
+ *
+ * These are used for onion hostnames, which are derived from keys, so the
+ * time taken doesn't depend on the data: there are no branches or table
+ * lookups indexed by its values, and no allocation.
+ */
+
+/* Encode 'srclen' bytes from 'src' into 'dest' as a null-terminated string
+ *
+ * srclen must be a multiple of 5, and destlen must be at least
+ * srclen * 8 / 5 + 1. Otherwise, 'dest' is cleared.
+ */
+void base32_encode(char *dest, unsigned destlen, const char *src, unsigned srclen);
+
+/* Decode 'srclen' characters from 'src' into 'dest'
+ *
+ * srclen must be a multiple of 8, and destlen must be at least
+ * srclen * 5 / 8 + 1. Upper and lowercase characters are accepted. Returns
+ * false if the lengths are wrong or any character is invalid, in which case
+ * the contents of 'dest' are undefined.
+ */
+bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srclen);
+
+#endif // BASE32_H
@@ -31,13 +31,21 @@
  */
 
 #include "CryptoKey.h"
+#include "Base32.h"
 #include "SecureRNG.h"
 #include "Useful.h"
 #include <QtDebug>
 #include <QFile>
+#include <QMutex>
+#include <QRunnable>
+#include <QSharedPointer>
+#include <QThreadPool>
 #include <openssl/bn.h>
 #include <openssl/bio.h>
 #include <openssl/pem.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 void RSA_get0_factors(const RSA *r, const BIGNUM **p, const BIGNUM **q)
@@ -48,8 +56,97 @@ void RSA_get0_factors(const RSA *r, const BIGNUM **p, const BIGNUM **q)
 #define RSA_bits(o) (BN_num_bits((o)->n))
 #endif
 
-void base32_encode(char *dest, unsigned destlen, const char *src, unsigned srclen);
-bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srclen);
+// Ed25519 keys are only available from OpenSSL 1.1.1
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+#define HAVE_ED25519
+#endif
+
+namespace {
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+// OpenSSL before 1.1 can only be used from several threads with locking callbacks
+QMutex *opensslLocks = 0;
+
+void opensslLockingCallback(int mode, int n, const char *file, int line)
+{
+    Q_UNUSED(file);
+    Q_UNUSED(line);
+    if (mode & CRYPTO_LOCK)
+        opensslLocks[n].lock();
+    else
+        opensslLocks[n].unlock();
+}
+#endif
+
+Q_GLOBAL_STATIC(QThreadPool, cryptoThreadPoolInstance)
+
+// Worker threads for slow key operations; only called from the main thread
+QThreadPool *cryptoThreadPool()
+{
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    if (!opensslLocks && !CRYPTO_get_locking_callback()) {
+        opensslLocks = new QMutex[CRYPTO_num_locks()];
+        CRYPTO_set_locking_callback(opensslLockingCallback);
+    }
+#endif
+    return cryptoThreadPoolInstance();
+}
+
+#ifdef HAVE_ED25519
+QByteArray rawEd25519Key(EVP_PKEY *key, bool privateKey)
+{
+    QByteArray re(32, 0);
+    size_t len = re.size();
+    uchar *buf = reinterpret_cast<uchar*>(re.data());
+    int r = privateKey ? EVP_PKEY_get_raw_private_key(key, buf, &len)
+                       : EVP_PKEY_get_raw_public_key(key, buf, &len);
+    if (r != 1 || len != 32) {
+        OPENSSL_cleanse(buf, re.size());
+        return QByteArray();
+    }
+    return re;
+}
+#endif
+
+}
+
+/* Runs 'work' on a crypto worker thread, then 'done' on the thread of 'context'
+ *
+ * The task belongs to the thread that started it. It's deleted after the
+ * finished signal has been delivered, and deletes itself from the worker
+ * thread so that it can't be deleted while still emitting.
+ */
+class CryptoTask : public QObject, public QRunnable
+{
+    Q_OBJECT
+
+public:
+    static void start(QObject *context, std::function<void()> work, std::function<void()> done)
+    {
+        CryptoTask *task = new CryptoTask(work);
+        connect(task, &CryptoTask::finished, context, done);
+        cryptoThreadPool()->start(task);
+    }
+
+    virtual void run()
+    {
+        work();
+        emit finished();
+        deleteLater();
+    }
+
+signals:
+    void finished();
+
+private:
+    std::function<void()> work;
+
+    explicit CryptoTask(std::function<void()> w)
+        : work(w)
+    {
+        setAutoDelete(false);
+    }
+};
 
 CryptoKey::CryptoKey()
 {
@@ -67,6 +164,11 @@ CryptoKey::Data::~Data()
         RSA_free(key);
         key = 0;
     }
+    if (edKey)
+    {
+        EVP_PKEY_free(edKey);
+        edKey = 0;
+    }
 }
 
 void CryptoKey::clear()
@@ -74,6 +176,12 @@ void CryptoKey::clear()
     d = 0;
 }
 
+QCache<QByteArray,CryptoKey::DataPointer> &CryptoKey::publicKeyCache()
+{
+    static QCache<QByteArray,DataPointer> cache(PublicKeyCacheSize);
+    return cache;
+}
+
 bool CryptoKey::loadFromData(const QByteArray &data, KeyType type, KeyFormat format)
 {
     RSA *key = NULL;
@@ -82,7 +190,31 @@ bool CryptoKey::loadFromData(const QByteArray &data, KeyType type, KeyFormat for
     if (data.isEmpty())
         return false;
 
-    if (format == PEM) {
+    if (format == Raw) {
+#ifdef HAVE_ED25519
+        const uchar *dp = reinterpret_cast<const uchar*>(data.constData());
+        EVP_PKEY *edKey = NULL;
+        if (data.size() == 32) {
+            if (type == PrivateKey)
+                edKey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, dp, data.size());
+            else
+                edKey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, dp, data.size());
+        }
+
+        if (!edKey) {
+            qWarning() << "Failed to parse" << (type == PrivateKey ? "private" : "public") << "Ed25519 key from data";
+            return false;
+        }
+
+        d = new Data;
+        d->edKey = edKey;
+        d->isEdPrivate = (type == PrivateKey);
+        return true;
+#else
+        qWarning() << "Ed25519 keys are not supported by this version of OpenSSL";
+        return false;
+#endif
+    } else if (format == PEM) {
         BIO *b = BIO_new_mem_buf((void*)data.constData(), -1);
 
         if (type == PrivateKey)
@@ -92,6 +224,13 @@ bool CryptoKey::loadFromData(const QByteArray &data, KeyType type, KeyFormat for
 
         BIO_free(b);
     } else if (format == DER) {
+        if (type == PublicKey) {
+            if (DataPointer *cached = publicKeyCache().object(data)) {
+                d = *cached;
+                return true;
+            }
+        }
+
         const uchar *dp = reinterpret_cast<const uchar*>(data.constData());
 
         if (type == PrivateKey)
@@ -108,6 +247,8 @@ bool CryptoKey::loadFromData(const QByteArray &data, KeyType type, KeyFormat for
     }
 
     d = new Data(key);
+    if (format == DER && type == PublicKey)
+        publicKeyCache().insert(data, new DataPointer(d));
     return true;
 }
 
@@ -127,10 +268,42 @@ bool CryptoKey::loadFromFile(const QString &path, KeyType type, KeyFormat format
     return loadFromData(data, type, format);
 }
 
+bool CryptoKey::generateEd25519()
+{
+    clear();
+
+#ifdef HAVE_ED25519
+    EVP_PKEY *edKey = NULL;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_ED25519, NULL);
+    bool ok = ctx && EVP_PKEY_keygen_init(ctx) == 1 && EVP_PKEY_keygen(ctx, &edKey) == 1;
+    EVP_PKEY_CTX_free(ctx);
+
+    if (!ok) {
+        qWarning() << "Failed to generate Ed25519 key";
+        return false;
+    }
+
+    d = new Data;
+    d->edKey = edKey;
+    d->isEdPrivate = true;
+    return true;
+#else
+    qWarning() << "Ed25519 keys are not supported by this version of OpenSSL";
+    return false;
+#endif
+}
+
+CryptoKey::KeyAlgorithm CryptoKey::algorithm() const
+{
+    return (isLoaded() && d->edKey) ? Ed25519 : RSA1024;
+}
+
 bool CryptoKey::isPrivate() const
 {
     if (!isLoaded()) {
       return false;
+    } else if (d->edKey) {
+        return d->isEdPrivate;
     } else {
         const BIGNUM *p, *q;
         RSA_get0_factors(d->key, &p, &q);
@@ -140,15 +313,21 @@ bool CryptoKey::isPrivate() const
 
 int CryptoKey::bits() const
 {
-    return isLoaded() ? RSA_bits(d->key) : 0;
+    if (!isLoaded())
+        return 0;
+    if (d->edKey)
+        return EVP_PKEY_bits(d->edKey);
+    return RSA_bits(d->key);
 }
 
 QByteArray CryptoKey::publicKeyDigest() const
 {
     if (!isLoaded())
         return QByteArray();
+    if (!d->digest.isNull())
+        return d->digest;
 
-    QByteArray buf = encodedPublicKey(DER);
+    QByteArray buf = encodedPublicKey(algorithm() == Ed25519 ? Raw : DER);
 
     QByteArray re(20, 0);
     bool ok = SHA1(reinterpret_cast<const unsigned char*>(buf.constData()), buf.size(),
@@ -160,6 +339,7 @@ QByteArray CryptoKey::publicKeyDigest() const
         return QByteArray();
     }
 
+    d->digest = re;
     return re;
 }
 
@@ -168,7 +348,14 @@ QByteArray CryptoKey::encodedPublicKey(KeyFormat format) const
     if (!isLoaded())
         return QByteArray();
 
-    if (format == PEM) {
+    if ((format == Raw) != (algorithm() == Ed25519))
+        return QByteArray();
+
+    if (format == Raw) {
+#ifdef HAVE_ED25519
+        return rawEd25519Key(d->edKey, false);
+#endif
+    } else if (format == PEM) {
         BIO *b = BIO_new(BIO_s_mem());
 
         if (!PEM_write_bio_RSAPublicKey(b, d->key)) {
@@ -210,7 +397,14 @@ QByteArray CryptoKey::encodedPrivateKey(KeyFormat format) const
     if (!isLoaded() || !isPrivate())
         return QByteArray();
 
-    if (format == PEM) {
+    if ((format == Raw) != (algorithm() == Ed25519))
+        return QByteArray();
+
+    if (format == Raw) {
+#ifdef HAVE_ED25519
+        return rawEd25519Key(d->edKey, true);
+#endif
+    } else if (format == PEM) {
         BIO *b = BIO_new(BIO_s_mem());
 
         if (!PEM_write_bio_RSAPrivateKey(b, d->key, NULL, NULL, 0, NULL, NULL)) {
@@ -247,10 +441,68 @@ QByteArray CryptoKey::encodedPrivateKey(KeyFormat format) const
     return QByteArray();
 }
 
+QByteArray CryptoKey::expandedPrivateKey() const
+{
+    QByteArray seed = encodedPrivateKey(Raw);
+    if (seed.size() != 32)
+        return QByteArray();
+
+    // As in RFC 8032 section 5.1.5, which is the form Tor stores and accepts
+    QByteArray re(64, 0);
+    SHA512(reinterpret_cast<const uchar*>(seed.constData()), seed.size(),
+           reinterpret_cast<uchar*>(re.data()));
+    OPENSSL_cleanse(seed.data(), seed.size());
+
+    re[0] = char(uchar(re[0]) & 248);
+    re[31] = char((uchar(re[31]) & 63) | 64);
+    return re;
+}
+
+#ifdef HAVE_ED25519
+static const int v3HostnameEncodedSize = 56;
+static const char v3ServiceIDVersion = 0x03;
+
+// The two checksum bytes of a version 3 service ID, as in Tor's rend-spec-v3
+static QByteArray v3ServiceIDChecksum(const QByteArray &publicKey)
+{
+    QByteArray checksumData = QByteArray(".onion checksum") + publicKey + v3ServiceIDVersion;
+    uchar checksum[32];
+    if (EVP_Digest(checksumData.constData(), checksumData.size(), checksum, NULL, EVP_sha3_256(), NULL) != 1) {
+        qWarning() << "Failed to hash public key data for service ID";
+        return QByteArray();
+    }
+    return QByteArray(reinterpret_cast<const char*>(checksum), 2);
+}
+#endif
+
 QString CryptoKey::torServiceID() const
 {
     if (!isLoaded())
         return QString();
+    if (!d->serviceID.isNull())
+        return d->serviceID;
+
+    if (algorithm() == Ed25519) {
+#ifdef HAVE_ED25519
+        // Version 3: base32(pubkey | checksum[:2] | version), as in Tor's rend-spec-v3
+        QByteArray publicKey = encodedPublicKey(Raw);
+        if (publicKey.isEmpty())
+            return QString();
+
+        QByteArray checksum = v3ServiceIDChecksum(publicKey);
+        if (checksum.isEmpty())
+            return QString();
+
+        QByteArray data = publicKey + checksum + QByteArray(1, v3ServiceIDVersion);
+
+        QByteArray re(v3HostnameEncodedSize+1, 0);
+        base32_encode(re.data(), re.size(), data.constData(), data.size());
+        re.chop(1);
+
+        d->serviceID = QString::fromLatin1(re);
+        return d->serviceID;
+#endif
+    }
 
     QByteArray digest = publicKeyDigest();
     if (digest.isNull())
@@ -265,7 +517,31 @@ QString CryptoKey::torServiceID() const
     // Chop extra null byte
     re.chop(1);
 
-    return QString::fromLatin1(re);
+    d->serviceID = QString::fromLatin1(re);
+    return d->serviceID;
+}
+
+bool CryptoKey::isValidServiceID(const QString &serviceID)
+{
+    QByteArray encoded = serviceID.toLatin1();
+    if (encoded.size() == 16) {
+        char data[11];
+        return base32_decode(data, sizeof(data), encoded.constData(), encoded.size());
+    }
+
+#ifdef HAVE_ED25519
+    if (encoded.size() == v3HostnameEncodedSize) {
+        // pubkey | checksum[:2] | version
+        char data[36];
+        if (!base32_decode(data, sizeof(data), encoded.constData(), encoded.size()))
+            return false;
+        if (data[34] != v3ServiceIDVersion)
+            return false;
+        return v3ServiceIDChecksum(QByteArray(data, 32)) == QByteArray(data + 32, 2);
+    }
+#endif
+
+    return false;
 }
 
 QByteArray CryptoKey::signData(const QByteArray &data) const
@@ -286,6 +562,26 @@ QByteArray CryptoKey::signSHA256(const QByteArray &digest) const
     if (!isPrivate())
         return QByteArray();
 
+#ifdef HAVE_ED25519
+    if (d->edKey) {
+        QByteArray re(64, 0);
+        size_t sigsize = re.size();
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        bool ok = ctx && EVP_DigestSignInit(ctx, NULL, NULL, NULL, d->edKey) == 1 &&
+                  EVP_DigestSign(ctx, reinterpret_cast<uchar*>(re.data()), &sigsize,
+                                 reinterpret_cast<const uchar*>(digest.constData()), digest.size()) == 1;
+        EVP_MD_CTX_free(ctx);
+
+        if (!ok) {
+            qWarning() << "Ed25519 signature failed";
+            return QByteArray();
+        }
+
+        re.truncate(int(sigsize));
+        return re;
+    }
+#endif
+
     QByteArray re(RSA_size(d->key), 0);
     unsigned sigsize = 0;
     int r = RSA_sign(NID_sha256, reinterpret_cast<const unsigned char*>(digest.constData()), digest.size(),
@@ -319,6 +615,17 @@ bool CryptoKey::verifySHA256(const QByteArray &digest, QByteArray signature) con
     if (!isLoaded())
         return false;
 
+#ifdef HAVE_ED25519
+    if (d->edKey) {
+        EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+        bool ok = ctx && EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, d->edKey) == 1 &&
+                  EVP_DigestVerify(ctx, reinterpret_cast<const uchar*>(signature.constData()), signature.size(),
+                                   reinterpret_cast<const uchar*>(digest.constData()), digest.size()) == 1;
+        EVP_MD_CTX_free(ctx);
+        return ok;
+    }
+#endif
+
     int r = RSA_verify(NID_sha256, reinterpret_cast<const uchar*>(digest.constData()), digest.size(),
                        reinterpret_cast<uchar*>(signature.data()), signature.size(), d->key);
     if (r != 1)
@@ -326,6 +633,28 @@ bool CryptoKey::verifySHA256(const QByteArray &digest, QByteArray signature) con
     return true;
 }
 
+void CryptoKey::signSHA256Async(const QByteArray &digest, QObject *context,
+                                std::function<void(const QByteArray &signature)> callback) const
+{
+    CryptoKey key(*this);
+    QSharedPointer<QByteArray> signature(new QByteArray);
+    CryptoTask::start(context,
+        [key,digest,signature]() { *signature = key.signSHA256(digest); },
+        [callback,signature]() { callback(*signature); }
+    );
+}
+
+void CryptoKey::verifySHA256Async(const QByteArray &digest, const QByteArray &signature, QObject *context,
+                                  std::function<void(bool valid)> callback) const
+{
+    CryptoKey key(*this);
+    QSharedPointer<bool> valid(new bool(false));
+    CryptoTask::start(context,
+        [key,digest,signature,valid]() { *valid = key.verifySHA256(digest, signature); },
+        [callback,valid]() { callback(*valid); }
+    );
+}
+
 /* Cryptographic hash of a password as expected by Tor's HashedControlPassword */
 QByteArray torControlHashedPassword(const QByteArray &password)
 {
@@ -354,124 +683,4 @@ QByteArray torControlHashedPassword(const QByteArray &password)
            QByteArray::fromRawData(reinterpret_cast<const char*>(md), 20).toHex().toUpper();
 }
 
-/* Copyright (c) 2001-2004, Roger Dingledine
- * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson
- * Copyright (c) 2007-2010, The Tor Project, Inc.
- *
- * Redistribution and use in source and binary forms, with or without
- * modification, are permitted provided that the following conditions are
- * met:
- *
- *   Redistributions of source code must retain the above copyright
- *   notice, this list of conditions and the following disclaimer.
- *
- *   Redistributions in binary form must reproduce the above
- *   copyright notice, this list of conditions and the following disclaimer
- *   in the documentation and/or other materials provided with the
- *   distribution.
- *
- *   Neither the names of the copyright owners nor the names of its
- *   contributors may be used to endorse or promote products derived from
- *   this software without specific prior written permission.
- *
- * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
- * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
- * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
- * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
- * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
- * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
- * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
- * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
- * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
- * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
- * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
- */
-
-#define BASE32_CHARS "abcdefghijklmnopqrstuvwxyz234567"
-
-/* Implements base32 encoding as in rfc3548. Requires that srclen*8 is a multiple of 5. */
-void base32_encode(char *dest, unsigned destlen, const char *src, unsigned srclen)
-{
-    unsigned i, bit, v, u;
-    unsigned nbits = srclen * 8;
-
-     /* We need an even multiple of 5 bits, and enough space */
-    if ((nbits%5) != 0 || destlen > (nbits/5)+1) {
-        Q_ASSERT(false);
-        memset(dest, 0, destlen);
-        return;
-    }
-
-    for (i = 0, bit = 0; bit < nbits; ++i, bit += 5)
-    {
-        /* set v to the 16-bit value starting at src[bits/8], 0-padded. */
-        v = ((quint8) src[bit / 8]) << 8;
-        if (bit + 5 < nbits)
-            v += (quint8) src[(bit/8)+1];
-
-        /* set u to the 5-bit value at the bit'th bit of src. */
-        u = (v >> (11 - (bit % 8))) & 0x1F;
-        dest[i] = BASE32_CHARS[u];
-    }
-
-    dest[i] = '\0';
-}
-
-/* Implements base32 decoding as in rfc3548. Requires that srclen*5 is a multiple of 8. */
-bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srclen)
-{
-    unsigned int i, j, bit;
-    unsigned nbits = srclen * 5;
-
-     /* We need an even multiple of 8 bits, and enough space */
-    if ((nbits%8) != 0 || (nbits/8)+1 > destlen) {
-        Q_ASSERT(false);
-        return false;
-    }
-
-    char *tmp = new char[srclen];
-
-    /* Convert base32 encoded chars to the 5-bit values that they represent. */
-    for (j = 0; j < srclen; ++j)
-    {
-        if (src[j] > 0x60 && src[j] < 0x7B)
-            tmp[j] = src[j] - 0x61;
-        else if (src[j] > 0x31 && src[j] < 0x38)
-            tmp[j] = src[j] - 0x18;
-        else if (src[j] > 0x40 && src[j] < 0x5B)
-            tmp[j] = src[j] - 0x41;
-        else
-        {
-            delete[] tmp;
-            return false;
-        }
-    }
-
-    /* Assemble result byte-wise by applying five possible cases. */
-    for (i = 0, bit = 0; bit < nbits; ++i, bit += 8)
-    {
-        switch (bit % 40)
-        {
-        case 0:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 3) + (((quint8)tmp[(bit/5)+1]) >> 2);
-            break;
-        case 8:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 6) + (((quint8)tmp[(bit/5)+1]) << 1)
-                      + (((quint8)tmp[(bit/5)+2]) >> 4);
-            break;
-        case 16:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 4) + (((quint8)tmp[(bit/5)+1]) >> 1);
-            break;
-        case 24:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 7) + (((quint8)tmp[(bit/5)+1]) << 2)
-                      + (((quint8)tmp[(bit/5)+2]) >> 3);
-            break;
-        case 32:
-            dest[i] = (((quint8)tmp[(bit/5)]) << 5) + ((quint8)tmp[(bit/5)+1]);
-            break;
-        }
-    }
-
-    delete[] tmp;
-    return true;
-}
+#include "CryptoKey.moc"
@@ -36,6 +36,10 @@
 #include <QString>
 #include <QSharedData>
 #include <QExplicitlySharedDataPointer>
+#include <QCache>
+#include <functional>
+
+class QObject;
 
 class CryptoKey
 {
@@ -47,7 +51,14 @@ public:
 
     enum KeyFormat {
         PEM,
-        DER
+        DER,
+        // 32 byte Ed25519 key, which is the seed for a private key; only for Ed25519 keys
+        Raw
+    };
+
+    enum KeyAlgorithm {
+        RSA1024,    // Version 2 onion services
+        Ed25519     // Version 3 onion services
     };
 
     CryptoKey();
@@ -58,13 +69,26 @@ public:
     bool loadFromFile(const QString &path, KeyType type, KeyFormat format = PEM);
     void clear();
 
-    bool isLoaded() const { return d.data() && d->key != 0; }
+    // Generate a new Ed25519 private key; this needs OpenSSL 1.1.1 or later
+    bool generateEd25519();
+
+    bool isLoaded() const { return d.data() && (d->key != 0 || d->edKey != 0); }
     bool isPrivate() const;
+    KeyAlgorithm algorithm() const;
 
     QByteArray publicKeyDigest() const;
     QByteArray encodedPublicKey(KeyFormat format) const;
     QByteArray encodedPrivateKey(KeyFormat format) const;
+    // Tor's 64 byte expanded form of an Ed25519 private key, as used by ADD_ONION
+    QByteArray expandedPrivateKey() const;
+    // 16 characters for an RSA key, or 56 for an Ed25519 key
     QString torServiceID() const;
+    /* Check the encoding of a service ID, without the .onion suffix
+     *
+     * Version 3 IDs must also have the right version and checksum, and are
+     * only accepted where Ed25519 keys are supported.
+     */
+    static bool isValidServiceID(const QString &serviceID);
     int bits() const;
 
     // Calculate and sign SHA-256 digest of data using this key and PKCS #1 v2.0 padding
@@ -72,22 +96,59 @@ public:
     // Verify a signature as per signData
     bool verifyData(const QByteArray &data, QByteArray signature) const;
 
-    // Sign the input SHA-256 digest using this key and PKCS #1 v2.0 padding
+    /* Sign the input SHA-256 digest using this key and PKCS #1 v2.0 padding
+     *
+     * Ed25519 keys sign the digest itself as the message, and their
+     * signatures are always 64 bytes.
+     */
     QByteArray signSHA256(const QByteArray &digest) const;
     // Verify a signature as per signSHA256
     bool verifySHA256(const QByteArray &digest, QByteArray signature) const;
 
+    /* Sign as per signSHA256 on a worker thread
+     *
+     * 'callback' is called with the signature, which is empty on failure,
+     * on the thread of 'context' once it's ready. If 'context' is destroyed
+     * first, the callback isn't called. Operations run in parallel, and their
+     * callbacks may not be called in the order they were started.
+     */
+    void signSHA256Async(const QByteArray &digest, QObject *context,
+                         std::function<void(const QByteArray &signature)> callback) const;
+    // Verify a signature as per signSHA256 on a worker thread, like signSHA256Async
+    void verifySHA256Async(const QByteArray &digest, const QByteArray &signature, QObject *context,
+                           std::function<void(bool valid)> callback) const;
+
 private:
     struct Data : public QSharedData
     {
         typedef struct rsa_st RSA;
+        typedef struct evp_pkey_st EVP_PKEY;
+        // Exactly one of these is set
         RSA *key;
+        EVP_PKEY *edKey;
+        // Set when edKey was loaded or generated with its private half
+        bool isEdPrivate;
+        // Calculated from the key when first needed
+        QByteArray digest;
+        QString serviceID;
 
-        Data(RSA *k = 0) : key(k) { }
+        Data(RSA *k = 0) : key(k), edKey(0), isEdPrivate(false) { }
         ~Data();
     };
 
-    QExplicitlySharedDataPointer<Data> d;
+    typedef QExplicitlySharedDataPointer<Data> DataPointer;
+
+    /* Recently loaded DER public keys, by their encoded data
+     *
+     * Peers send their public key with every authentication. Keys that were
+     * loaded recently share the parsed key and its derived digest and
+     * service ID, instead of parsing and hashing it again. The cache is
+     * only used from the main thread.
+     */
+    static const int PublicKeyCacheSize = 256;
+    static QCache<QByteArray,DataPointer> &publicKeyCache();
+
+    DataPointer d;
 };
 
 QByteArray torControlHashedPassword(const QByteArray &password);
@@ -32,14 +32,163 @@
 
 #include "SecureRNG.h"
 #include <QtDebug>
+#include <QtEndian>
+#include <QAtomicInt>
+#include <QThreadStorage>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <openssl/crypto.h>
 #include <limits.h>
+#include <string.h>
 
 #ifdef Q_OS_WIN
 #include <wincrypt.h>
 #endif
 
+#ifdef Q_OS_UNIX
+#include <pthread.h>
+#endif
+
+namespace {
+
+// Incremented in the child after fork, so that it doesn't repeat the parent's output
+QBasicAtomicInt forkGeneration = Q_BASIC_ATOMIC_INITIALIZER(0);
+
+#ifdef Q_OS_UNIX
+void afterFork()
+{
+    forkGeneration.ref();
+}
+#endif
+
+void opensslRandom(uchar *buf, int size)
+{
+    int r = RAND_bytes(buf, size);
+    if (r <= 0)
+        qFatal("RNG failed: %lu", ERR_get_error());
+}
+
+inline quint32 rotate(quint32 v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+
+#define QUARTERROUND(a, b, c, d) \
+    x[a] += x[b]; x[d] = rotate(x[d] ^ x[a], 16); \
+    x[c] += x[d]; x[b] = rotate(x[b] ^ x[c], 12); \
+    x[a] += x[b]; x[d] = rotate(x[d] ^ x[a], 8); \
+    x[c] += x[d]; x[b] = rotate(x[b] ^ x[c], 7);
+
+/* One 64 byte block of ChaCha20 output (RFC 7539), with a zero nonce */
+void chacha20Block(const quint32 key[8], quint32 counter, uchar *out)
+{
+    quint32 input[16] = {
+        0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+        key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+        counter, 0, 0, 0
+    };
+    quint32 x[16];
+    memcpy(x, input, sizeof(x));
+
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(0, 4, 8, 12)
+        QUARTERROUND(1, 5, 9, 13)
+        QUARTERROUND(2, 6, 10, 14)
+        QUARTERROUND(3, 7, 11, 15)
+        QUARTERROUND(0, 5, 10, 15)
+        QUARTERROUND(1, 6, 11, 12)
+        QUARTERROUND(2, 7, 8, 13)
+        QUARTERROUND(3, 4, 9, 14)
+    }
+
+    for (int i = 0; i < 16; i++)
+        qToLittleEndian(x[i] + input[i], out + i * 4);
+    OPENSSL_cleanse(x, sizeof(x));
+}
+
+#undef QUARTERROUND
+
+/* Buffered output for one thread
+ *
+ * Each refill generates a buffer of ChaCha20 output and immediately uses the
+ * start of it as the next key, so earlier output can't be recovered from the
+ * state. Bytes are cleared from the buffer as they're used.
+ */
+class Generator
+{
+public:
+    static const int BufferSize = 1024;
+    static const int KeySize = 32;
+
+    Generator()
+        : available(0), untilReseed(0), generation(-1)
+    {
+    }
+
+    ~Generator()
+    {
+        OPENSSL_cleanse(key, sizeof(key));
+        OPENSSL_cleanse(buffer, sizeof(buffer));
+    }
+
+    void read(uchar *out, int size)
+    {
+        // A forked child must not hand out what's left of the parent's buffer
+        if (generation != forkGeneration.load()) {
+            OPENSSL_cleanse(buffer, sizeof(buffer));
+            available = 0;
+        }
+
+        while (size > 0) {
+            if (!available)
+                refill();
+
+            int n = qMin(size, available);
+            uchar *p = buffer + BufferSize - available;
+            memcpy(out, p, n);
+            memset(p, 0, n);
+            available -= n;
+            out += n;
+            size -= n;
+        }
+    }
+
+private:
+    quint32 key[KeySize / 4];
+    uchar buffer[BufferSize];
+    int available;
+    int untilReseed;
+    int generation;
+
+    void refill()
+    {
+        int currentGeneration = forkGeneration.load();
+        if (untilReseed <= 0 || generation != currentGeneration) {
+            uchar seed[KeySize];
+            opensslRandom(seed, KeySize);
+            for (int i = 0; i < KeySize / 4; i++)
+                key[i] = qFromLittleEndian<quint32>(seed + i * 4);
+            OPENSSL_cleanse(seed, sizeof(seed));
+            untilReseed = SecureRNG::ReseedInterval;
+            generation = currentGeneration;
+        }
+
+        for (int i = 0; i < BufferSize / 64; i++)
+            chacha20Block(key, i, buffer + i * 64);
+
+        for (int i = 0; i < KeySize / 4; i++)
+            key[i] = qFromLittleEndian<quint32>(buffer + i * 4);
+        memset(buffer, 0, KeySize);
+
+        available = BufferSize - KeySize;
+        untilReseed -= available;
+    }
+};
+
+QThreadStorage<Generator*> generators;
+
+}
+
 #if QT_VERSION >= 0x040700
 #include <QElapsedTimer>
 #endif
@@ -86,6 +235,14 @@ bool SecureRNG::seed()
     }
 #endif
 
+#ifdef Q_OS_UNIX
+    static bool forkHandler = false;
+    if (!forkHandler) {
+        pthread_atfork(NULL, NULL, afterFork);
+        forkHandler = true;
+    }
+#endif
+
 #if QT_VERSION >= 0x040700
     qDebug() << "RNG seed took" << timer.elapsed() << "ms";
 #endif
@@ -95,9 +252,14 @@ bool SecureRNG::seed()
 
 void SecureRNG::random(char *buf, int size)
 {
-    int r = RAND_bytes(reinterpret_cast<unsigned char*>(buf), size);
-    if (r <= 0)
-        qFatal("RNG failed: %lu", ERR_get_error());
+    if (size > BufferedRequestSize) {
+        opensslRandom(reinterpret_cast<uchar*>(buf), size);
+        return;
+    }
+
+    if (!generators.hasLocalData())
+        generators.setLocalData(new Generator);
+    generators.localData()->read(reinterpret_cast<uchar*>(buf), size);
 }
 
 QByteArray SecureRNG::random(int size)
@@ -115,17 +277,27 @@ QByteArray SecureRNG::randomPrintable(int length)
     return re;
 }
 
+/* Lemire's multiply-and-shift method, which only divides when a value
+ * might need to be rejected */
 unsigned SecureRNG::randomInt(unsigned max)
 {
-    unsigned cutoff = UINT_MAX - (UINT_MAX % max);
-    unsigned value = 0;
+    Q_STATIC_ASSERT(sizeof(unsigned) == sizeof(quint32));
+    if (!max)
+        return 0;
 
-    for (;;)
-    {
-        random(reinterpret_cast<char*>(&value), sizeof(value));
-        if (value < cutoff)
-            return value % max;
+    quint32 value = 0;
+    random(reinterpret_cast<char*>(&value), sizeof(value));
+    quint64 m = quint64(value) * max;
+
+    if (quint32(m) < max) {
+        quint32 threshold = (0u - max) % max;
+        while (quint32(m) < threshold) {
+            random(reinterpret_cast<char*>(&value), sizeof(value));
+            m = quint64(value) * max;
+        }
     }
+
+    return unsigned(m >> 32);
 }
 
 #ifndef UINT64_MAX
@@ -134,12 +306,15 @@ unsigned SecureRNG::randomInt(unsigned max)
 
 quint64 SecureRNG::randomInt64(quint64 max)
 {
+    if (!max)
+        return 0;
+
     quint64 cutoff = UINT64_MAX - (UINT64_MAX % max);
     quint64 value = 0;
 
     for (;;)
     {
-        random(reinterpret_cast<char*>(value), sizeof(value));
+        random(reinterpret_cast<char*>(&value), sizeof(value));
         if (value < cutoff)
             return value % max;
     }
@@ -35,15 +35,28 @@
 
 #include <QByteArray>
 
+/* Cryptographically secure random data
+ *
+ * Small requests are served from a per-thread buffer of ChaCha20 output,
+ * keyed from OpenSSL's RNG. Each refill replaces the key with part of its
+ * own output, and the key is taken from OpenSSL again after every
+ * ReseedInterval bytes and in the child after a fork. Larger requests go
+ * to OpenSSL directly.
+ */
 class SecureRNG
 {
 public:
+    // Requests up to this size are served from the buffer
+    static const int BufferedRequestSize = 64;
+    static const int ReseedInterval = 1024 * 1024;
+
     static bool seed();
 
     static void random(char *buf, int size);
     static QByteArray random(int size);
 
     static QByteArray randomPrintable(int length);
+    // Uniformly distributed value in [0, max); returns 0 if max is 0
     static unsigned randomInt(unsigned max);
     static quint64 randomInt64(quint64 max);
 };
@@ -39,6 +39,7 @@
 #include <QDir>
 #include <QFileInfo>
 #include <QTimer>
+#include <QElapsedTimer>
 #include <QDebug>
 #include <QPointer>
 
@@ -51,6 +52,16 @@ public:
     QString filePath;
     QString errorMessage;
     QTimer syncTimer;
+    // Started by the first change that hasn't been written
+    QElapsedTimer pendingTimer;
+    int pendingChanges;
+    int syncDelay;
+    int maxSyncLatency;
+    SettingsFile::SyncStatistics statistics;
+    bool journaled;
+    // Records for changes that haven't been appended to the journal yet
+    QByteArray journalBuffer;
+    qint64 journalSize;
     QJsonObject jsonRoot;
     SettingsObject *rootObject;
 
@@ -62,16 +73,24 @@ public:
     bool checkDirPermissions(const QString &path);
     bool readFile();
     bool writeFile();
+    void scheduleSync();
+
+    QString journalPath() const { return filePath + QStringLiteral(".journal"); }
+    void appendJournal(const QStringList &path, const QJsonValue &value);
+    bool writeJournal();
+    int replayJournal();
+    bool compact();
 
     static QStringList splitPath(const QString &input, bool &ok);
     QJsonValue read(const QJsonObject &base, const QStringList &path);
+    static bool setValue(QJsonObject &root, const QStringList &path, const QJsonValue &value, QJsonValue *originalValue);
     bool write(const QStringList &path, const QJsonValue &value);
 
 signals:
     void modified(const QStringList &path, const QJsonValue &value);
 
-private slots:
-    void sync();
+public slots:
+    bool sync();
 };
 
 SettingsFile::SettingsFile(QObject *parent)
@@ -87,17 +106,23 @@ SettingsFile::~SettingsFile()
 SettingsFilePrivate::SettingsFilePrivate(SettingsFile *qp)
     : QObject(qp)
     , q(qp)
+    , pendingChanges(0)
+    , syncDelay(SettingsFile::DefaultSyncDelay)
+    , maxSyncLatency(SettingsFile::DefaultMaxSyncLatency)
+    , journaled(false)
+    , journalSize(0)
     , rootObject(0)
 {
-    syncTimer.setInterval(0);
     syncTimer.setSingleShot(true);
     connect(&syncTimer, &QTimer::timeout, this, &SettingsFilePrivate::sync);
 }
 
 SettingsFilePrivate::~SettingsFilePrivate()
 {
-    if (syncTimer.isActive())
+    if (pendingChanges)
         sync();
+    if (journalSize)
+        compact();
     delete rootObject;
 }
 
@@ -105,6 +130,10 @@ void SettingsFilePrivate::reset()
 {
     filePath.clear();
     errorMessage.clear();
+    syncTimer.stop();
+    pendingChanges = 0;
+    journalBuffer.clear();
+    journalSize = 0;
 
     jsonRoot = QJsonObject();
     emit modified(QStringList(), jsonRoot);
@@ -120,6 +149,8 @@ bool SettingsFile::setFilePath(const QString &filePath)
     if (d->filePath == filePath)
         return hasError();
 
+    if (d->pendingChanges)
+        d->sync();
     d->reset();
     d->filePath = filePath;
 
@@ -180,13 +211,176 @@ const SettingsObject *SettingsFile::root() const
     return d->rootObject;
 }
 
-void SettingsFilePrivate::sync()
+int SettingsFile::syncDelay() const
 {
-    if (filePath.isEmpty())
+    return d->syncDelay;
+}
+
+int SettingsFile::maxSyncLatency() const
+{
+    return d->maxSyncLatency;
+}
+
+void SettingsFile::setSyncDelay(int syncDelay, int maxSyncLatency)
+{
+    d->syncDelay = qMax(syncDelay, 0);
+    d->maxSyncLatency = qMax(maxSyncLatency, d->syncDelay);
+    if (d->pendingChanges)
+        d->scheduleSync();
+}
+
+bool SettingsFile::isJournaled() const
+{
+    return d->journaled;
+}
+
+void SettingsFile::setJournaled(bool journaled)
+{
+    if (d->journaled == journaled)
         return;
 
+    if (d->pendingChanges)
+        d->sync();
+    if (!journaled && d->journalSize)
+        d->compact();
+    d->journaled = journaled;
+}
+
+bool SettingsFile::hasPendingChanges() const
+{
+    return d->pendingChanges > 0;
+}
+
+bool SettingsFile::flush()
+{
+    return d->sync();
+}
+
+SettingsFile::SyncStatistics SettingsFile::syncStatistics() const
+{
+    return d->statistics;
+}
+
+/* Restart the delay after a change, without passing the latency bound */
+void SettingsFilePrivate::scheduleSync()
+{
+    qint64 remaining = maxSyncLatency - pendingTimer.elapsed();
+    syncTimer.start(int(qBound(Q_INT64_C(0), remaining, qint64(syncDelay))));
+}
+
+bool SettingsFilePrivate::sync()
+{
+    if (filePath.isEmpty())
+        return false;
+
     syncTimer.stop();
-    writeFile();
+    if (!pendingChanges)
+        return true;
+
+    if (journaled) {
+        if (!writeJournal() && !compact())
+            return false;
+        if (journalSize > SettingsFile::JournalCompactionSize)
+            compact();
+    } else if (!writeFile()) {
+        return false;
+    }
+
+    statistics.syncCount++;
+    statistics.changeCount += pendingChanges;
+    pendingChanges = 0;
+    return true;
+}
+
+/* Journal records are single lines of compact JSON, each with the path of a
+ * write and its value. The value is omitted for an unset. Records are only
+ * appended, and a change is complete once its line ends; anything after the
+ * last complete record is from an interrupted append and is ignored.
+ *
+ * Records set absolute values, so replaying a journal that was already
+ * compacted into the file (if the file was written but the journal wasn't
+ * removed) gives the same data.
+ */
+void SettingsFilePrivate::appendJournal(const QStringList &path, const QJsonValue &value)
+{
+    QJsonObject record;
+    record.insert(QStringLiteral("path"), QJsonArray::fromStringList(path));
+    record.insert(QStringLiteral("value"), value);
+    journalBuffer.append(QJsonDocument(record).toJson(QJsonDocument::Compact));
+    journalBuffer.append('\n');
+}
+
+bool SettingsFilePrivate::writeJournal()
+{
+    QFile file(journalPath());
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "Cannot open settings journal:" << file.errorString();
+        return false;
+    }
+
+    if (file.write(journalBuffer) < journalBuffer.size() || !file.flush()) {
+        qWarning() << "Cannot write settings journal:" << file.errorString();
+        return false;
+    }
+
+    journalSize = file.size();
+    statistics.bytesWritten += journalBuffer.size();
+    statistics.lastSyncBytes = journalBuffer.size();
+    journalBuffer.clear();
+    return true;
+}
+
+/* Apply any journal to jsonRoot; returns the number of records, or -1 if
+ * there is no journal
+ */
+int SettingsFilePrivate::replayJournal()
+{
+    QFile file(journalPath());
+    if (!file.open(QIODevice::ReadOnly))
+        return -1;
+
+    QByteArray data = file.readAll();
+    int count = 0;
+    int start = 0;
+    for (int end; (end = data.indexOf('\n', start)) >= 0; start = end + 1) {
+        QJsonObject record = QJsonDocument::fromJson(data.mid(start, end - start)).object();
+        QJsonValue pathValue = record.value(QStringLiteral("path"));
+        QStringList path;
+        bool ok = pathValue.isArray();
+        foreach (const QJsonValue &key, pathValue.toArray()) {
+            if (!key.isString() || key.toString().isEmpty())
+                ok = false;
+            path.append(key.toString());
+        }
+
+        if (!ok) {
+            qWarning() << "Ignoring damaged settings journal after" << count << "records";
+            return count;
+        }
+
+        setValue(jsonRoot, path, record.value(QStringLiteral("value")), 0);
+        count++;
+    }
+
+    if (start < data.size())
+        qWarning() << "Ignoring incomplete record at the end of settings journal";
+    return count;
+}
+
+// Write all data to the file and remove the journal
+bool SettingsFilePrivate::compact()
+{
+    if (filePath.isEmpty() || !writeFile())
+        return false;
+
+    journalBuffer.clear();
+    journalSize = 0;
+    if (QFile::exists(journalPath()) && !QFile::remove(journalPath())) {
+        qWarning() << "Cannot remove settings journal after compacting";
+        return false;
+    }
+
+    return true;
 }
 
 bool SettingsFilePrivate::readFile()
@@ -202,25 +396,29 @@ bool SettingsFilePrivate::readFile()
         setError(file.errorString());
         return false;
     }
+    file.close();
 
     if (data.isEmpty()) {
         jsonRoot = QJsonObject();
-        return true;
-    }
+    } else {
+        QJsonParseError parseError;
+        QJsonDocument document = QJsonDocument::fromJson(data, &parseError);
+        if (document.isNull()) {
+            setError(parseError.errorString());
+            return false;
+        }
 
-    QJsonParseError parseError;
-    QJsonDocument document = QJsonDocument::fromJson(data, &parseError);
-    if (document.isNull()) {
-        setError(parseError.errorString());
-        return false;
-    }
+        if (!document.isObject()) {
+            setError(QStringLiteral("Invalid configuration file (expected object)"));
+            return false;
+        }
 
-    if (!document.isObject()) {
-        setError(QStringLiteral("Invalid configuration file (expected object)"));
-        return false;
+        jsonRoot = document.object();
     }
 
-    jsonRoot = document.object();
+    // Compact the journal now, so that it's only replayed once
+    if (replayJournal() >= 0)
+        compact();
 
     emit modified(QStringList(), jsonRoot);
     return true;
@@ -246,6 +444,8 @@ bool SettingsFilePrivate::writeFile()
         return false;
     }
 
+    statistics.bytesWritten += data.size();
+    statistics.lastSyncBytes = data.size();
     return true;
 }
 
@@ -318,12 +518,13 @@ static void findModifiedRecursive(ModifiedList &modified, const QStringList &pat
         modified.append(qMakePair(path, newValue));
 }
 
-bool SettingsFilePrivate::write(const QStringList &path, const QJsonValue &value)
+/* Set 'value' at 'path' within 'root', returning false if it's unchanged */
+bool SettingsFilePrivate::setValue(QJsonObject &root, const QStringList &path, const QJsonValue &value,
+                                   QJsonValue *originalValue)
 {
     typedef QVarLengthArray<QPair<QString,QJsonObject> > ObjectStack;
     ObjectStack stack;
-    QJsonValue current = jsonRoot;
-    QJsonValue originalValue;
+    QJsonValue current = root;
     QString currentKey;
 
     foreach (const QString &key, path) {
@@ -337,7 +538,8 @@ bool SettingsFilePrivate::write(const QStringList &path, const QJsonValue &value
     // is the old value. Write back changes in reverse.
     if (current == value)
         return false;
-    originalValue = current;
+    if (originalValue)
+        *originalValue = current;
     current = value;
 
     ObjectStack::const_iterator it = stack.end(), begin = stack.begin();
@@ -349,9 +551,22 @@ bool SettingsFilePrivate::write(const QStringList &path, const QJsonValue &value
         currentKey = it->first;
     }
 
-    // current is now the updated jsonRoot
-    jsonRoot = current.toObject();
-    syncTimer.start();
+    // current is now the updated root
+    root = current.toObject();
+    return true;
+}
+
+bool SettingsFilePrivate::write(const QStringList &path, const QJsonValue &value)
+{
+    QJsonValue originalValue;
+    if (!setValue(jsonRoot, path, value, &originalValue))
+        return false;
+
+    if (journaled)
+        appendJournal(path, value);
+    if (!pendingChanges++)
+        pendingTimer.start();
+    scheduleSync();
 
     ModifiedList modified;
     findModifiedRecursive(modified, path, originalValue, value);
@@ -550,4 +765,12 @@ void SettingsObject::undefine()
     d->file->d->write(d->path, QJsonValue::Undefined);
 }
 
+bool SettingsObject::flush()
+{
+    if (d->invalid)
+        return false;
+
+    return d->file->flush();
+}
+
 #include "Settings.moc"
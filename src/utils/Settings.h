@@ -51,6 +51,20 @@ class SettingsObjectPrivate;
  *
  * Data is accessed via SettingsObject, either using the root property
  * or by creating a SettingsObject, optionally using a base path.
+ *
+ * Changes are written to the file once they have stopped for syncDelay
+ * milliseconds, and no later than maxSyncLatency milliseconds after the
+ * first change that hasn't been written, so that a burst of changes is
+ * written only once. Use flush to write immediately, e.g. for data that
+ * must not be lost. Pending changes are also written when the SettingsFile
+ * is destroyed or its filePath changes.
+ *
+ * A journaled SettingsFile appends each change to a journal next to the
+ * file (with a ".journal" suffix) instead of rewriting the whole file. The
+ * journal is compacted into the file once it grows past
+ * JournalCompactionSize, when the file is read, and when the SettingsFile is
+ * destroyed. Any journal is replayed when the file is read, whether or not
+ * the SettingsFile is journaled.
  */
 class SettingsFile : public QObject
 {
@@ -75,6 +89,35 @@ public:
     SettingsObject *root();
     const SettingsObject *root() const;
 
+    static const int DefaultSyncDelay = 500;
+    static const int DefaultMaxSyncLatency = 5000;
+
+    int syncDelay() const;
+    int maxSyncLatency() const;
+    // A delay of 0 writes changes when control returns to the event loop
+    void setSyncDelay(int syncDelay, int maxSyncLatency);
+
+    static const int JournalCompactionSize = 64 * 1024;
+
+    bool isJournaled() const;
+    void setJournaled(bool journaled);
+
+    // True if there are changes that haven't been written to the file
+    bool hasPendingChanges() const;
+    // Write pending changes now; returns false if writing failed
+    Q_INVOKABLE bool flush();
+
+    struct SyncStatistics
+    {
+        int syncCount;          // Times the file has been written
+        int changeCount;        // Changes included in those writes
+        qint64 bytesWritten;    // Total size of those writes
+        qint64 lastSyncBytes;   // Size of the most recent write
+
+        SyncStatistics() : syncCount(0), changeCount(0), bytesWritten(0), lastSyncBytes(0) { }
+    };
+    SyncStatistics syncStatistics() const;
+
 signals:
     void filePathChanged();
     void error();
@@ -173,6 +216,9 @@ public:
 
     Q_INVOKABLE void undefine();
 
+    // Write pending changes to the file immediately, as SettingsFile::flush
+    Q_INVOKABLE bool flush();
+
 signals:
     void pathChanged();
     void dataChanged();
@@ -0,0 +1,211 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "Utf8.h"
+#include <cstring>
+
+#if defined(__SSE2__) || (defined(_MSC_VER) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)))
+#include <emmintrin.h>
+#define UTF8_USE_SSE2
+#endif
+
+namespace {
+
+/* Noncharacters are decoded and encoded by Qt's own codec, which has had
+ * different rules for them between versions.
+ */
+inline bool isNoncharacter(uint ucs4)
+{
+    return (ucs4 >= 0xfdd0 && ucs4 <= 0xfdef) || (ucs4 & 0xfffe) == 0xfffe;
+}
+
+inline bool isContinuation(uchar byte)
+{
+    return (byte & 0xc0) == 0x80;
+}
+
+/* Decode well-formed UTF-8 into UTF-16
+ *
+ * 'out' must have room for (end - p) characters. Returns the number of
+ * characters written, or -1 if the input contains anything other than
+ * well-formed UTF-8 of characters that aren't noncharacters.
+ */
+int decodeUtf8(const uchar *p, const uchar *end, ushort *out)
+{
+    ushort *start = out;
+
+    while (p < end) {
+#ifdef UTF8_USE_SSE2
+        // Widen 16 bytes at a time while they're all ASCII
+        const __m128i zero = _mm_setzero_si128();
+        while (end - p >= 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            if (_mm_movemask_epi8(chunk))
+                break;
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(chunk, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpackhi_epi8(chunk, zero));
+            p += 16;
+            out += 16;
+        }
+        if (p == end)
+            break;
+#endif
+
+        uchar b0 = *p;
+        if (b0 < 0x80) {
+            *out++ = b0;
+            p++;
+        } else if (b0 >= 0xc2 && b0 <= 0xdf) {
+            if (end - p < 2 || !isContinuation(p[1]))
+                return -1;
+            *out++ = ushort(((b0 & 0x1f) << 6) | (p[1] & 0x3f));
+            p += 2;
+        } else if (b0 >= 0xe0 && b0 <= 0xef) {
+            if (end - p < 3 || !isContinuation(p[1]) || !isContinuation(p[2]))
+                return -1;
+            // Reject overlong forms and surrogates
+            if ((b0 == 0xe0 && p[1] < 0xa0) || (b0 == 0xed && p[1] > 0x9f))
+                return -1;
+            uint ucs4 = ((b0 & 0x0f) << 12) | ((p[1] & 0x3f) << 6) | (p[2] & 0x3f);
+            if (isNoncharacter(ucs4))
+                return -1;
+            *out++ = ushort(ucs4);
+            p += 3;
+        } else if (b0 >= 0xf0 && b0 <= 0xf4) {
+            if (end - p < 4 || !isContinuation(p[1]) || !isContinuation(p[2]) || !isContinuation(p[3]))
+                return -1;
+            // Reject overlong forms and characters above U+10FFFF
+            if ((b0 == 0xf0 && p[1] < 0x90) || (b0 == 0xf4 && p[1] > 0x8f))
+                return -1;
+            uint ucs4 = ((b0 & 0x07) << 18) | ((p[1] & 0x3f) << 12) | ((p[2] & 0x3f) << 6) | (p[3] & 0x3f);
+            if (isNoncharacter(ucs4))
+                return -1;
+            *out++ = QChar::highSurrogate(ucs4);
+            *out++ = QChar::lowSurrogate(ucs4);
+            p += 4;
+        } else {
+            return -1;
+        }
+    }
+
+    return int(out - start);
+}
+
+/* Encode UTF-16 into UTF-8
+ *
+ * 'out' must have room for 3 bytes per character. Returns the number of
+ * bytes written, or -1 for unpaired surrogates and noncharacters.
+ */
+int encodeUtf8(const ushort *p, const ushort *end, uchar *out)
+{
+    uchar *start = out;
+
+    while (p < end) {
+#ifdef UTF8_USE_SSE2
+        // Narrow 8 characters at a time while they're all ASCII
+        const __m128i asciiMask = _mm_set1_epi16(short(0xff80));
+        const __m128i zero = _mm_setzero_si128();
+        while (end - p >= 8) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(chunk, asciiMask), zero)) != 0xffff)
+                break;
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_packus_epi16(chunk, chunk));
+            p += 8;
+            out += 8;
+        }
+        if (p == end)
+            break;
+#endif
+
+        ushort u = *p++;
+        if (u < 0x80) {
+            *out++ = uchar(u);
+        } else if (u < 0x800) {
+            *out++ = uchar(0xc0 | (u >> 6));
+            *out++ = uchar(0x80 | (u & 0x3f));
+        } else if (!QChar::isSurrogate(u)) {
+            if (isNoncharacter(u))
+                return -1;
+            *out++ = uchar(0xe0 | (u >> 12));
+            *out++ = uchar(0x80 | ((u >> 6) & 0x3f));
+            *out++ = uchar(0x80 | (u & 0x3f));
+        } else {
+            if (!QChar::isHighSurrogate(u) || p == end || !QChar::isLowSurrogate(*p))
+                return -1;
+            uint ucs4 = QChar::surrogateToUcs4(u, *p++);
+            if (isNoncharacter(ucs4))
+                return -1;
+            *out++ = uchar(0xf0 | (ucs4 >> 18));
+            *out++ = uchar(0x80 | ((ucs4 >> 12) & 0x3f));
+            *out++ = uchar(0x80 | ((ucs4 >> 6) & 0x3f));
+            *out++ = uchar(0x80 | (ucs4 & 0x3f));
+        }
+    }
+
+    return int(out - start);
+}
+
+}
+
+QString utf8ToString(const char *data, int size)
+{
+    const uchar *p = reinterpret_cast<const uchar*>(data);
+    if (size <= 0)
+        return QString::fromUtf8(data, size);
+
+    // QString::fromUtf8 skips a leading byte order mark
+    if (size >= 3 && p[0] == 0xef && p[1] == 0xbb && p[2] == 0xbf)
+        return QString::fromUtf8(data, size);
+
+    // UTF-8 never takes fewer bytes than UTF-16 takes characters
+    QString re(size, Qt::Uninitialized);
+    int length = decodeUtf8(p, p + size, reinterpret_cast<ushort*>(re.data()));
+    if (length < 0)
+        return QString::fromUtf8(data, size);
+
+    re.resize(length);
+    return re;
+}
+
+int stringToUtf8(const QString &string, char *out)
+{
+    const ushort *p = string.utf16();
+    int size = encodeUtf8(p, p + string.size(), reinterpret_cast<uchar*>(out));
+    if (size >= 0)
+        return size;
+
+    QByteArray utf8 = string.toUtf8();
+    if (utf8.size() > utf8MaxSize(string.size()))
+        return -1;
+    memcpy(out, utf8.constData(), utf8.size());
+    return utf8.size();
+}
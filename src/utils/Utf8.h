@@ -0,0 +1,63 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <QString>
+
+/* Decode UTF-8 text into a QString
+ *
+ * The result is always identical to QString::fromUtf8, including the
+ * replacement of invalid sequences. Well-formed text is decoded directly
+ * into the string's storage, using SSE2 for runs of ASCII where available.
+ * Anything else, such as invalid sequences or a byte order mark, is passed
+ * to QString::fromUtf8.
+ */
+QString utf8ToString(const char *data, int size);
+
+/* Largest number of bytes stringToUtf8 can write for a string of 'length' characters */
+inline int utf8MaxSize(int length)
+{
+    return length * 3;
+}
+
+/* Encode a QString as UTF-8 into 'out'
+ *
+ * 'out' must have room for utf8MaxSize(string.size()) bytes. Returns the
+ * number of bytes written, which are always identical to QString::toUtf8.
+ * As with utf8ToString, only strings with unpaired surrogates or other
+ * unusual characters use Qt's encoder.
+ */
+int stringToUtf8(const QString &string, char *out);
+
+#endif // UTF8_H
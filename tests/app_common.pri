@@ -60,7 +60,9 @@ SOURCES += \
     $${SRC}/core/IdentityManager.cpp \
     $${SRC}/core/ConversationModel.cpp \
     $${SRC}/utils/StringUtil.cpp \
+    $${SRC}/utils/Utf8.cpp \
     $${SRC}/utils/CryptoKey.cpp \
+    $${SRC}/utils/Base32.cpp \
     $${SRC}/utils/SecureRNG.cpp \
     $${SRC}/utils/Settings.cpp \
     $${SRC}/utils/PendingOperation.cpp \
@@ -79,11 +81,13 @@ HEADERS += $${SRC}/ui/MainWindow.h \
     $${SRC}/tor/SetConfCommand.h \
     $${SRC}/tor/AddOnionCommand.h \
     $${SRC}/utils/StringUtil.h \
+    $${SRC}/utils/Utf8.h \
     $${SRC}/core/ContactsManager.h \
     $${SRC}/core/ContactUser.h \
     $${SRC}/tor/GetConfCommand.h \
     $${SRC}/tor/HiddenService.h \
     $${SRC}/utils/CryptoKey.h \
+    $${SRC}/utils/Base32.h \
     $${SRC}/utils/SecureRNG.h \
     $${SRC}/core/OutgoingContactRequest.h \
     $${SRC}/core/IncomingRequestManager.h \
@@ -106,7 +110,12 @@ SOURCES += $${SRC}/protocol/Channel.cpp \
     $${SRC}/protocol/OutboundConnector.cpp \
     $${SRC}/protocol/AuthHiddenServiceChannel.cpp \
     $${SRC}/protocol/ChatChannel.cpp \
-    $${SRC}/protocol/ContactRequestChannel.cpp
+    $${SRC}/protocol/ContactRequestChannel.cpp \
+    $${SRC}/protocol/ChannelIdAllocator.cpp \
+    $${SRC}/protocol/ChatPacket.cpp \
+    $${SRC}/protocol/PacketHeader.cpp \
+    $${SRC}/protocol/PacketCompression.cpp \
+    $${SRC}/protocol/ResumptionTicket.cpp
 
 HEADERS += $${SRC}/protocol/Channel.h \
     $${SRC}/protocol/Channel_p.h \
@@ -116,7 +125,12 @@ HEADERS += $${SRC}/protocol/Channel.h \
     $${SRC}/protocol/OutboundConnector.h \
     $${SRC}/protocol/AuthHiddenServiceChannel.h \
     $${SRC}/protocol/ChatChannel.h \
-    $${SRC}/protocol/ContactRequestChannel.h
+    $${SRC}/protocol/ContactRequestChannel.h \
+    $${SRC}/protocol/ChannelIdAllocator.h \
+    $${SRC}/protocol/ChatPacket.h \
+    $${SRC}/protocol/PacketHeader.h \
+    $${SRC}/protocol/PacketCompression.h \
+    $${SRC}/protocol/ResumptionTicket.h
 
 PROTOS += $${SRC}/protocol/ControlChannel.proto \
     $${SRC}/protocol/AuthHiddenService.proto \
@@ -1,2 +1,13 @@
 TEMPLATE = subdirs
-SUBDIRS += tst_cryptokey
+SUBDIRS += tst_cryptokey \
+    tst_channelidallocator \
+    tst_chatpacket \
+    tst_utf8 \
+    tst_packetcompression \
+    tst_resumptionticket \
+    tst_base32 \
+    tst_securerng \
+    tst_settings \
+    tst_packetheader \
+    tst_connection \
+    tst_contactidvalidator
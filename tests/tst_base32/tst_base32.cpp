@@ -0,0 +1,331 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include "utils/Base32.h"
+
+class TestBase32 : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void vectors_data();
+    void vectors();
+    void invalid();
+    void encodeReference();
+    void decodeReference();
+    void roundTrip();
+
+    void benchmarkEncodeReference_data();
+    void benchmarkEncodeReference();
+    void benchmarkEncode_data();
+    void benchmarkEncode();
+    void benchmarkDecodeReference_data();
+    void benchmarkDecodeReference();
+    void benchmarkDecode_data();
+    void benchmarkDecode();
+};
+
+namespace Reference {
+/* The implementation that base32_encode and base32_decode replaced, from Tor
+ *
+ * Copyright (c) 2001-2004, Roger Dingledine
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson
+ * Copyright (c) 2007-2010, The Tor Project, Inc.
+ * Distributed under the same terms as Ricochet, above.
+ */
+
+#define BASE32_CHARS "abcdefghijklmnopqrstuvwxyz234567"
+
+void base32_encode(char *dest, unsigned destlen, const char *src, unsigned srclen)
+{
+    unsigned i, bit, v, u;
+    unsigned nbits = srclen * 8;
+
+    Q_ASSERT((nbits%5) == 0 && destlen >= (nbits/5)+1);
+    Q_UNUSED(destlen);
+
+    for (i = 0, bit = 0; bit < nbits; ++i, bit += 5)
+    {
+        /* set v to the 16-bit value starting at src[bits/8], 0-padded. */
+        v = ((quint8) src[bit / 8]) << 8;
+        if (bit + 5 < nbits)
+            v += (quint8) src[(bit/8)+1];
+
+        /* set u to the 5-bit value at the bit'th bit of src. */
+        u = (v >> (11 - (bit % 8))) & 0x1F;
+        dest[i] = BASE32_CHARS[u];
+    }
+
+    dest[i] = '\0';
+}
+
+bool base32_decode(char *dest, unsigned destlen, const char *src, unsigned srclen)
+{
+    unsigned int i, j, bit;
+    unsigned nbits = srclen * 5;
+
+    Q_ASSERT((nbits%8) == 0 && (nbits/8)+1 <= destlen);
+    Q_UNUSED(destlen);
+
+    char *tmp = new char[srclen];
+
+    /* Convert base32 encoded chars to the 5-bit values that they represent. */
+    for (j = 0; j < srclen; ++j)
+    {
+        if (src[j] > 0x60 && src[j] < 0x7B)
+            tmp[j] = src[j] - 0x61;
+        else if (src[j] > 0x31 && src[j] < 0x38)
+            tmp[j] = src[j] - 0x18;
+        else if (src[j] > 0x40 && src[j] < 0x5B)
+            tmp[j] = src[j] - 0x41;
+        else
+        {
+            delete[] tmp;
+            return false;
+        }
+    }
+
+    /* Assemble result byte-wise by applying five possible cases. */
+    for (i = 0, bit = 0; bit < nbits; ++i, bit += 8)
+    {
+        switch (bit % 40)
+        {
+        case 0:
+            dest[i] = (((quint8)tmp[(bit/5)]) << 3) + (((quint8)tmp[(bit/5)+1]) >> 2);
+            break;
+        case 8:
+            dest[i] = (((quint8)tmp[(bit/5)]) << 6) + (((quint8)tmp[(bit/5)+1]) << 1)
+                      + (((quint8)tmp[(bit/5)+2]) >> 4);
+            break;
+        case 16:
+            dest[i] = (((quint8)tmp[(bit/5)]) << 4) + (((quint8)tmp[(bit/5)+1]) >> 1);
+            break;
+        case 24:
+            dest[i] = (((quint8)tmp[(bit/5)]) << 7) + (((quint8)tmp[(bit/5)+1]) << 2)
+                      + (((quint8)tmp[(bit/5)+2]) >> 3);
+            break;
+        case 32:
+            dest[i] = (((quint8)tmp[(bit/5)]) << 5) + ((quint8)tmp[(bit/5)+1]);
+            break;
+        }
+    }
+
+    delete[] tmp;
+    return true;
+}
+
+#undef BASE32_CHARS
+}
+
+static QByteArray encoded(const QByteArray &data, bool reference = false)
+{
+    QByteArray re(data.size() / 5 * 8 + 1, 'x');
+    if (reference)
+        Reference::base32_encode(re.data(), re.size(), data.constData(), data.size());
+    else
+        base32_encode(re.data(), re.size(), data.constData(), data.size());
+    if (re.endsWith('\0'))
+        re.chop(1);
+    return re;
+}
+
+static QByteArray decoded(const QByteArray &text, bool reference = false)
+{
+    QByteArray re(text.size() / 8 * 5 + 1, 0);
+    bool ok;
+    if (reference)
+        ok = Reference::base32_decode(re.data(), re.size(), text.constData(), text.size());
+    else
+        ok = base32_decode(re.data(), re.size(), text.constData(), text.size());
+    if (!ok)
+        return QByteArray("<failed>");
+    re.chop(1);
+    return re;
+}
+
+static QByteArray randomBytes(int size)
+{
+    QByteArray re(size, 0);
+    for (int i = 0; i < size; i++)
+        re[i] = char(qrand());
+    return re;
+}
+
+void TestBase32::vectors_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<QByteArray>("text");
+
+    QTest::newRow("empty") << QByteArray() << QByteArray();
+    QTest::newRow("rfc4648") << QByteArray("fooba") << QByteArray("mzxw6ytb");
+    QTest::newRow("zeros") << QByteArray(10, 0) << QByteArray("aaaaaaaaaaaaaaaa");
+    QTest::newRow("ones") << QByteArray(5, char(0xff)) << QByteArray("77777777");
+    QTest::newRow("onion") << QByteArray::fromHex("b4780cabdfc359300443") << QByteArray("wr4azk67ynmtabcd");
+}
+
+void TestBase32::vectors()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(QByteArray, text);
+
+    QCOMPARE(encoded(data), text);
+    QCOMPARE(decoded(text), data);
+    QCOMPARE(decoded(text.toUpper()), data);
+}
+
+void TestBase32::invalid()
+{
+    QCOMPARE(decoded("mzxw6yt1"), QByteArray("<failed>"));
+    QCOMPARE(decoded("mzxw6yt8"), QByteArray("<failed>"));
+    QCOMPARE(decoded("mzxw6yt="), QByteArray("<failed>"));
+    QCOMPARE(decoded("mzxw6yt@"), QByteArray("<failed>"));
+    QCOMPARE(decoded("mzxw6yt{"), QByteArray("<failed>"));
+    QCOMPARE(decoded(QByteArray("mzxw6yt") + char(0x12)), QByteArray("<failed>"));
+    QCOMPARE(decoded(QByteArray("mzxw6yt") + char(0xe2)), QByteArray("<failed>"));
+    QCOMPARE(decoded(QByteArray("\0zxw6ytb", 8)), QByteArray("<failed>"));
+    // Only the first group is invalid
+    QCOMPARE(decoded("mzxw6y.bmzxw6ytb"), QByteArray("<failed>"));
+}
+
+/* Every byte value in every position, and random data of each length */
+void TestBase32::encodeReference()
+{
+    for (int size = 5; size <= 40; size += 5) {
+        for (int i = 0; i < size; i++) {
+            for (int c = 0; c < 256; c++) {
+                QByteArray data = randomBytes(size);
+                data[i] = char(c);
+                if (encoded(data) != encoded(data, true))
+                    QFAIL(qPrintable(QStringLiteral("Encoding differs for: %1").arg(QString::fromLatin1(data.toHex()))));
+            }
+        }
+    }
+}
+
+/* Every byte value in every position of text that is otherwise valid */
+void TestBase32::decodeReference()
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz234567ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+    for (int size = 8; size <= 56; size += 8) {
+        for (int i = 0; i < size; i++) {
+            for (int c = 0; c < 256; c++) {
+                QByteArray text(size, 0);
+                for (int j = 0; j < size; j++)
+                    text[j] = alphabet[qrand() % (sizeof(alphabet) - 1)];
+                text[i] = char(c);
+                if (decoded(text) != decoded(text, true))
+                    QFAIL(qPrintable(QStringLiteral("Decoding differs for: %1").arg(QString::fromLatin1(text.toHex()))));
+            }
+        }
+    }
+}
+
+void TestBase32::roundTrip()
+{
+    qsrand(1);
+    for (int i = 0; i < 10000; i++) {
+        QByteArray data = randomBytes((qrand() % 12) * 5);
+        QByteArray text = encoded(data);
+        QCOMPARE(text.size(), data.size() / 5 * 8);
+        QCOMPARE(decoded(text), data);
+    }
+}
+
+static void addSizes()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::newRow("v2 hostname") << randomBytes(10);
+    QTest::newRow("v3 hostname") << randomBytes(35);
+}
+
+void TestBase32::benchmarkEncodeReference_data()
+{
+    addSizes();
+}
+
+void TestBase32::benchmarkEncodeReference()
+{
+    QFETCH(QByteArray, data);
+    QByteArray out(data.size() / 5 * 8 + 1, 0);
+    QBENCHMARK {
+        Reference::base32_encode(out.data(), out.size(), data.constData(), data.size());
+    }
+}
+
+void TestBase32::benchmarkEncode_data()
+{
+    addSizes();
+}
+
+void TestBase32::benchmarkEncode()
+{
+    QFETCH(QByteArray, data);
+    QByteArray out(data.size() / 5 * 8 + 1, 0);
+    QBENCHMARK {
+        base32_encode(out.data(), out.size(), data.constData(), data.size());
+    }
+}
+
+void TestBase32::benchmarkDecodeReference_data()
+{
+    addSizes();
+}
+
+void TestBase32::benchmarkDecodeReference()
+{
+    QFETCH(QByteArray, data);
+    QByteArray text = encoded(data);
+    QByteArray out(data.size() + 1, 0);
+    QBENCHMARK {
+        Reference::base32_decode(out.data(), out.size(), text.constData(), text.size());
+    }
+}
+
+void TestBase32::benchmarkDecode_data()
+{
+    addSizes();
+}
+
+void TestBase32::benchmarkDecode()
+{
+    QFETCH(QByteArray, data);
+    QByteArray text = encoded(data);
+    QByteArray out(data.size() + 1, 0);
+    QBENCHMARK {
+        base32_decode(out.data(), out.size(), text.constData(), text.size());
+    }
+}
+
+QTEST_APPLESS_MAIN(TestBase32)
+#include "tst_base32.moc"
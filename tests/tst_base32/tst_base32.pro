@@ -0,0 +1,4 @@
+include(../tests.pri)
+
+SOURCES += tst_base32.cpp \
+    $${SRC}/utils/Base32.cpp
@@ -0,0 +1,188 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include <QSet>
+#include "protocol/ChannelIdAllocator.h"
+
+using Protocol::ChannelIdAllocator;
+
+class TestChannelIdAllocator : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void parity_data();
+    void parity();
+    void exhaustion();
+    void acquireRelease();
+    void reuseOrder();
+    void churn();
+};
+
+void TestChannelIdAllocator::parity_data()
+{
+    QTest::addColumn<int>("parity");
+    QTest::addColumn<int>("firstId");
+    QTest::addColumn<int>("lastId");
+    QTest::addColumn<int>("capacity");
+
+    QTest::newRow("odd") << int(ChannelIdAllocator::OddIdentifiers) << 1 << 65535 << 32768;
+    QTest::newRow("even") << int(ChannelIdAllocator::EvenIdentifiers) << 2 << 65534 << 32767;
+}
+
+void TestChannelIdAllocator::parity()
+{
+    QFETCH(int, parity);
+    QFETCH(int, firstId);
+    QFETCH(int, lastId);
+    QFETCH(int, capacity);
+
+    ChannelIdAllocator ids(static_cast<ChannelIdAllocator::Parity>(parity));
+    QCOMPARE(ids.capacity(), capacity);
+    QVERIFY(!ids.contains(0));
+    QVERIFY(!ids.contains(-1));
+    QVERIFY(!ids.contains(firstId + 1));
+    QVERIFY(!ids.contains(lastId + 2));
+    QVERIFY(ids.contains(firstId));
+    QVERIFY(ids.contains(lastId));
+
+    // Every identifier is handed out in order, exactly once
+    int expected = firstId;
+    for (int i = 0; i < capacity; i++) {
+        int id = ids.allocate();
+        if (id != expected)
+            QFAIL(qPrintable(QStringLiteral("Allocated %1, expected %2").arg(id).arg(expected)));
+        expected += 2;
+    }
+
+    QCOMPARE(ids.usedCount(), capacity);
+    QVERIFY(ids.isUsed(lastId));
+}
+
+void TestChannelIdAllocator::exhaustion()
+{
+    ChannelIdAllocator ids(ChannelIdAllocator::EvenIdentifiers);
+    while (ids.allocate() >= 0)
+        ;
+
+    QCOMPARE(ids.usedCount(), ids.capacity());
+    QCOMPARE(ids.next(), -1);
+    QCOMPARE(ids.allocate(), -1);
+    QCOMPARE(ids.usedCount(), ids.capacity());
+
+    // Releasing any identifier makes exactly that one available again
+    QVERIFY(ids.release(31338));
+    QCOMPARE(ids.next(), 31338);
+    QCOMPARE(ids.allocate(), 31338);
+    QCOMPARE(ids.allocate(), -1);
+
+    ids.reset(ChannelIdAllocator::EvenIdentifiers);
+    QCOMPARE(ids.usedCount(), 0);
+    QCOMPARE(ids.next(), 2);
+}
+
+void TestChannelIdAllocator::acquireRelease()
+{
+    ChannelIdAllocator ids(ChannelIdAllocator::OddIdentifiers);
+
+    QVERIFY(ids.acquire(1001));
+    QVERIFY(ids.isUsed(1001));
+    QVERIFY(!ids.acquire(1001));
+    QCOMPARE(ids.usedCount(), 1);
+
+    // Identifiers from the other half of the space are never accepted
+    QVERIFY(!ids.acquire(1002));
+    QVERIFY(!ids.acquire(0));
+    QVERIFY(!ids.acquire(65537));
+    QVERIFY(!ids.release(1002));
+
+    // Acquiring moves the search past that identifier
+    QCOMPARE(ids.next(), 1003);
+
+    QVERIFY(ids.release(1001));
+    QVERIFY(!ids.isUsed(1001));
+    QVERIFY(!ids.release(1001));
+    QCOMPARE(ids.usedCount(), 0);
+}
+
+void TestChannelIdAllocator::reuseOrder()
+{
+    ChannelIdAllocator ids(ChannelIdAllocator::OddIdentifiers);
+    QCOMPARE(ids.allocate(), 1);
+    QCOMPARE(ids.allocate(), 3);
+    QVERIFY(ids.release(1));
+
+    // A released identifier isn't reused until the search wraps around
+    QCOMPARE(ids.allocate(), 5);
+
+    QVERIFY(ids.acquire(65535));
+    QCOMPARE(ids.allocate(), 1);
+    QCOMPARE(ids.allocate(), 7);
+}
+
+void TestChannelIdAllocator::churn()
+{
+    ChannelIdAllocator ids(ChannelIdAllocator::OddIdentifiers);
+    QSet<int> open;
+    QVector<int> openList;
+    const int maxOpen = 20000;
+    quint32 seed = 12345;
+
+    for (int i = 0; i < 4000000; i++) {
+        seed = seed * 1103515245u + 12345u;
+        bool doOpen = openList.isEmpty() || (openList.size() < maxOpen && (seed >> 16) & 1);
+
+        if (doOpen) {
+            int id = ids.allocate();
+            if (id < 0 || !ids.contains(id) || open.contains(id))
+                QFAIL(qPrintable(QStringLiteral("Allocated invalid or duplicate id %1 at cycle %2").arg(id).arg(i)));
+            open.insert(id);
+            openList.append(id);
+        } else {
+            int index = int((seed >> 8) % quint32(openList.size()));
+            int id = openList[index];
+            openList[index] = openList.last();
+            openList.removeLast();
+            open.remove(id);
+            if (!ids.release(id))
+                QFAIL(qPrintable(QStringLiteral("Failed to release id %1 at cycle %2").arg(id).arg(i)));
+        }
+    }
+
+    QCOMPARE(ids.usedCount(), open.size());
+    foreach (int id, open)
+        QVERIFY(ids.isUsed(id));
+}
+
+QTEST_MAIN(TestChannelIdAllocator)
+#include "tst_channelidallocator.moc"
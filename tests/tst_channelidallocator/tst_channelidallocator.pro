@@ -0,0 +1,4 @@
+include(../tests.pri)
+
+SOURCES += tst_channelidallocator.cpp \
+    $${SRC}/protocol/ChannelIdAllocator.cpp
@@ -0,0 +1,452 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include "protocol/ChatPacket.h"
+#include "protocol/ChatChannel.pb.h"
+
+using Protocol::ChatPacket;
+namespace Chat = Protocol::Data::Chat;
+
+Q_DECLARE_METATYPE(std::string)
+
+class TestChatPacket : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void chatMessage();
+    void chatAcknowledge();
+    void coalescedAcknowledge();
+    void merge();
+    void batch();
+    void unknownFields();
+    void invalid_data();
+    void invalid();
+    void matchesProtobuf();
+    void writeChatMessage_data();
+    void writeChatMessage();
+    void benchmarkProtobuf();
+    void benchmarkChatPacket();
+};
+
+static std::string serialize(const Chat::Packet &packet)
+{
+    std::string re;
+    packet.SerializeToString(&re);
+    return re;
+}
+
+static std::string varint(quint64 value)
+{
+    std::string re;
+    do {
+        quint8 byte = value & 0x7f;
+        value >>= 7;
+        if (value)
+            byte |= 0x80;
+        re += char(byte);
+    } while (value);
+    return re;
+}
+
+static std::string tag(int field, int wireType)
+{
+    return varint((quint64(field) << 3) | wireType);
+}
+
+static std::string lengthDelimited(int field, const std::string &data)
+{
+    return tag(field, 2) + varint(data.size()) + data;
+}
+
+static bool sameMessage(const ChatPacket::Message &a, const Chat::ChatMessage &b)
+{
+    return a.text() == QByteArray(b.message_text().data(), int(b.message_text().size())) &&
+           a.hasMessageId() == b.has_message_id() && a.messageId() == b.message_id() &&
+           a.hasTimeDelta() == b.has_time_delta() && a.timeDelta() == b.time_delta();
+}
+
+/* Compare the decoder's result for 'data' with the protobuf parser's */
+static bool sameAsProtobuf(const std::string &data)
+{
+    Chat::Packet message;
+    bool expected = message.ParseFromArray(data.data(), int(data.size()));
+    ChatPacket packet;
+    if (packet.parse(data.data(), int(data.size())) != expected)
+        return false;
+    if (!expected)
+        return true;
+
+    if (packet.hasChatMessage() != message.has_chat_message() ||
+        packet.hasChatAcknowledge() != message.has_chat_acknowledge())
+        return false;
+
+    if (message.has_chat_message() && !sameMessage(packet.chatMessage(), message.chat_message()))
+        return false;
+
+    if (packet.chatMessageBatch().size() != message.chat_message_batch_size())
+        return false;
+    for (int i = 0; i < message.chat_message_batch_size(); i++) {
+        if (!sameMessage(packet.chatMessageBatch()[i], message.chat_message_batch(i)))
+            return false;
+    }
+
+    if (message.has_chat_acknowledge()) {
+        const Chat::ChatAcknowledge &m = message.chat_acknowledge();
+        if (packet.hasAcknowledgeId() != m.has_message_id() || packet.acknowledgeId() != m.message_id() ||
+            packet.accepted() != m.accepted() ||
+            packet.additionalAcknowledgeIds().size() != m.additional_message_id_size())
+            return false;
+        for (int i = 0; i < m.additional_message_id_size(); i++) {
+            if (packet.additionalAcknowledgeIds()[i] != m.additional_message_id(i))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void TestChatPacket::chatMessage()
+{
+    QString text = QStringLiteral("Hello é世界!");
+    Chat::Packet message;
+    message.mutable_chat_message()->set_message_text(text.toStdString());
+    message.mutable_chat_message()->set_message_id(4000000000u);
+    message.mutable_chat_message()->set_time_delta(-3600);
+    std::string data = serialize(message);
+
+    ChatPacket packet;
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QVERIFY(packet.hasChatMessage());
+    QVERIFY(!packet.hasChatAcknowledge());
+    QCOMPARE(QString::fromUtf8(packet.chatMessage().text()), text);
+    QVERIFY(packet.chatMessage().hasMessageId());
+    QCOMPARE(packet.chatMessage().messageId(), 4000000000u);
+    QVERIFY(packet.chatMessage().hasTimeDelta());
+    QCOMPARE(packet.chatMessage().timeDelta(), qint64(-3600));
+
+    // The text refers to the packet data
+    QVERIFY(packet.chatMessage().text().constData() >= data.data());
+    QVERIFY(packet.chatMessage().text().constData() < data.data() + data.size());
+
+    message.mutable_chat_message()->clear_message_id();
+    message.mutable_chat_message()->clear_time_delta();
+    data = serialize(message);
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QVERIFY(!packet.chatMessage().hasMessageId());
+    QVERIFY(!packet.chatMessage().hasTimeDelta());
+}
+
+void TestChatPacket::chatAcknowledge()
+{
+    Chat::Packet message;
+    message.mutable_chat_acknowledge()->set_message_id(1234);
+    std::string data = serialize(message);
+
+    ChatPacket packet;
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QVERIFY(!packet.hasChatMessage());
+    QVERIFY(packet.hasChatAcknowledge());
+    QVERIFY(packet.hasAcknowledgeId());
+    QCOMPARE(packet.acknowledgeId(), 1234u);
+    // accepted defaults to true
+    QVERIFY(packet.accepted());
+
+    message.mutable_chat_acknowledge()->set_accepted(false);
+    data = serialize(message);
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QVERIFY(!packet.accepted());
+
+    // An empty packet is valid, and has neither message
+    QVERIFY(packet.parse(QByteArray()));
+    QVERIFY(!packet.hasChatMessage());
+    QVERIFY(!packet.hasChatAcknowledge());
+}
+
+void TestChatPacket::coalescedAcknowledge()
+{
+    Chat::Packet message;
+    message.mutable_chat_acknowledge()->set_message_id(10);
+    message.mutable_chat_acknowledge()->add_additional_message_id(11);
+    message.mutable_chat_acknowledge()->add_additional_message_id(4000000000u);
+    std::string data = serialize(message);
+
+    ChatPacket packet;
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QCOMPARE(packet.acknowledgeId(), 10u);
+    QCOMPARE(packet.additionalAcknowledgeIds(), QVector<quint32>() << 11 << 4000000000u);
+    QVERIFY(sameAsProtobuf(data));
+
+    // Unpacked values are also accepted, and all occurrences are kept in order
+    data = lengthDelimited(2, tag(3, 0) + varint(1) + lengthDelimited(3, varint(2) + varint(3)) + tag(3, 0) + varint(4));
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QCOMPARE(packet.additionalAcknowledgeIds(), QVector<quint32>() << 1 << 2 << 3 << 4);
+    QVERIFY(sameAsProtobuf(data));
+
+    // A value that runs past the end of the packed field is invalid
+    data = lengthDelimited(2, lengthDelimited(3, varint(2) + "\x80"));
+    QVERIFY(!packet.parse(data.data(), int(data.size())));
+    QVERIFY(sameAsProtobuf(data));
+}
+
+void TestChatPacket::merge()
+{
+    // Repeated submessages are merged, and the last value of each field is used
+    std::string data = lengthDelimited(1, lengthDelimited(1, "first") + tag(2, 0) + varint(7)) +
+                       lengthDelimited(1, lengthDelimited(1, "second") + tag(3, 0) + varint(quint64(-5)));
+
+    ChatPacket packet;
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QCOMPARE(packet.chatMessage().text(), QByteArray("second"));
+    QCOMPARE(packet.chatMessage().messageId(), 7u);
+    QCOMPARE(packet.chatMessage().timeDelta(), qint64(-5));
+    QVERIFY(sameAsProtobuf(data));
+}
+
+void TestChatPacket::batch()
+{
+    Chat::Packet message;
+    for (int i = 0; i < 3; i++) {
+        Chat::ChatMessage *m = message.add_chat_message_batch();
+        m->set_message_text("message " + std::to_string(i));
+        m->set_message_id(100 + i);
+        if (i == 1)
+            m->set_time_delta(-10);
+    }
+    std::string data = serialize(message);
+
+    ChatPacket packet;
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QVERIFY(!packet.hasChatMessage());
+    QCOMPARE(packet.chatMessageBatch().size(), 3);
+    QCOMPARE(packet.chatMessageBatch()[2].text(), QByteArray("message 2"));
+    QCOMPARE(packet.chatMessageBatch()[2].messageId(), 102u);
+    QVERIFY(packet.chatMessageBatch()[1].hasTimeDelta());
+    QVERIFY(!packet.chatMessageBatch()[0].hasTimeDelta());
+    QVERIFY(sameAsProtobuf(data));
+
+    // Unlike chat_message, entries of the batch aren't merged
+    data = lengthDelimited(3, lengthDelimited(1, "a")) + lengthDelimited(1, lengthDelimited(1, "b")) +
+           lengthDelimited(3, tag(2, 0) + varint(5) + lengthDelimited(1, "c"));
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QVERIFY(packet.hasChatMessage());
+    QCOMPARE(packet.chatMessageBatch().size(), 2);
+    QVERIFY(!packet.chatMessageBatch()[0].hasMessageId());
+    QCOMPARE(packet.chatMessageBatch()[1].messageId(), 5u);
+    QVERIFY(sameAsProtobuf(data));
+
+    // Each entry requires message_text
+    data = lengthDelimited(3, lengthDelimited(1, "a")) + lengthDelimited(3, tag(2, 0) + varint(5));
+    QVERIFY(!packet.parse(data.data(), int(data.size())));
+    QVERIFY(sameAsProtobuf(data));
+
+    // Entries written one after another by writeBatchedChatMessage form a packet
+    QByteArray buffer;
+    for (int i = 0; i < 3; i++) {
+        int offset = buffer.size();
+        QString text = QStringLiteral("message %1").arg(i);
+        buffer.resize(offset + ChatPacket::maxChatMessageSize(text.size()));
+        int size = ChatPacket::writeBatchedChatMessage(buffer.data() + offset, text, 100 + i, i == 1, -10);
+        QVERIFY(size > 0);
+        buffer.resize(offset + size);
+    }
+    std::string expected = serialize(message);
+    QCOMPARE(buffer, QByteArray(expected.data(), int(expected.size())));
+}
+
+void TestChatPacket::unknownFields()
+{
+    std::string unknown = tag(9, 0) + varint(300) +
+                          tag(10, 1) + std::string(8, 'x') +
+                          tag(11, 5) + std::string(4, 'y') +
+                          lengthDelimited(12, "zzz") +
+                          tag(13, 3) + tag(14, 0) + varint(1) + tag(13, 4) +
+                          // Known field number with an unexpected wire type
+                          tag(2, 5) + std::string(4, 'w');
+    std::string data = unknown + lengthDelimited(1, unknown + lengthDelimited(1, "text") + unknown) + unknown;
+
+    ChatPacket packet;
+    QVERIFY(packet.parse(data.data(), int(data.size())));
+    QCOMPARE(packet.chatMessage().text(), QByteArray("text"));
+    QVERIFY(!packet.chatMessage().hasMessageId());
+    QVERIFY(sameAsProtobuf(data));
+}
+
+void TestChatPacket::invalid_data()
+{
+    QTest::addColumn<std::string>("data");
+
+    std::string text = lengthDelimited(1, "text");
+    QTest::newRow("missing required text") << lengthDelimited(1, tag(2, 0) + varint(1));
+    QTest::newRow("truncated length") << tag(1, 2) + varint(20) + text;
+    QTest::newRow("truncated varint") << lengthDelimited(1, text + tag(2, 0) + "\x80");
+    QTest::newRow("overlong varint") << lengthDelimited(1, text + tag(2, 0) + std::string(10, '\xff') + '\x01');
+    QTest::newRow("zero tag") << std::string(1, '\0') + text;
+    QTest::newRow("field zero") << tag(0, 0) + varint(1);
+    QTest::newRow("end group") << tag(5, 4);
+    QTest::newRow("end group in message") << lengthDelimited(1, lengthDelimited(1, "text") + tag(5, 4));
+    QTest::newRow("unterminated group") << tag(5, 3) + tag(6, 0) + varint(1);
+    QTest::newRow("mismatched group") << tag(5, 3) + tag(6, 4);
+    QTest::newRow("wire type 6") << tag(5, 6);
+    QTest::newRow("wire type 7") << tag(5, 7);
+    QTest::newRow("truncated fixed64") << tag(5, 1) + "1234567";
+
+    std::string nested;
+    for (int i = 0; i < 101; i++)
+        nested = tag(5, 3) + nested + tag(5, 4);
+    QTest::newRow("group recursion limit") << nested;
+}
+
+void TestChatPacket::invalid()
+{
+    QFETCH(std::string, data);
+
+    ChatPacket packet;
+    QVERIFY(!packet.parse(data.data(), int(data.size())));
+    QVERIFY(sameAsProtobuf(data));
+}
+
+void TestChatPacket::matchesProtobuf()
+{
+    // Mutations of valid packets, compared against the protobuf parser
+    Chat::Packet message;
+    message.mutable_chat_message()->set_message_text("Lorem ipsum dolor sit amet");
+    message.mutable_chat_message()->set_message_id(123456789);
+    message.mutable_chat_message()->set_time_delta(-60);
+    message.mutable_chat_acknowledge()->set_message_id(987654321);
+    message.mutable_chat_acknowledge()->set_accepted(false);
+    message.mutable_chat_acknowledge()->add_additional_message_id(300);
+    message.mutable_chat_acknowledge()->add_additional_message_id(7);
+    message.add_chat_message_batch()->set_message_text("consectetur");
+    message.add_chat_message_batch()->set_message_text("adipiscing");
+    message.mutable_chat_message_batch(1)->set_message_id(42);
+    const std::string seed = serialize(message) + tag(7, 3) + tag(8, 1) + "abcdefgh" + tag(7, 4);
+
+    quint32 random = 1;
+    auto next = [&random]() {
+        random = random * 1103515245u + 12345u;
+        return random >> 8;
+    };
+
+    for (int i = 0; i < 200000; i++) {
+        std::string data = seed;
+        int mutations = 1 + next() % 4;
+        for (int j = 0; j < mutations; j++) {
+            size_t pos = next() % data.size();
+            switch (next() % 4) {
+            case 0: data[pos] = char(next()); break;
+            case 1: data.erase(pos, 1 + next() % 4); break;
+            case 2: data.insert(pos, 1, char(next())); break;
+            case 3: data.resize(pos); break;
+            }
+            if (data.empty())
+                break;
+        }
+
+        if (!sameAsProtobuf(data)) {
+            QFAIL(qPrintable(QStringLiteral("Decoder and protobuf disagree on: %1")
+                             .arg(QString::fromLatin1(QByteArray(data.data(), int(data.size())).toHex()))));
+        }
+    }
+}
+
+static std::string benchmarkPacket()
+{
+    Chat::Packet message;
+    message.mutable_chat_message()->set_message_text(
+        "This is a fairly typical chat message, long enough that it isn't stored inline in a std::string.");
+    message.mutable_chat_message()->set_message_id(123456789);
+    return serialize(message);
+}
+
+void TestChatPacket::writeChatMessage_data()
+{
+    QTest::addColumn<QString>("text");
+    QTest::addColumn<quint32>("id");
+    QTest::addColumn<bool>("hasTimeDelta");
+    QTest::addColumn<qint64>("timeDelta");
+
+    QTest::newRow("ascii") << QStringLiteral("hello") << 1u << false << qint64(0);
+    QTest::newRow("multilingual") << QString::fromUtf8("Grüße, мир, 世界 \xF0\x9F\x98\x80") << 4000000000u << true << qint64(-3600);
+    QTest::newRow("zero delta") << QStringLiteral("x") << 0u << true << qint64(0);
+    QTest::newRow("long") << QString(2000, QChar(0x4e16)) << 300u << true << qint64(-1);
+    QTest::newRow("lone surrogate") << QString(QChar(0xd800)) + QStringLiteral("abc") << 7u << false << qint64(0);
+}
+
+void TestChatPacket::writeChatMessage()
+{
+    QFETCH(QString, text);
+    QFETCH(quint32, id);
+    QFETCH(bool, hasTimeDelta);
+    QFETCH(qint64, timeDelta);
+
+    Chat::Packet message;
+    message.mutable_chat_message()->set_message_text(text.toStdString());
+    message.mutable_chat_message()->set_message_id(id);
+    if (hasTimeDelta)
+        message.mutable_chat_message()->set_time_delta(timeDelta);
+
+    QByteArray buffer(ChatPacket::maxChatMessageSize(text.size()), 0);
+    int size = ChatPacket::writeChatMessage(buffer.data(), text, id, hasTimeDelta, timeDelta);
+    QVERIFY(size > 0 && size <= buffer.size());
+    std::string expected = serialize(message);
+    QCOMPARE(QByteArray(buffer.constData(), size), QByteArray(expected.data(), int(expected.size())));
+}
+
+void TestChatPacket::benchmarkProtobuf()
+{
+    std::string data = benchmarkPacket();
+    QString text;
+    QBENCHMARK {
+        Chat::Packet message;
+        message.ParseFromArray(data.data(), int(data.size()));
+        text = QString::fromStdString(message.chat_message().message_text());
+    }
+    QVERIFY(!text.isEmpty());
+}
+
+void TestChatPacket::benchmarkChatPacket()
+{
+    std::string data = benchmarkPacket();
+    QString text;
+    QBENCHMARK {
+        ChatPacket packet;
+        packet.parse(data.data(), int(data.size()));
+        QByteArray utf8 = packet.chatMessage().text();
+        text = QString::fromUtf8(utf8.constData(), utf8.size());
+    }
+    QVERIFY(!text.isEmpty());
+}
+
+QTEST_MAIN(TestChatPacket)
+#include "tst_chatpacket.moc"
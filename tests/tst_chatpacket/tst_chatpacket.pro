@@ -0,0 +1,8 @@
+include(../tests.pri)
+include($${SRC}/../protobuf.pri)
+
+PROTOS += $${SRC}/protocol/ChatChannel.proto
+
+SOURCES += tst_chatpacket.cpp \
+    $${SRC}/protocol/ChatPacket.cpp \
+    $${SRC}/utils/Utf8.cpp
@@ -0,0 +1,327 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QQueue>
+#include "protocol/Connection.h"
+#include "protocol/Connection_p.h"
+#include "protocol/AuthHiddenServiceChannel.h"
+#include "utils/CryptoKey.h"
+#include "utils/SecureRNG.h"
+
+using namespace Protocol;
+
+/* Forwards data between two sockets after a fixed delay in each direction
+ *
+ * This stands in for the latency of a Tor circuit. A disconnect from either
+ * side is passed on once the data before it has been forwarded.
+ */
+class DelayedRelay : public QObject
+{
+    Q_OBJECT
+
+public:
+    DelayedRelay(QTcpSocket *a, QTcpSocket *b, int delay)
+        : QObject(a), delay(delay)
+    {
+        clock.start();
+        pipe(a, b, &toB);
+        pipe(b, a, &toA);
+    }
+
+private:
+    struct Chunk
+    {
+        qint64 due;
+        QByteArray data;
+        bool disconnect;
+    };
+
+    struct Pipe
+    {
+        QTcpSocket *to;
+        QQueue<Chunk> queue;
+        QTimer timer;
+    };
+
+    int delay;
+    QElapsedTimer clock;
+    Pipe toA, toB;
+
+    void pipe(QTcpSocket *from, QTcpSocket *to, Pipe *p)
+    {
+        p->to = to;
+        p->timer.setSingleShot(true);
+        p->timer.setTimerType(Qt::PreciseTimer);
+        connect(&p->timer, &QTimer::timeout, this, [=]() { forward(p); });
+        connect(from, &QTcpSocket::readyRead, this, [=]() { enqueue(p, from->readAll(), false); });
+        connect(from, &QTcpSocket::disconnected, this, [=]() { enqueue(p, QByteArray(), true); });
+    }
+
+    void enqueue(Pipe *p, const QByteArray &data, bool disconnect)
+    {
+        Chunk chunk = { clock.elapsed() + delay, data, disconnect };
+        p->queue.enqueue(chunk);
+        if (!p->timer.isActive())
+            p->timer.start(delay);
+    }
+
+    void forward(Pipe *p)
+    {
+        while (!p->queue.isEmpty() && p->queue.head().due <= clock.elapsed()) {
+            Chunk chunk = p->queue.dequeue();
+            if (chunk.disconnect)
+                p->to->disconnectFromHost();
+            else
+                p->to->write(chunk.data);
+        }
+
+        if (!p->queue.isEmpty())
+            p->timer.start(int(qMax<qint64>(0, p->queue.head().due - clock.elapsed())));
+    }
+};
+
+// Lets the test name the peer, as a TorSocket does with the onion it connected to
+class OnionSocket : public QTcpSocket
+{
+public:
+    void setOnionHostname(const QString &hostname) { setPeerName(hostname); }
+};
+
+class TestConnection : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void benchmarkTimeToReady_data();
+    void benchmarkTimeToReady();
+    void optimisticVersionRefused();
+
+private:
+    QTcpServer server;
+    QTcpServer relay;
+    QList<Connection*> serverConnections;
+};
+
+static const char serverHostname[] = "iou53ffunpweuzy5.onion";
+
+void TestConnection::initTestCase()
+{
+    QVERIFY(SecureRNG::seed());
+    QVERIFY(server.listen(QHostAddress::LocalHost));
+    QVERIFY(relay.listen(QHostAddress::LocalHost));
+
+    connect(&server, &QTcpServer::newConnection, this,
+        [this]() {
+            QTcpSocket *socket = server.nextPendingConnection();
+            socket->setProperty("localHostname", QString::fromLatin1(serverHostname));
+            serverConnections.append(new Connection(socket, Connection::ServerSide));
+        }
+    );
+}
+
+void TestConnection::benchmarkTimeToReady_data()
+{
+    QTest::addColumn<bool>("optimistic");
+    QTest::addColumn<bool>("oneRoundTrip");
+    QTest::addColumn<int>("latency");
+
+    // One way latency in msec; a round trip through Tor is typically several hundred
+    QTest::newRow("negotiated") << false << false << 50;
+    QTest::newRow("negotiated, one round trip auth") << false << true << 50;
+    QTest::newRow("optimistic, one round trip auth") << true << true << 50;
+}
+
+/* Time from the socket connecting until the connection is authenticated,
+ * which is when OutboundConnector becomes Ready. Each round trip costs twice
+ * the latency: negotiated connections take three, or two with one round trip
+ * authentication, and optimistic connections take one.
+ */
+void TestConnection::benchmarkTimeToReady()
+{
+    QFETCH(bool, optimistic);
+    QFETCH(bool, oneRoundTrip);
+    QFETCH(int, latency);
+
+    // A new client key for each row, so no resumption ticket applies
+    CryptoKey clientKey;
+    if (!clientKey.generateEd25519())
+        QSKIP("Ed25519 keys aren't supported by this OpenSSL");
+
+    connect(&relay, &QTcpServer::newConnection, this,
+        [this,latency]() {
+            QTcpSocket *inbound = relay.nextPendingConnection();
+            QTcpSocket *outbound = new QTcpSocket(inbound);
+            new DelayedRelay(inbound, outbound, latency);
+            outbound->connectToHost(QHostAddress::LocalHost, server.serverPort());
+        }
+    );
+
+    OnionSocket *socket = new OnionSocket;
+    socket->connectToHost(QHostAddress::LocalHost, relay.serverPort());
+    QVERIFY(socket->waitForConnected(5000));
+    socket->setOnionHostname(QString::fromLatin1(serverHostname));
+
+    Connection *connection = 0;
+    QSignalSpy *authSpy = 0;
+    auto startAuthentication = [&]() {
+        AuthHiddenServiceChannel *channel = new AuthHiddenServiceChannel(Channel::Outbound, connection);
+        authSpy = new QSignalSpy(channel, SIGNAL(authSuccessful()));
+        channel->setPrivateKey(clientKey);
+        channel->setOneRoundTrip(oneRoundTrip);
+        QSignalSpy preparedSpy(channel, SIGNAL(oneRoundTripPrepared()));
+        channel->prepareOneRoundTrip();
+        QVERIFY(preparedSpy.count() > 0 || preparedSpy.wait(5000));
+        QVERIFY(channel->openChannel());
+    };
+
+    QElapsedTimer timer;
+    QBENCHMARK_ONCE {
+        timer.start();
+        if (optimistic) {
+            connection = Connection::optimisticClient(socket, ConnectionPrivate::ProtocolVersion);
+            startAuthentication();
+        } else {
+            connection = new Connection(socket, Connection::ClientSide);
+            QSignalSpy readySpy(connection, SIGNAL(ready()));
+            QVERIFY(readySpy.wait(5000));
+            startAuthentication();
+        }
+        QVERIFY(authSpy->count() > 0 || authSpy->wait(5000));
+    }
+
+    int roundTrips = optimistic ? 1 : (oneRoundTrip ? 2 : 3);
+    qDebug() << "Ready after" << timer.elapsed() << "msec;" << roundTrips << "round trips of" << latency * 2 << "msec";
+    QVERIFY(timer.elapsed() >= roundTrips * latency * 2);
+
+    delete authSpy;
+    relay.disconnect(this);
+
+    // Close both sides gracefully, so neither is destroyed with an open socket
+    QSignalSpy clientClosed(connection, SIGNAL(closed()));
+    connection->close();
+    QVERIFY(clientClosed.count() > 0 || clientClosed.wait(5000));
+    delete connection;
+
+    foreach (Connection *c, serverConnections) {
+        QSignalSpy serverClosed(c, SIGNAL(closed()));
+        QVERIFY(!c->isConnected() || serverClosed.wait(5000));
+        delete c;
+    }
+    serverConnections.clear();
+}
+
+/* A peer that doesn't accept the version assumed by an optimistic client
+ * answers with ProtocolVersionFailed. The client must drop the connection
+ * without writing anything more, so that it can be retried with negotiation,
+ * as OutboundConnector does.
+ */
+void TestConnection::optimisticVersionRefused()
+{
+    CryptoKey clientKey;
+    if (!clientKey.generateEd25519())
+        QSKIP("Ed25519 keys aren't supported by this OpenSSL");
+
+    // Stands in for a peer that no longer speaks the version the client assumed
+    QByteArray received;
+    qint64 sent = 0;
+    QTcpSocket *peerSocket = 0;
+    QTcpServer peer;
+    QVERIFY(peer.listen(QHostAddress::LocalHost));
+    connect(&peer, &QTcpServer::newConnection, this,
+        [&]() {
+            QTcpSocket *s = peer.nextPendingConnection();
+            peerSocket = s;
+            connect(s, &QTcpSocket::readyRead, this, [s,&received]() { received += s->readAll(); });
+        }
+    );
+
+    OnionSocket *socket = new OnionSocket;
+    connect(socket, &QTcpSocket::bytesWritten, this, [&sent](qint64 bytes) { sent += bytes; });
+    socket->connectToHost(QHostAddress::LocalHost, peer.serverPort());
+    QVERIFY(socket->waitForConnected(5000));
+    socket->setOnionHostname(QString::fromLatin1(serverHostname));
+
+    Connection *connection = Connection::optimisticClient(socket, ConnectionPrivate::ProtocolVersion);
+    QSignalSpy failedSpy(connection, SIGNAL(versionNegotiationFailed()));
+    QSignalSpy readySpy(connection, SIGNAL(ready()));
+    AuthHiddenServiceChannel *channel = new AuthHiddenServiceChannel(Channel::Outbound, connection);
+    channel->setPrivateKey(clientKey);
+    QVERIFY(channel->openChannel());
+
+    // The introduction and the OpenChannel request are written before any answer
+    QTRY_VERIFY(peerSocket && sent > 4 && socket->bytesToWrite() == 0 && received.size() == sent);
+    QCOMPARE(received.left(4), QByteArray("\x49\x4D\x01", 3) + char(ConnectionPrivate::ProtocolVersion));
+
+    qint64 sentBeforeAnswer = sent;
+    peerSocket->write(QByteArray(1, char(ConnectionPrivate::ProtocolVersionFailed)));
+    QVERIFY(failedSpy.wait(5000));
+    QCOMPARE(readySpy.count(), 0);
+
+    // The client drops the connection without writing anything more
+    QTRY_COMPARE(peerSocket->state(), QAbstractSocket::UnconnectedState);
+    received += peerSocket->readAll();
+    QCOMPARE(sent, sentBeforeAnswer);
+    QCOMPARE(qint64(received.size()), sentBeforeAnswer);
+    QVERIFY(!connection->isConnected());
+    delete connection;
+
+    // A retry without an assumed version offers every supported version
+    received.clear();
+    peerSocket = 0;
+    socket = new OnionSocket;
+    socket->connectToHost(QHostAddress::LocalHost, peer.serverPort());
+    QVERIFY(socket->waitForConnected(5000));
+    socket->setOnionHostname(QString::fromLatin1(serverHostname));
+
+    connection = new Connection(socket, Connection::ClientSide);
+    QSignalSpy retryReadySpy(connection, SIGNAL(ready()));
+    const char fullIntro[] = { 0x49, 0x4D, 0x03, char(ConnectionPrivate::ProtocolVersion),
+                               char(ConnectionPrivate::ProtocolVersionMin), 0 };
+    QTRY_VERIFY(peerSocket && received.size() >= int(sizeof(fullIntro)));
+    QCOMPARE(received, QByteArray(fullIntro, sizeof(fullIntro)));
+
+    peerSocket->write(QByteArray(1, char(ConnectionPrivate::ProtocolVersion)));
+    QVERIFY(retryReadySpy.wait(5000));
+    QCOMPARE(connection->protocolVersion(), int(ConnectionPrivate::ProtocolVersion));
+
+    QSignalSpy clientClosed(connection, SIGNAL(closed()));
+    connection->close();
+    QVERIFY(clientClosed.count() > 0 || clientClosed.wait(5000));
+    delete connection;
+}
+
+QTEST_MAIN(TestConnection)
+#include "tst_connection.moc"
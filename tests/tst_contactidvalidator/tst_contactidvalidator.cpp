@@ -8,6 +8,7 @@ class TestContactIDValidator : public QObject
 
 private slots:
     void test_validate();
+    void test_v3();
 };
 
 ContactIDValidator validator((QObject*)NULL);
@@ -23,5 +24,26 @@ void TestContactIDValidator::test_validate()
     QCOMPARE(validator.validate(text, pos), QValidator::Acceptable);
 }
 
+void TestContactIDValidator::test_v3()
+{
+    QString id = "ricochet:25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sid";
+    int pos = 0;
+    QCOMPARE(validator.validate(id, pos), QValidator::Acceptable);
+    QCOMPARE(ContactIDValidator::hostnameFromID(id), QString("25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sid.onion"));
+    QCOMPARE(ContactIDValidator::idFromHostname(QStringLiteral("25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sid.onion")), id);
+    QCOMPARE(ContactIDValidator::idFromHostname(QStringLiteral("25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sid")), id);
+    QCOMPARE(ContactIDValidator::idFromHostname(QStringLiteral("iou53ffunpweuzy5.onion")), QString("ricochet:iou53ffunpweuzy5"));
+
+    // Wrong checksum, and wrong version byte
+    id = "ricochet:25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5aid";
+    pos = 0;
+    QCOMPARE(validator.validate(id, pos), QValidator::Invalid);
+    QVERIFY(ContactIDValidator::hostnameFromID(id).isEmpty());
+    QVERIFY(ContactIDValidator::idFromHostname(QStringLiteral("25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sia")).isEmpty());
+
+    // Neither version's length
+    QVERIFY(ContactIDValidator::idFromHostname(QStringLiteral("25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhken.onion")).isEmpty());
+}
+
 QTEST_APPLESS_MAIN(TestContactIDValidator)
 #include "tst_contactidvalidator.moc"
@@ -1,5 +1,6 @@
 include(../tests.pri)
 include(../app_common.pri)
 include($${SRC}/../protobuf.pri)
+include($${SRC}/../zlib.pri)
 
 SOURCES += tst_contactidvalidator.cpp
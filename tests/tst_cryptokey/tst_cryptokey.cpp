@@ -43,7 +43,15 @@ private slots:
     void encodedPublicKey();
     void encodedPrivateKey();
     void torServiceID();
+    void publicKeyCache();
     void sign();
+    void signAsync();
+    void ed25519();
+    void ed25519Sign();
+    void benchmarkSign_data();
+    void benchmarkSign();
+    void benchmarkVerify_data();
+    void benchmarkVerify();
 };
 
 const char *alice =
@@ -75,6 +83,17 @@ const char *bob =
 const char *bobDigest = "b4780cabdfc3593004431644977cf73bf8475848";
 const char *bobTorID = "wr4azk67ynmtabcd";
 
+// From RFC 8032 section 7.1, TEST 1 and TEST 2
+const char *carolSeed = "9d61b19deffd5a60ba844af492ec2cc44449c5697b326919703bac031cae7f60";
+const char *carolPublicKey = "d75a980182b10ab7d54bfed3c964073a0ee172f3daa62325af021a68f707511a";
+const char *carolExpanded = "307c83864f2833cb427a2ef1c00a013cfdff2768d980c0a3a520f006904de94f"
+                            "9b4f0afe280b746a778684e75442502057b7473a03f08f96f5a38e9287e01f8f";
+const char *carolTorID = "25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sid";
+const char *carolSignedEmpty = "e5564300c360ac729086e2cc806e828a84877f1eb8e5d974d873e065224901555fb8821590a33bacc61e39701cf9b46bd25bf5f0595bbe24655141438e7a100b";
+const char *daveSeed = "4ccd089b28ff96da9db6c346ec114e0f5b8a319f35aba624da8cf6ed4fb8a6fb";
+const char *davePublicKey = "3d4017c3e843895a92b70aa74d1b7ebc9c982ccf2ec4968cc0cd55f12af4660c";
+const char *daveSigned72 = "92a009a9f0d4cab8720e820b5f642540a2b27b5416503f8fb3762223ebdb69da085ac1e43e15996e458f3613d0f11d8c387b2eaeb4302aeeb00d291612bb0c00";
+
 void TestCryptoKey::load()
 {
     CryptoKey key;
@@ -183,6 +202,31 @@ void TestCryptoKey::torServiceID()
     QCOMPARE(id, QLatin1String(bobTorID));
 }
 
+void TestCryptoKey::publicKeyCache()
+{
+    CryptoKey key;
+    QVERIFY(key.loadFromData(bob, CryptoKey::PublicKey));
+    QByteArray derEncoded = key.encodedPublicKey(CryptoKey::DER);
+
+    // Loading the same data again gives the same key and derived values
+    for (int i = 0; i < 2; i++) {
+        CryptoKey key2;
+        QVERIFY(key2.loadFromData(derEncoded, CryptoKey::PublicKey, CryptoKey::DER));
+        QVERIFY(!key2.isPrivate());
+        QCOMPARE(key2.bits(), 1024);
+        QCOMPARE(key2.publicKeyDigest().toHex(), QByteArray(bobDigest));
+        QCOMPARE(key2.torServiceID(), QLatin1String(bobTorID));
+        QCOMPARE(key2.torServiceID(), QLatin1String(bobTorID));
+    }
+
+    // Different data isn't mistaken for a cached key
+    QByteArray modified = derEncoded;
+    modified[20] = char(modified[20] ^ 0x01);
+    CryptoKey key3;
+    QVERIFY(key3.loadFromData(modified, CryptoKey::PublicKey, CryptoKey::DER));
+    QVERIFY(key3.torServiceID() != QLatin1String(bobTorID));
+}
+
 void TestCryptoKey::sign()
 {
     CryptoKey key;
@@ -224,5 +268,154 @@ void TestCryptoKey::sign()
     QVERIFY(key.verifySHA256(dataDigest, signaturep));
 }
 
+void TestCryptoKey::signAsync()
+{
+    CryptoKey key;
+    QVERIFY(key.loadFromData(alice, CryptoKey::PrivateKey));
+    QByteArray digest(32, 'd');
+
+    QByteArray signature;
+    bool done = false;
+    key.signSHA256Async(digest, this,
+        [&](const QByteArray &result) {
+            signature = result;
+            done = true;
+        }
+    );
+    QTRY_VERIFY(done);
+    QVERIFY(key.verifySHA256(digest, signature));
+
+    int results = 0;
+    bool valid = false, invalid = true;
+    key.verifySHA256Async(digest, signature, this, [&](bool v) { valid = v; results++; });
+    key.verifySHA256Async(QByteArray(32, 'x'), signature, this, [&](bool v) { invalid = v; results++; });
+    QTRY_COMPARE(results, 2);
+    QVERIFY(valid);
+    QVERIFY(!invalid);
+
+    // The callback isn't called once its context is gone
+    QObject *context = new QObject;
+    bool called = false;
+    key.signSHA256Async(digest, context, [&](const QByteArray &) { called = true; });
+    delete context;
+    QTest::qWait(200);
+    QVERIFY(!called);
+}
+
+void TestCryptoKey::ed25519()
+{
+    CryptoKey key;
+    QVERIFY(key.loadFromData(QByteArray::fromHex(carolSeed), CryptoKey::PrivateKey, CryptoKey::Raw));
+    QVERIFY(key.isLoaded());
+    QVERIFY(key.isPrivate());
+    QCOMPARE(key.algorithm(), CryptoKey::Ed25519);
+    QCOMPARE(key.encodedPublicKey(CryptoKey::Raw).toHex(), QByteArray(carolPublicKey));
+    QCOMPARE(key.encodedPrivateKey(CryptoKey::Raw).toHex(), QByteArray(carolSeed));
+    QCOMPARE(key.expandedPrivateKey().toHex(), QByteArray(carolExpanded));
+    QCOMPARE(key.torServiceID(), QLatin1String(carolTorID));
+
+    // Ed25519 keys have no DER or PEM encoding, and RSA keys have no raw encoding
+    QVERIFY(key.encodedPublicKey(CryptoKey::DER).isEmpty());
+    QVERIFY(key.encodedPrivateKey(CryptoKey::PEM).isEmpty());
+    CryptoKey rsaKey;
+    QVERIFY(rsaKey.loadFromData(alice, CryptoKey::PrivateKey));
+    QCOMPARE(rsaKey.algorithm(), CryptoKey::RSA1024);
+    QVERIFY(rsaKey.encodedPublicKey(CryptoKey::Raw).isEmpty());
+    QVERIFY(rsaKey.expandedPrivateKey().isEmpty());
+
+    CryptoKey publicKey;
+    QVERIFY(publicKey.loadFromData(QByteArray::fromHex(carolPublicKey), CryptoKey::PublicKey, CryptoKey::Raw));
+    QVERIFY(!publicKey.isPrivate());
+    QVERIFY(publicKey.encodedPrivateKey(CryptoKey::Raw).isEmpty());
+    QCOMPARE(publicKey.torServiceID(), QLatin1String(carolTorID));
+    QCOMPARE(publicKey.publicKeyDigest(), key.publicKeyDigest());
+
+    // Wrong size
+    CryptoKey key2;
+    QVERIFY(!key2.loadFromData(QByteArray::fromHex(carolSeed).mid(1), CryptoKey::PrivateKey, CryptoKey::Raw));
+    QVERIFY(!key2.isLoaded());
+
+    // Generated keys
+    CryptoKey key3;
+    QVERIFY(key3.generateEd25519());
+    QVERIFY(key3.isPrivate());
+    QCOMPARE(key3.torServiceID().size(), 56);
+    QVERIFY(key3.torServiceID() != key.torServiceID());
+}
+
+void TestCryptoKey::ed25519Sign()
+{
+    CryptoKey key;
+    QVERIFY(key.loadFromData(QByteArray::fromHex(carolSeed), CryptoKey::PrivateKey, CryptoKey::Raw));
+    CryptoKey publicKey;
+    QVERIFY(publicKey.loadFromData(QByteArray::fromHex(carolPublicKey), CryptoKey::PublicKey, CryptoKey::Raw));
+
+    // Compare to the RFC's signatures
+    QCOMPARE(key.signSHA256(QByteArray()).toHex(), QByteArray(carolSignedEmpty));
+    QVERIFY(publicKey.verifySHA256(QByteArray(), QByteArray::fromHex(carolSignedEmpty)));
+
+    CryptoKey dave;
+    QVERIFY(dave.loadFromData(QByteArray::fromHex(daveSeed), CryptoKey::PrivateKey, CryptoKey::Raw));
+    QCOMPARE(dave.encodedPublicKey(CryptoKey::Raw).toHex(), QByteArray(davePublicKey));
+    QCOMPARE(dave.signSHA256(QByteArray::fromHex("72")).toHex(), QByteArray(daveSigned72));
+
+    QByteArray digest(32, 'd');
+    QByteArray signature = key.signSHA256(digest);
+    QCOMPARE(signature.size(), 64);
+    QVERIFY(publicKey.verifySHA256(digest, signature));
+
+    // Bad signature
+    QVERIFY(!publicKey.verifySHA256(QByteArray(32, 'x'), signature));
+    QVERIFY(!publicKey.verifySHA256(digest, signature.mid(0, 63)));
+
+    // Wrong public key
+    QVERIFY(!dave.verifySHA256(digest, signature));
+}
+
+void TestCryptoKey::benchmarkSign_data()
+{
+    QTest::addColumn<bool>("ed25519");
+    QTest::newRow("rsa1024") << false;
+    QTest::newRow("ed25519") << true;
+}
+
+void TestCryptoKey::benchmarkSign()
+{
+    QFETCH(bool, ed25519);
+
+    CryptoKey key;
+    if (ed25519)
+        QVERIFY(key.loadFromData(QByteArray::fromHex(carolSeed), CryptoKey::PrivateKey, CryptoKey::Raw));
+    else
+        QVERIFY(key.loadFromData(alice, CryptoKey::PrivateKey));
+
+    QByteArray digest(32, 'd');
+    QBENCHMARK {
+        key.signSHA256(digest);
+    }
+}
+
+void TestCryptoKey::benchmarkVerify_data()
+{
+    benchmarkSign_data();
+}
+
+void TestCryptoKey::benchmarkVerify()
+{
+    QFETCH(bool, ed25519);
+
+    CryptoKey key;
+    if (ed25519)
+        QVERIFY(key.loadFromData(QByteArray::fromHex(carolSeed), CryptoKey::PrivateKey, CryptoKey::Raw));
+    else
+        QVERIFY(key.loadFromData(alice, CryptoKey::PrivateKey));
+
+    QByteArray digest(32, 'd');
+    QByteArray signature = key.signSHA256(digest);
+    QBENCHMARK {
+        key.verifySHA256(digest, signature);
+    }
+}
+
 QTEST_MAIN(TestCryptoKey)
 #include "tst_cryptokey.moc"
@@ -2,6 +2,7 @@ include(../tests.pri)
 
 SOURCES += tst_cryptokey.cpp \
     $${SRC}/utils/CryptoKey.cpp \
+    $${SRC}/utils/Base32.cpp \
     $${SRC}/utils/SecureRNG.cpp
 
 unix {
@@ -0,0 +1,158 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include "protocol/PacketCompression.h"
+
+using Protocol::PacketCompression;
+
+class TestPacketCompression : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void roundTrip_data();
+    void roundTrip();
+    void stream();
+    void dictionary();
+    void invalidData();
+    void sizeLimit();
+
+private:
+    static QByteArray compress(PacketCompression &compression, const QByteArray &data);
+    static QByteArray decompress(PacketCompression &compression, const QByteArray &data, int maxSize = 65530);
+};
+
+QByteArray TestPacketCompression::compress(PacketCompression &compression, const QByteArray &data)
+{
+    QByteArray out(PacketCompression::maxCompressedSize(data.size()), 0);
+    int size = compression.compress(data.constData(), data.size(), out.data());
+    if (size < 0)
+        return QByteArray();
+    out.resize(size);
+    return out;
+}
+
+QByteArray TestPacketCompression::decompress(PacketCompression &compression, const QByteArray &data, int maxSize)
+{
+    QByteArray out(maxSize, 0);
+    int size = compression.decompress(data.constData(), data.size(), out.data(), maxSize);
+    if (size < 0)
+        return QByteArray();
+    out.resize(size);
+    return out;
+}
+
+static QByteArray randomData(int size, quint32 seed)
+{
+    QByteArray data(size, 0);
+    for (int i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = char(seed >> 24);
+    }
+    return data;
+}
+
+void TestPacketCompression::roundTrip_data()
+{
+    QTest::addColumn<QByteArray>("data");
+
+    QTest::newRow("byte") << QByteArray("a");
+    QTest::newRow("text") << QByteArray("Hey, are you there? I'll send the link again once I'm back.");
+    QTest::newRow("repeated") << QByteArray(30000, 'x');
+    QTest::newRow("random") << randomData(4000, 1);
+    // Incompressible data at the largest packet size must fit maxCompressedSize
+    QTest::newRow("random max") << randomData(65530, 2);
+}
+
+void TestPacketCompression::roundTrip()
+{
+    QFETCH(QByteArray, data);
+
+    PacketCompression sender, receiver;
+    QByteArray compressed = compress(sender, data);
+    QVERIFY(!compressed.isEmpty());
+    QVERIFY(compressed.size() <= PacketCompression::maxCompressedSize(data.size()));
+    QCOMPARE(decompress(receiver, compressed), data);
+}
+
+void TestPacketCompression::stream()
+{
+    // Each packet refers back to the ones before it
+    PacketCompression sender, receiver;
+    QByteArray data = randomData(1000, 3);
+    QByteArray first = compress(sender, data);
+    QByteArray second = compress(sender, data);
+    QVERIFY(first.size() > data.size());
+    QVERIFY(second.size() < 32);
+
+    QCOMPARE(decompress(receiver, first), data);
+    QCOMPARE(decompress(receiver, second), data);
+
+    // A receiver that missed the first packet can't follow
+    PacketCompression other;
+    QVERIFY(decompress(other, second) != data);
+}
+
+void TestPacketCompression::dictionary()
+{
+    PacketCompression sender, receiver;
+    QByteArray data("Hey, how's it going? Sorry, I was away from my computer. Talk to you soon.");
+    QByteArray compressed = compress(sender, data);
+    QVERIFY(compressed.size() < data.size() / 2);
+    QCOMPARE(decompress(receiver, compressed), data);
+}
+
+void TestPacketCompression::invalidData()
+{
+    PacketCompression sender, receiver;
+    QByteArray data("A packet that should have been fine");
+    QByteArray compressed = compress(sender, data);
+
+    QVERIFY(decompress(receiver, QByteArray("\xff\xff\xff\xff\xff", 5)).isNull());
+    // The stream is unusable after an error
+    QVERIFY(decompress(receiver, compressed).isNull());
+}
+
+void TestPacketCompression::sizeLimit()
+{
+    PacketCompression sender, receiver;
+    QByteArray data(1000, 'a');
+    QByteArray compressed = compress(sender, data);
+    QVERIFY(decompress(receiver, compressed, data.size() - 1).isNull());
+
+    PacketCompression exact;
+    QCOMPARE(decompress(exact, compressed, data.size()), data);
+}
+
+QTEST_MAIN(TestPacketCompression)
+#include "tst_packetcompression.moc"
@@ -0,0 +1,5 @@
+include(../tests.pri)
+include($${SRC}/../zlib.pri)
+
+SOURCES += tst_packetcompression.cpp \
+    $${SRC}/protocol/PacketCompression.cpp
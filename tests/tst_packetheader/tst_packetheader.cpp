@@ -0,0 +1,239 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include "protocol/PacketHeader.h"
+
+using Protocol::PacketHeader;
+
+class TestPacketHeader : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void varint_data();
+    void varint();
+    void paddedVarint();
+    void version1();
+    void version2_data();
+    void version2();
+    void incomplete();
+    void invalid_data();
+    void invalid();
+    void sizeLimit();
+    void selectVersion_data();
+    void selectVersion();
+};
+
+void TestPacketHeader::varint_data()
+{
+    QTest::addColumn<uint>("value");
+    QTest::addColumn<QByteArray>("encoded");
+
+    QTest::newRow("zero") << 0u << QByteArray::fromHex("00");
+    QTest::newRow("one byte") << 127u << QByteArray::fromHex("7f");
+    QTest::newRow("two bytes") << 128u << QByteArray::fromHex("8001");
+    QTest::newRow("300") << 300u << QByteArray::fromHex("ac02");
+    QTest::newRow("three bytes") << 16384u << QByteArray::fromHex("808001");
+    QTest::newRow("largest") << 2097151u << QByteArray::fromHex("ffff7f");
+}
+
+void TestPacketHeader::varint()
+{
+    QFETCH(uint, value);
+    QFETCH(QByteArray, encoded);
+
+    int size = PacketHeader::varintSize(value);
+    QCOMPARE(size, encoded.size());
+
+    uchar buf[PacketHeader::VarintMaxSize];
+    QCOMPARE(PacketHeader::writeVarint(buf, value, size), buf + size);
+    QCOMPARE(QByteArray(reinterpret_cast<char*>(buf), size), encoded);
+
+    quint32 decoded = 0;
+    QCOMPARE(PacketHeader::readVarint(buf, size, &decoded), size);
+    QCOMPARE(uint(decoded), value);
+}
+
+void TestPacketHeader::paddedVarint()
+{
+    // Values padded with continuation bytes up to the largest size decode the same
+    const quint32 values[] = { 0, 1, 127, 128, 16383, 16384, 1048576 };
+    for (quint32 value : values) {
+        for (int size = PacketHeader::varintSize(value); size <= PacketHeader::VarintMaxSize; size++) {
+            uchar buf[PacketHeader::VarintMaxSize + 1] = { 0xaa, 0xaa, 0xaa, 0xaa };
+            QCOMPARE(PacketHeader::writeVarint(buf, value, size), buf + size);
+            QCOMPARE(buf[size], uchar(0xaa));
+
+            quint32 decoded = 0;
+            QCOMPARE(PacketHeader::readVarint(buf, sizeof(buf), &decoded), size);
+            QCOMPARE(decoded, value);
+        }
+    }
+
+    // Four bytes is too long, even as padding
+    const uchar tooLong[] = { 0x80, 0x80, 0x80, 0x00 };
+    quint32 decoded = 0;
+    QCOMPARE(PacketHeader::readVarint(tooLong, sizeof(tooLong), &decoded), -1);
+}
+
+void TestPacketHeader::version1()
+{
+    const uchar header[] = { 0x00, 0x0a, 0x01, 0x02 };
+    int headerSize = 0, dataSize = 0, channelId = 0;
+    QCOMPARE(PacketHeader::parse(1, header, sizeof(header), PacketHeader::Version1MaxDataSize,
+                                 &headerSize, &dataSize, &channelId), 1);
+    QCOMPARE(headerSize, 4);
+    QCOMPARE(dataSize, 6);
+    QCOMPARE(channelId, 258);
+
+    // The size includes the header, so it can't be smaller than the header
+    const uchar tooSmall[] = { 0x00, 0x03, 0x00, 0x01 };
+    QCOMPARE(PacketHeader::parse(1, tooSmall, sizeof(tooSmall), PacketHeader::Version1MaxDataSize,
+                                 &headerSize, &dataSize, &channelId), -1);
+}
+
+void TestPacketHeader::version2_data()
+{
+    QTest::addColumn<QByteArray>("header");
+    QTest::addColumn<int>("headerSize");
+    QTest::addColumn<int>("dataSize");
+    QTest::addColumn<int>("channelId");
+
+    QTest::newRow("close control") << QByteArray::fromHex("0000") << 2 << 0 << 0;
+    QTest::newRow("small") << QByteArray::fromHex("0a06") << 2 << 10 << 3;
+    QTest::newRow("padded") << QByteArray::fromHex("8a8000868000") << 6 << 10 << 3;
+    QTest::newRow("empty flags") << QByteArray::fromHex("0a0700") << 3 << 10 << 3;
+    QTest::newRow("largest") << QByteArray::fromHex("808040feff07") << 6 << 1048576 << 65535;
+}
+
+void TestPacketHeader::version2()
+{
+    QFETCH(QByteArray, header);
+    QFETCH(int, headerSize);
+    QFETCH(int, dataSize);
+    QFETCH(int, channelId);
+
+    // Data following the header doesn't change the result
+    QByteArray packet = header + QByteArray(4, 0x01);
+    int parsedHeaderSize = 0, parsedDataSize = 0, parsedChannelId = 0;
+    QCOMPARE(PacketHeader::parse(2, reinterpret_cast<const uchar*>(packet.constData()), packet.size(),
+                                 PacketHeader::Version2MaxDataSize,
+                                 &parsedHeaderSize, &parsedDataSize, &parsedChannelId), 1);
+    QCOMPARE(parsedHeaderSize, headerSize);
+    QCOMPARE(parsedDataSize, dataSize);
+    QCOMPARE(parsedChannelId, channelId);
+}
+
+void TestPacketHeader::incomplete()
+{
+    // Every prefix of a complete header needs more data
+    const QByteArray headers[] = { QByteArray::fromHex("000a0102"), QByteArray::fromHex("8a8000868000"),
+                                   QByteArray::fromHex("0a0700") };
+    for (int version = 1; version <= 2; version++) {
+        for (const QByteArray &header : headers) {
+            if ((version == 1) != (header.size() == 4))
+                continue;
+            for (int available = 0; available < header.size(); available++) {
+                int headerSize = 0, dataSize = 0, channelId = 0;
+                QCOMPARE(PacketHeader::parse(version, reinterpret_cast<const uchar*>(header.constData()), available,
+                                             PacketHeader::Version2MaxDataSize,
+                                             &headerSize, &dataSize, &channelId), 0);
+            }
+        }
+    }
+}
+
+void TestPacketHeader::invalid_data()
+{
+    QTest::addColumn<QByteArray>("header");
+
+    QTest::newRow("size too long") << QByteArray::fromHex("80808000");
+    QTest::newRow("channel too long") << QByteArray::fromHex("0080808000");
+    QTest::newRow("unknown flag") << QByteArray::fromHex("0a0701");
+    QTest::newRow("oversize") << QByteArray::fromHex("81804000");
+    QTest::newRow("channel too large") << QByteArray::fromHex("00808008");
+}
+
+void TestPacketHeader::invalid()
+{
+    QFETCH(QByteArray, header);
+
+    int headerSize = 0, dataSize = 0, channelId = 0;
+    QCOMPARE(PacketHeader::parse(2, reinterpret_cast<const uchar*>(header.constData()), header.size(),
+                                 PacketHeader::Version2MaxDataSize,
+                                 &headerSize, &dataSize, &channelId), -1);
+}
+
+void TestPacketHeader::sizeLimit()
+{
+    // The caller's limit applies in place of the largest size for the version
+    int headerSize = 0, dataSize = 0, channelId = 0;
+    const uchar atLimit[] = { 0xfb, 0xff, 0x03, 0x02 };
+    QCOMPARE(PacketHeader::parse(2, atLimit, sizeof(atLimit), PacketHeader::Version1MaxDataSize,
+                                 &headerSize, &dataSize, &channelId), 1);
+    QCOMPARE(dataSize, int(PacketHeader::Version1MaxDataSize));
+
+    const uchar overLimit[] = { 0xfc, 0xff, 0x03, 0x02 };
+    QCOMPARE(PacketHeader::parse(2, overLimit, sizeof(overLimit), PacketHeader::Version1MaxDataSize,
+                                 &headerSize, &dataSize, &channelId), -1);
+    QCOMPARE(PacketHeader::parse(2, overLimit, sizeof(overLimit), PacketHeader::Version2MaxDataSize,
+                                 &headerSize, &dataSize, &channelId), 1);
+
+    const uchar version1[] = { 0xff, 0xff, 0x00, 0x01 };
+    QCOMPARE(PacketHeader::parse(1, version1, sizeof(version1), 1024,
+                                 &headerSize, &dataSize, &channelId), -1);
+}
+
+void TestPacketHeader::selectVersion_data()
+{
+    QTest::addColumn<QByteArray>("versions");
+    QTest::addColumn<int>("selected");
+
+    QTest::newRow("newest") << QByteArray::fromHex("020100") << 2;
+    QTest::newRow("any order") << QByteArray::fromHex("000102") << 2;
+    QTest::newRow("only old") << QByteArray::fromHex("01") << 1;
+    QTest::newRow("too new") << QByteArray::fromHex("0301") << 1;
+    QTest::newRow("none") << QByteArray::fromHex("0003ff") << int(PacketHeader::VersionFailed);
+    QTest::newRow("empty") << QByteArray() << int(PacketHeader::VersionFailed);
+}
+
+void TestPacketHeader::selectVersion()
+{
+    QFETCH(QByteArray, versions);
+    QFETCH(int, selected);
+
+    QCOMPARE(int(PacketHeader::selectVersion(versions, 1, 2)), selected);
+}
+
+QTEST_APPLESS_MAIN(TestPacketHeader)
+#include "tst_packetheader.moc"
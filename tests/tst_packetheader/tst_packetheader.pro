@@ -0,0 +1,4 @@
+include(../tests.pri)
+
+SOURCES += tst_packetheader.cpp \
+    $${SRC}/protocol/PacketHeader.cpp
@@ -0,0 +1,150 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include "protocol/ResumptionTicket.h"
+
+using Protocol::ResumptionTicketKeys;
+
+class TestResumptionTicket : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void roundTrip();
+    void v3Hostname();
+    void expiry();
+    void rotation();
+    void modified();
+    void otherKeys();
+
+private:
+    static const quint64 Start = 1500000000;
+    static QString hostname() { return QStringLiteral("ricochetimtest77"); }
+    static QByteArray secret() { return QByteArray(ResumptionTicketKeys::SecretSize, 's'); }
+};
+
+void TestResumptionTicket::roundTrip()
+{
+    ResumptionTicketKeys keys;
+    QByteArray ticket = keys.issue(hostname(), secret(), Start);
+    QCOMPARE(ticket.size(), int(ResumptionTicketKeys::TicketSize));
+
+    QString openedHostname;
+    QByteArray openedSecret;
+    quint64 expiry = 0;
+    QVERIFY(keys.open(ticket, Start + 10, &openedHostname, &openedSecret, &expiry));
+    QCOMPARE(openedHostname, hostname());
+    QCOMPARE(openedSecret, secret());
+    QCOMPARE(expiry, Start + ResumptionTicketKeys::Lifetime);
+
+    // Tickets for the same client are different each time
+    QVERIFY(keys.issue(hostname(), secret(), Start) != ticket);
+}
+
+void TestResumptionTicket::v3Hostname()
+{
+    ResumptionTicketKeys keys;
+    QString v3Hostname = QStringLiteral("25njqamcweflpvkl73j4szahhihoc4xt3ktcgjnpaingr5yhkenl5sid");
+    QByteArray ticket = keys.issue(v3Hostname, secret(), Start);
+    QCOMPARE(ticket.size(), int(ResumptionTicketKeys::TicketSize));
+
+    QString openedHostname;
+    QByteArray openedSecret;
+    QVERIFY(keys.open(ticket, Start + 10, &openedHostname, &openedSecret));
+    QCOMPARE(openedHostname, v3Hostname);
+    QCOMPARE(openedSecret, secret());
+}
+
+void TestResumptionTicket::expiry()
+{
+    ResumptionTicketKeys keys;
+    QByteArray ticket = keys.issue(hostname(), secret(), Start);
+
+    QString openedHostname;
+    QByteArray openedSecret;
+    QVERIFY(keys.open(ticket, Start + ResumptionTicketKeys::Lifetime - 1, &openedHostname, &openedSecret));
+    QVERIFY(!keys.open(ticket, Start + ResumptionTicketKeys::Lifetime, &openedHostname, &openedSecret));
+}
+
+void TestResumptionTicket::rotation()
+{
+    ResumptionTicketKeys keys;
+    QString openedHostname;
+    QByteArray openedSecret;
+
+    // Issued just before the key is replaced, and still valid until it expires
+    QByteArray first = keys.issue(hostname(), secret(), Start);
+    QByteArray late = keys.issue(hostname(), secret(), Start + ResumptionTicketKeys::Lifetime - 1);
+    QByteArray second = keys.issue(hostname(), secret(), Start + ResumptionTicketKeys::Lifetime);
+    QVERIFY(first.left(4) != second.left(4));
+    QVERIFY(keys.open(late, Start + 2 * ResumptionTicketKeys::Lifetime - 2, &openedHostname, &openedSecret));
+    QVERIFY(keys.open(second, Start + 2 * ResumptionTicketKeys::Lifetime - 2, &openedHostname, &openedSecret));
+
+    // Once the key is gone, so are its tickets
+    keys.issue(hostname(), secret(), Start + 2 * ResumptionTicketKeys::Lifetime);
+    QVERIFY(!keys.open(late, Start + 2 * ResumptionTicketKeys::Lifetime, &openedHostname, &openedSecret));
+    QVERIFY(keys.open(second, Start + 2 * ResumptionTicketKeys::Lifetime - 1, &openedHostname, &openedSecret));
+}
+
+void TestResumptionTicket::modified()
+{
+    ResumptionTicketKeys keys;
+    QByteArray ticket = keys.issue(hostname(), secret(), Start);
+
+    QString openedHostname;
+    QByteArray openedSecret;
+    for (int i = 0; i < ticket.size(); i++) {
+        QByteArray copy = ticket;
+        copy[i] = char(copy[i] ^ 0x01);
+        QVERIFY(!keys.open(copy, Start, &openedHostname, &openedSecret));
+    }
+
+    QVERIFY(!keys.open(ticket.left(ticket.size() - 1), Start, &openedHostname, &openedSecret));
+    QVERIFY(!keys.open(ticket + 'x', Start, &openedHostname, &openedSecret));
+    QVERIFY(keys.open(ticket, Start, &openedHostname, &openedSecret));
+}
+
+void TestResumptionTicket::otherKeys()
+{
+    // Tickets from one identity can't be used with another
+    ResumptionTicketKeys keys, other;
+    QByteArray ticket = keys.issue(hostname(), secret(), Start);
+    other.issue(hostname(), secret(), Start);
+
+    QString openedHostname;
+    QByteArray openedSecret;
+    QVERIFY(!other.open(ticket, Start, &openedHostname, &openedSecret));
+}
+
+QTEST_MAIN(TestResumptionTicket)
+#include "tst_resumptionticket.moc"
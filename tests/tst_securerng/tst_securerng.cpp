@@ -0,0 +1,240 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include "utils/SecureRNG.h"
+#include <openssl/rand.h>
+#include <limits.h>
+
+#ifdef Q_OS_UNIX
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+class TestSecureRNG : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void random();
+    void randomInt();
+    void randomIntDistribution();
+    void randomInt64();
+    void randomPrintable();
+    void threads();
+    void fork();
+
+    void benchmarkRandomOpenSSL();
+    void benchmarkRandom();
+    void benchmarkRandomIntOpenSSL();
+    void benchmarkRandomInt();
+};
+
+class RandomThread : public QThread
+{
+public:
+    QByteArray data;
+
+    virtual void run()
+    {
+        data = SecureRNG::random(32);
+    }
+};
+
+void TestSecureRNG::initTestCase()
+{
+    QVERIFY(SecureRNG::seed());
+}
+
+void TestSecureRNG::random()
+{
+    // Buffered and unbuffered sizes, and reads that cross a refill
+    for (int size = 0; size <= 2000; size += 13) {
+        QByteArray a = SecureRNG::random(size);
+        QByteArray b = SecureRNG::random(size);
+        QCOMPARE(a.size(), size);
+        if (size >= 8) {
+            QVERIFY(a != b);
+            QVERIFY(a != QByteArray(size, 0));
+        }
+    }
+
+    // Many small reads, past the reseed interval
+    QSet<QByteArray> seen;
+    for (int i = 0; i < SecureRNG::ReseedInterval / 16 + 1000; i++) {
+        QByteArray a = SecureRNG::random(16);
+        if (i % 100 == 0) {
+            QVERIFY(!seen.contains(a));
+            seen.insert(a);
+        }
+    }
+}
+
+void TestSecureRNG::randomInt()
+{
+    QCOMPARE(SecureRNG::randomInt(0), 0u);
+    QCOMPARE(SecureRNG::randomInt(1), 0u);
+
+    const unsigned maxes[] = { 2, 3, 95, 1000, 0x80000001u, UINT_MAX };
+    for (unsigned max : maxes) {
+        unsigned largest = 0;
+        for (int i = 0; i < 1000; i++) {
+            unsigned value = SecureRNG::randomInt(max);
+            QVERIFY(value < max);
+            largest = qMax(largest, value);
+        }
+        QVERIFY(largest >= max / 2);
+    }
+}
+
+void TestSecureRNG::randomIntDistribution()
+{
+    // Each bucket should be within about 6 standard deviations of 10000
+    const int buckets = 6;
+    int counts[buckets] = { 0 };
+    for (int i = 0; i < buckets * 10000; i++)
+        counts[SecureRNG::randomInt(buckets)]++;
+    for (int i = 0; i < buckets; i++)
+        QVERIFY2(counts[i] > 9450 && counts[i] < 10550, qPrintable(QString::number(counts[i])));
+}
+
+void TestSecureRNG::randomInt64()
+{
+    QCOMPARE(SecureRNG::randomInt64(0), Q_UINT64_C(0));
+    QCOMPARE(SecureRNG::randomInt64(1), Q_UINT64_C(0));
+
+    const quint64 max = Q_UINT64_C(1) << 40;
+    quint64 largest = 0;
+    for (int i = 0; i < 1000; i++) {
+        quint64 value = SecureRNG::randomInt64(max);
+        QVERIFY(value < max);
+        largest = qMax(largest, value);
+    }
+    // Values use more than 32 bits
+    QVERIFY(largest > Q_UINT64_C(0xffffffff));
+
+    for (int i = 0; i < 1000; i++)
+        QVERIFY(SecureRNG::randomInt64(3) < 3);
+}
+
+void TestSecureRNG::randomPrintable()
+{
+    QByteArray text = SecureRNG::randomPrintable(1000);
+    QCOMPARE(text.size(), 1000);
+    foreach (char c, text)
+        QVERIFY(c >= 32 && c < 127);
+}
+
+void TestSecureRNG::threads()
+{
+    RandomThread a, b;
+    a.start();
+    b.start();
+    QVERIFY(a.wait(10000));
+    QVERIFY(b.wait(10000));
+    QCOMPARE(a.data.size(), 32);
+    QVERIFY(a.data != b.data);
+    QVERIFY(a.data != SecureRNG::random(32));
+}
+
+/* After a fork, the parent and child must not return the same data */
+void TestSecureRNG::fork()
+{
+#ifdef Q_OS_UNIX
+    // Make sure this thread's buffer has data left to be repeated
+    SecureRNG::random(16);
+
+    int fds[2];
+    QVERIFY(pipe(fds) == 0);
+
+    pid_t pid = ::fork();
+    QVERIFY(pid >= 0);
+    if (pid == 0) {
+        QByteArray data = SecureRNG::random(32);
+        ssize_t r = write(fds[1], data.constData(), data.size());
+        _exit(r == data.size() ? 0 : 1);
+    }
+
+    QByteArray data = SecureRNG::random(32);
+    QByteArray childData(32, 0);
+    ssize_t r = read(fds[0], childData.data(), childData.size());
+    int status = 0;
+    waitpid(pid, &status, 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    QCOMPARE(int(r), 32);
+    QVERIFY(data != childData);
+#else
+    QSKIP("fork is not available on this platform");
+#endif
+}
+
+void TestSecureRNG::benchmarkRandomOpenSSL()
+{
+    unsigned char buf[16];
+    QBENCHMARK {
+        RAND_bytes(buf, sizeof(buf));
+    }
+}
+
+void TestSecureRNG::benchmarkRandom()
+{
+    char buf[16];
+    QBENCHMARK {
+        SecureRNG::random(buf, sizeof(buf));
+    }
+}
+
+/* randomInt as it was before buffering */
+void TestSecureRNG::benchmarkRandomIntOpenSSL()
+{
+    const unsigned max = 95;
+    unsigned cutoff = UINT_MAX - (UINT_MAX % max);
+    QBENCHMARK {
+        unsigned value = 0;
+        do {
+            RAND_bytes(reinterpret_cast<unsigned char*>(&value), sizeof(value));
+        } while (value >= cutoff);
+    }
+}
+
+void TestSecureRNG::benchmarkRandomInt()
+{
+    QBENCHMARK {
+        SecureRNG::randomInt(95);
+    }
+}
+
+QTEST_MAIN(TestSecureRNG)
+#include "tst_securerng.moc"
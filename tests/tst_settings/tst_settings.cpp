@@ -0,0 +1,284 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include <QTemporaryDir>
+#include <QJsonDocument>
+#include "utils/Settings.h"
+
+class TestSettings : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void init();
+    void debounce();
+    void maxLatency();
+    void flush();
+    void unchanged();
+    void destroy();
+    void journal();
+    void journalReplay();
+    void journalDamaged();
+    void journalCompaction();
+    void journalUpgrade();
+
+private:
+    QScopedPointer<QTemporaryDir> dir;
+
+    QString filePath() const { return dir->path() + QStringLiteral("/settings.json"); }
+    QString journalPath() const { return filePath() + QStringLiteral(".journal"); }
+    void writeJournal(const QByteArray &data);
+    QJsonObject fileData() const;
+};
+
+void TestSettings::init()
+{
+    dir.reset(new QTemporaryDir);
+    QVERIFY(dir->isValid());
+}
+
+QJsonObject TestSettings::fileData() const
+{
+    QFile file(filePath());
+    if (!file.open(QIODevice::ReadOnly))
+        return QJsonObject();
+    return QJsonDocument::fromJson(file.readAll()).object();
+}
+
+/* A burst of changes is written once */
+void TestSettings::debounce()
+{
+    SettingsFile settings;
+    QVERIFY(settings.setFilePath(filePath()));
+    settings.setSyncDelay(100, 5000);
+
+    for (int i = 0; i < 50; i++)
+        settings.root()->write("count", i);
+    QVERIFY(settings.hasPendingChanges());
+    QCOMPARE(settings.syncStatistics().syncCount, 0);
+
+    QTRY_VERIFY(!settings.hasPendingChanges());
+    SettingsFile::SyncStatistics statistics = settings.syncStatistics();
+    QCOMPARE(statistics.syncCount, 1);
+    QCOMPARE(statistics.changeCount, 50);
+    QVERIFY(statistics.lastSyncBytes > 0);
+    QCOMPARE(statistics.bytesWritten, statistics.lastSyncBytes);
+    QCOMPARE(statistics.lastSyncBytes, QFileInfo(filePath()).size());
+    QCOMPARE(fileData().value("count").toInt(), 49);
+}
+
+/* Continuous changes are still written within the latency bound */
+void TestSettings::maxLatency()
+{
+    SettingsFile settings;
+    QVERIFY(settings.setFilePath(filePath()));
+    settings.setSyncDelay(200, 300);
+
+    QElapsedTimer timer;
+    timer.start();
+    int i = 0;
+    while (settings.syncStatistics().syncCount == 0 && timer.elapsed() < 5000) {
+        settings.root()->write("count", i++);
+        QTest::qWait(20);
+    }
+
+    QCOMPARE(settings.syncStatistics().syncCount, 1);
+    QVERIFY(timer.elapsed() < 1000);
+}
+
+void TestSettings::flush()
+{
+    SettingsFile settings;
+    QVERIFY(settings.setFilePath(filePath()));
+    settings.setSyncDelay(10000, 10000);
+
+    settings.root()->write("key", QStringLiteral("value"));
+    QVERIFY(fileData().isEmpty());
+    QVERIFY(settings.root()->flush());
+    QVERIFY(!settings.hasPendingChanges());
+    QCOMPARE(fileData().value("key").toString(), QStringLiteral("value"));
+
+    // Nothing left to write
+    QVERIFY(settings.flush());
+    QCOMPARE(settings.syncStatistics().syncCount, 1);
+}
+
+void TestSettings::unchanged()
+{
+    SettingsFile settings;
+    QVERIFY(settings.setFilePath(filePath()));
+    settings.root()->write("key", true);
+    QVERIFY(settings.flush());
+
+    // Writing the same value again isn't a change
+    settings.root()->write("key", true);
+    QVERIFY(!settings.hasPendingChanges());
+}
+
+void TestSettings::destroy()
+{
+    {
+        SettingsFile settings;
+        QVERIFY(settings.setFilePath(filePath()));
+        settings.setSyncDelay(10000, 10000);
+        settings.root()->write("key", 1);
+    }
+
+    QCOMPARE(fileData().value("key").toInt(), 1);
+}
+
+void TestSettings::writeJournal(const QByteArray &data)
+{
+    QFile file(journalPath());
+    QVERIFY(file.open(QIODevice::WriteOnly));
+    QCOMPARE(file.write(data), qint64(data.size()));
+}
+
+/* Changes are appended to the journal, not the file */
+void TestSettings::journal()
+{
+    SettingsFile settings;
+    settings.setJournaled(true);
+    QVERIFY(settings.setFilePath(filePath()));
+    settings.root()->write("big", QString(1000, QLatin1Char('x')));
+    QVERIFY(settings.flush());
+
+    settings.root()->write("contacts.1.lastConnected", 1234);
+    QVERIFY(settings.flush());
+    QVERIFY(settings.syncStatistics().lastSyncBytes < 100);
+    QVERIFY(fileData().isEmpty());
+    QVERIFY(QFile::exists(journalPath()));
+
+    settings.root()->unset("big");
+    QVERIFY(settings.flush());
+    QCOMPARE(settings.syncStatistics().syncCount, 3);
+}
+
+void TestSettings::journalReplay()
+{
+    SettingsFile settings;
+    settings.setJournaled(true);
+    QVERIFY(settings.setFilePath(filePath()));
+    settings.root()->write("a.b", 1);
+    settings.root()->write("a.c", QStringLiteral("two"));
+    QVERIFY(settings.flush());
+    settings.root()->write("d", true);
+    settings.root()->unset("a.b");
+    QVERIFY(settings.flush());
+
+    // Another instance sees the same data, and compacts the journal
+    SettingsFile settings2;
+    QVERIFY(settings2.setFilePath(filePath()));
+    QCOMPARE(settings2.root()->data(), settings.root()->data());
+    QVERIFY(!QFile::exists(journalPath()));
+    QCOMPARE(fileData(), settings.root()->data());
+}
+
+/* Replay stops at anything that isn't a complete record */
+void TestSettings::journalDamaged()
+{
+    writeJournal("{\"path\":[\"a\"],\"value\":1}\n"
+                 "{\"path\":[\"b\"],\"value\":2}\n"
+                 "{\"path\":[\"c\"],\"val");
+    {
+        SettingsFile settings;
+        QVERIFY(settings.setFilePath(filePath()));
+        QCOMPARE(settings.root()->read("a").toInt(), 1);
+        QCOMPARE(settings.root()->read("b").toInt(), 2);
+        QVERIFY(settings.root()->read("c").isUndefined());
+    }
+
+    writeJournal("{\"path\":[\"a\"],\"value\":3}\n"
+                 "garbage\n"
+                 "{\"path\":[\"b\"],\"value\":4}\n");
+    SettingsFile settings;
+    QVERIFY(settings.setFilePath(filePath()));
+    QCOMPARE(settings.root()->read("a").toInt(), 3);
+    QCOMPARE(settings.root()->read("b").toInt(), 2);
+}
+
+void TestSettings::journalCompaction()
+{
+    {
+        SettingsFile settings;
+        settings.setJournaled(true);
+        QVERIFY(settings.setFilePath(filePath()));
+
+        // Compacted once the journal is large enough
+        QString value(1000, QLatin1Char('x'));
+        int i = 0;
+        for (; i < 200 && !QFile::exists(journalPath()); i++) {
+            settings.root()->write("value", value + QString::number(i));
+            QVERIFY(settings.flush());
+        }
+        QVERIFY(QFile::exists(journalPath()));
+        for (; i < 200 && QFile::exists(journalPath()); i++) {
+            settings.root()->write("value", value + QString::number(i));
+            QVERIFY(settings.flush());
+        }
+        QVERIFY(!QFile::exists(journalPath()));
+        QVERIFY(!fileData().isEmpty());
+
+        settings.root()->write("last", true);
+        QVERIFY(settings.flush());
+        QVERIFY(QFile::exists(journalPath()));
+    }
+
+    // And when destroyed
+    QVERIFY(!QFile::exists(journalPath()));
+    QCOMPARE(fileData().value("last").toBool(), true);
+}
+
+/* A file written without a journal is read as before */
+void TestSettings::journalUpgrade()
+{
+    {
+        SettingsFile settings;
+        QVERIFY(settings.setFilePath(filePath()));
+        settings.root()->write("key", 1);
+    }
+
+    SettingsFile settings;
+    settings.setJournaled(true);
+    QVERIFY(settings.setFilePath(filePath()));
+    QCOMPARE(settings.root()->read("key").toInt(), 1);
+    settings.root()->write("key", 2);
+    QVERIFY(settings.flush());
+
+    SettingsFile settings2;
+    QVERIFY(settings2.setFilePath(filePath()));
+    QCOMPARE(settings2.root()->read("key").toInt(), 2);
+}
+
+QTEST_GUILESS_MAIN(TestSettings)
+#include "tst_settings.moc"
@@ -0,0 +1,6 @@
+include(../tests.pri)
+
+SOURCES += tst_settings.cpp \
+    $${SRC}/utils/Settings.cpp
+
+HEADERS += $${SRC}/utils/Settings.h
@@ -0,0 +1,317 @@
+/* Ricochet - https://ricochet.im/
+ * Copyright (C) 2014, John Brooks <john.brooks@dereferenced.net>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *
+ *    * Redistributions in binary form must reproduce the above
+ *      copyright notice, this list of conditions and the following disclaimer
+ *      in the documentation and/or other materials provided with the
+ *      distribution.
+ *
+ *    * Neither the names of the copyright owners nor the names of its
+ *      contributors may be used to endorse or promote products derived from
+ *      this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <QtTest>
+#include "utils/Utf8.h"
+
+class TestUtf8 : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void decodeShortSequences();
+    void decode_data();
+    void decode();
+    void decodeRandom();
+    void encodeCharacters();
+    void encode_data();
+    void encode();
+    void encodeRandom();
+
+    void benchmarkDecodeQt_data();
+    void benchmarkDecodeQt();
+    void benchmarkDecode_data();
+    void benchmarkDecode();
+    void benchmarkEncodeQt_data();
+    void benchmarkEncodeQt();
+    void benchmarkEncode_data();
+    void benchmarkEncode();
+};
+
+static QString decoded(const QByteArray &data)
+{
+    return utf8ToString(data.constData(), data.size());
+}
+
+static QByteArray encoded(const QString &string)
+{
+    QByteArray re(utf8MaxSize(string.size()), 0);
+    int size = stringToUtf8(string, re.data());
+    if (size < 0)
+        return QByteArray("<failed>");
+    re.truncate(size);
+    return re;
+}
+
+/* Compare against QString::fromUtf8 without repeating the input in the output on success */
+#define COMPARE_DECODE(data) \
+    do { \
+        QByteArray d_ = (data); \
+        if (decoded(d_) != QString::fromUtf8(d_.constData(), d_.size())) \
+            QFAIL(qPrintable(QStringLiteral("Decoding differs from Qt for: %1").arg(QString::fromLatin1(d_.toHex())))); \
+    } while (0)
+
+#define COMPARE_ENCODE(string) \
+    do { \
+        QString s_ = (string); \
+        if (encoded(s_) != s_.toUtf8()) \
+            QFAIL(qPrintable(QStringLiteral("Encoding differs from Qt for: %1").arg(QString::fromLatin1(QByteArray(reinterpret_cast<const char*>(s_.utf16()), s_.size() * 2).toHex())))); \
+    } while (0)
+
+void TestUtf8::decodeShortSequences()
+{
+    // Every sequence of one or two bytes, and every three and four byte
+    // sequence with a multibyte lead, with and without ASCII around it
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            QByteArray data;
+            data.append(char(a));
+            data.append(char(b));
+            COMPARE_DECODE(data);
+            COMPARE_DECODE("0123456789abcdef" + data + "0123456789abcdef");
+
+            if (a < 0xe0 || a > 0xf7)
+                continue;
+            for (int c = 0; c < 256; c += 0x3f) {
+                QByteArray three = data;
+                three.append(char(c));
+                COMPARE_DECODE(three);
+                three.append(char(0x80));
+                COMPARE_DECODE(three);
+            }
+        }
+    }
+}
+
+void TestUtf8::decode_data()
+{
+    QTest::addColumn<QByteArray>("data");
+
+    QTest::newRow("empty") << QByteArray();
+    QTest::newRow("ascii") << QByteArray("The quick brown fox jumps over the lazy dog");
+    QTest::newRow("nul") << QByteArray("a\0b", 3);
+    QTest::newRow("two byte") << QByteArray("Gr\xC3\xBC\xC3\x9F" "e");
+    QTest::newRow("three byte") << QByteArray("\xE4\xB8\x96\xE7\x95\x8C");
+    QTest::newRow("four byte") << QByteArray("\xF0\x9F\x98\x80\xF4\x8F\xBF\xBD");
+    QTest::newRow("byte order mark") << QByteArray("\xEF\xBB\xBFtext");
+    QTest::newRow("inner byte order mark") << QByteArray("text\xEF\xBB\xBFtext");
+    QTest::newRow("overlong nul") << QByteArray("\xC0\x80");
+    QTest::newRow("overlong three byte") << QByteArray("\xE0\x80\xAF");
+    QTest::newRow("overlong four byte") << QByteArray("\xF0\x80\x80\xAF");
+    QTest::newRow("surrogate") << QByteArray("\xED\xA0\x80\xED\xB0\x80");
+    QTest::newRow("above U+10FFFF") << QByteArray("\xF4\x90\x80\x80");
+    QTest::newRow("five byte") << QByteArray("\xF8\x88\x80\x80\x80");
+    QTest::newRow("lone continuation") << QByteArray("abc\x80" "def");
+    QTest::newRow("truncated") << QByteArray("abc\xE4\xB8");
+    QTest::newRow("interrupted") << QByteArray("\xE4" "abc");
+    QTest::newRow("noncharacter") << QByteArray("\xEF\xBF\xBE");
+    QTest::newRow("noncharacter U+FDD0") << QByteArray("\xEF\xB7\x90");
+    QTest::newRow("noncharacter U+10FFFF") << QByteArray("\xF4\x8F\xBF\xBF");
+    QTest::newRow("invalid after ascii run") << (QByteArray(40, 'x') + "\xFF" + QByteArray(40, 'y'));
+}
+
+void TestUtf8::decode()
+{
+    QFETCH(QByteArray, data);
+    QCOMPARE(decoded(data), QString::fromUtf8(data.constData(), data.size()));
+}
+
+void TestUtf8::decodeRandom()
+{
+    static const char *const pieces[] = {
+        "a", "hello, ", "0123456789abcdef0", "\xC3\xA9", "\xD0\xBC\xD0\xB8\xD1\x80",
+        "\xE4\xB8\x96", "\xF0\x9F\x98\x80", "\xED\xA0\x80", "\xC0\x80", "\x80", "\xFF",
+        "\xC3", "\xE4\xB8", "\xEF\xBF\xBD"
+    };
+    const int pieceCount = sizeof(pieces) / sizeof(pieces[0]);
+
+    qsrand(1);
+    for (int i = 0; i < 100000; i++) {
+        QByteArray data;
+        int count = qrand() % 16;
+        for (int j = 0; j < count; j++)
+            data.append(pieces[qrand() % pieceCount]);
+        if (!data.isEmpty() && qrand() % 4 == 0)
+            data[qrand() % data.size()] = char(qrand());
+        COMPARE_DECODE(data);
+    }
+}
+
+void TestUtf8::encodeCharacters()
+{
+    for (int u = 0; u <= 0xffff; u++) {
+        COMPARE_ENCODE(QString(QChar(u)));
+        COMPARE_ENCODE(QStringLiteral("abcdefgh") + QChar(u) + QStringLiteral("abcdefgh"));
+    }
+
+    for (uint ucs4 = 0x10000; ucs4 <= 0x10ffff; ucs4 += 0xff) {
+        QChar pair[] = { QChar(QChar::highSurrogate(ucs4)), QChar(QChar::lowSurrogate(ucs4)) };
+        COMPARE_ENCODE(QString(pair, 2));
+    }
+}
+
+void TestUtf8::encode_data()
+{
+    QTest::addColumn<QString>("string");
+
+    QTest::newRow("empty") << QString();
+    QTest::newRow("ascii") << QStringLiteral("The quick brown fox jumps over the lazy dog");
+    QTest::newRow("multilingual") << QString::fromUtf8("Gr\xC3\xBC\xC3\x9F" "e, \xD0\xBC\xD0\xB8\xD1\x80, \xE4\xB8\x96\xE7\x95\x8C \xF0\x9F\x98\x80");
+    QTest::newRow("lone high surrogate") << (QStringLiteral("abc") + QChar(0xd800) + QStringLiteral("def"));
+    QTest::newRow("lone low surrogate") << (QStringLiteral("abc") + QChar(0xdc00));
+    QTest::newRow("trailing high surrogate") << (QStringLiteral("abc") + QChar(0xd83d));
+    QTest::newRow("reversed pair") << (QString(QChar(0xde00)) + QChar(0xd83d));
+    QTest::newRow("noncharacter") << QString(QChar(0xfffe));
+}
+
+void TestUtf8::encode()
+{
+    QFETCH(QString, string);
+    QCOMPARE(encoded(string), string.toUtf8());
+}
+
+void TestUtf8::encodeRandom()
+{
+    static const ushort units[] = {
+        0x41, 0x7f, 0x80, 0x7ff, 0x800, 0x43c, 0x4e16, 0xfffd, 0xffff, 0xfdd0,
+        0xd800, 0xdbff, 0xdc00, 0xdfff, 0xd83d, 0xde00
+    };
+    const int unitCount = sizeof(units) / sizeof(units[0]);
+
+    qsrand(1);
+    for (int i = 0; i < 100000; i++) {
+        QString string;
+        int count = qrand() % 24;
+        for (int j = 0; j < count; j++) {
+            if (qrand() % 2)
+                string.append(QString(qrand() % 12 + 1, QLatin1Char('a')));
+            else
+                string.append(QChar(units[qrand() % unitCount]));
+        }
+        COMPARE_ENCODE(string);
+    }
+}
+
+/* Typical chat messages in a few scripts, repeated up to the size of a long message */
+static void addCorpora()
+{
+    QTest::addColumn<QByteArray>("data");
+
+    static const char *const corpora[][2] = {
+        { "english", "Are you around later? I pushed the fix for the build, let me know if it works for you. " },
+        { "german", "K\xC3\xB6nnen wir uns morgen treffen? Ich habe die \xC3\x9C" "bersetzung fast fertig, gr\xC3\xBC\xC3\x9F" "e! " },
+        { "russian", "\xD0\x9F\xD1\x80\xD0\xB8\xD0\xB2\xD0\xB5\xD1\x82, \xD0\xBA\xD0\xB0\xD0\xBA \xD0\xB4\xD0\xB5\xD0\xBB\xD0\xB0? "
+                     "\xD0\xA3\xD0\xB2\xD0\xB8\xD0\xB4\xD0\xB8\xD0\xBC\xD1\x81\xD1\x8F \xD0\xB7\xD0\xB0\xD0\xB2\xD1\x82\xD1\x80\xD0\xB0. " },
+        { "chinese", "\xE4\xBD\xA0\xE5\xA5\xBD\xEF\xBC\x8C\xE6\x98\x8E\xE5\xA4\xA9\xE8\xA7\x81\xE3\x80\x82"
+                     "\xE6\x88\x91\xE5\xB7\xB2\xE7\xBB\x8F\xE5\x8F\x91\xE9\x80\x81\xE4\xBA\x86\xE6\x96\x87\xE4\xBB\xB6\xE3\x80\x82" },
+        { "arabic", "\xD9\x85\xD8\xB1\xD8\xAD\xD8\xA8\xD8\xA7\xD8\x8C \xD9\x83\xD9\x8A\xD9\x81 \xD8\xAD\xD8\xA7\xD9\x84\xD9\x83\xD8\x9F "
+                    "\xD8\xA3\xD8\xB1\xD8\xA7\xD9\x83 \xD8\xBA\xD8\xAF\xD8\xA7. " },
+        { "emoji", "ok \xF0\x9F\x91\x8D see you soon \xF0\x9F\x98\x80\xF0\x9F\x8E\x89 " }
+    };
+
+    for (unsigned i = 0; i < sizeof(corpora) / sizeof(corpora[0]); i++) {
+        QByteArray text(corpora[i][1]);
+        QTest::newRow(QByteArray(corpora[i][0]) + " short") << text;
+
+        QByteArray longText;
+        while (QString::fromUtf8(longText + text).size() <= 2000)
+            longText += text;
+        QTest::newRow(QByteArray(corpora[i][0]) + " long") << longText;
+    }
+}
+
+void TestUtf8::benchmarkDecodeQt_data()
+{
+    addCorpora();
+}
+
+void TestUtf8::benchmarkDecodeQt()
+{
+    QFETCH(QByteArray, data);
+    QString text;
+    QBENCHMARK {
+        text = QString::fromUtf8(data.constData(), data.size());
+    }
+    QVERIFY(!text.isEmpty());
+}
+
+void TestUtf8::benchmarkDecode_data()
+{
+    addCorpora();
+}
+
+void TestUtf8::benchmarkDecode()
+{
+    QFETCH(QByteArray, data);
+    QString text;
+    QBENCHMARK {
+        text = utf8ToString(data.constData(), data.size());
+    }
+    QCOMPARE(text, QString::fromUtf8(data));
+}
+
+void TestUtf8::benchmarkEncodeQt_data()
+{
+    addCorpora();
+}
+
+void TestUtf8::benchmarkEncodeQt()
+{
+    QFETCH(QByteArray, data);
+    QString text = QString::fromUtf8(data);
+    QByteArray out(utf8MaxSize(text.size()), 0);
+    QBENCHMARK {
+        // As sending did before, through an intermediate copy
+        std::string utf8 = text.toStdString();
+        memcpy(out.data(), utf8.data(), utf8.size());
+    }
+}
+
+void TestUtf8::benchmarkEncode_data()
+{
+    addCorpora();
+}
+
+void TestUtf8::benchmarkEncode()
+{
+    QFETCH(QByteArray, data);
+    QString text = QString::fromUtf8(data);
+    QByteArray out(utf8MaxSize(text.size()), 0);
+    int size = 0;
+    QBENCHMARK {
+        size = stringToUtf8(text, out.data());
+    }
+    QCOMPARE(out.left(size), data);
+}
+
+QTEST_MAIN(TestUtf8)
+#include "tst_utf8.moc"
@@ -0,0 +1,4 @@
+include(../tests.pri)
+
+SOURCES += tst_utf8.cpp \
+    $${SRC}/utils/Utf8.cpp
@@ -0,0 +1,18 @@
+# zlib, for compressed channels
+#
+# Qt either links to the system zlib, or bundles a copy in QtCore and exports
+# its symbols (see buildscripts/mingw for a fix needed by older versions). Use
+# the same one as Qt, so that static builds don't need another dependency.
+
+contains(QT_CONFIG, system-zlib) {
+    unix:!contains(QT_CONFIG, no-pkg-config) {
+        CONFIG += link_pkgconfig
+        PKGCONFIG += zlib
+    } else:win32-msvc* {
+        LIBS += -lzdll
+    } else {
+        LIBS += -lz
+    }
+} else {
+    INCLUDEPATH += $$[QT_INSTALL_HEADERS]/QtZlib
+}